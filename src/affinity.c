@@ -0,0 +1,163 @@
+/*
+ * affinity.c
+ *
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "affinity.h"
+#include <sched.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* from <linux/mempolicy.h>, which libc doesn't expose */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+
+#define NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+
+
+static inline gint *ja_cpu_set_to_list(cpu_set_t * set, gint * count)
+{
+    gint n = CPU_COUNT(set);
+    if (n == 0) {
+        return NULL;
+    }
+    gint *cpus = g_new(gint, n);
+    gint i, j = 0;
+    for (i = 0; i < CPU_SETSIZE && j < n; i++) {
+        if (CPU_ISSET(i, set)) {
+            cpus[j++] = i;
+        }
+    }
+    *count = n;
+    return cpus;
+}
+
+static inline gboolean ja_cpu_parse_number(const gchar * s, gint * cpu)
+{
+    gchar *end = NULL;
+    gint64 n = g_ascii_strtoll(s, &end, 10);
+    if (end == s || n < 0 || n >= CPU_SETSIZE) {
+        return FALSE;
+    }
+    *cpu = (gint) n;
+    return *end == '\0';
+}
+
+gint *ja_cpu_list_parse(const gchar * list, gint * count)
+{
+    if (list == NULL) {
+        return NULL;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    gchar **ranges = g_strsplit(list, ",", -1);
+    gint i;
+    for (i = 0; ranges[i]; i++) {
+        gchar *range = g_strstrip(ranges[i]);
+        gchar *dash = strchr(range, '-');
+        gint first, last;
+        if (dash) {
+            *dash = '\0';
+            if (!ja_cpu_parse_number(range, &first) ||
+                !ja_cpu_parse_number(dash + 1, &last) || first > last) {
+                g_strfreev(ranges);
+                return NULL;
+            }
+        } else if (ja_cpu_parse_number(range, &first)) {
+            last = first;
+        } else {
+            g_strfreev(ranges);
+            return NULL;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, &set);
+        }
+    }
+    g_strfreev(ranges);
+    return ja_cpu_set_to_list(&set, count);
+}
+
+gint *ja_numa_node_cpus(gint node, gint * count)
+{
+    gchar path[128];
+    gchar *content = NULL;
+    g_snprintf(path, sizeof(path), NODE_CPULIST, node);
+    if (node < 0 || !g_file_get_contents(path, &content, NULL, NULL)) {
+        return NULL;
+    }
+    gint *cpus = ja_cpu_list_parse(g_strstrip(content), count);
+    g_free(content);
+    return cpus;
+}
+
+static inline void ja_cpu_list_to_set(const gint * cpus, gint count,
+                                      cpu_set_t * set)
+{
+    CPU_ZERO(set);
+    gint i;
+    for (i = 0; i < count; i++) {
+        CPU_SET(cpus[i], set);
+    }
+}
+
+gboolean ja_cpu_set_process(const gint * cpus, gint count)
+{
+    cpu_set_t set;
+    ja_cpu_list_to_set(cpus, count, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        g_warning("fail to set CPU affinity: %s", g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean ja_cpu_pin_thread(gint cpu)
+{
+    cpu_set_t set;
+    ja_cpu_list_to_set(&cpu, 1, &set);
+    gint err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        g_warning("fail to pin thread to CPU %d: %s", cpu, g_strerror(err));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean ja_numa_prefer_node(gint node)
+{
+#ifdef SYS_set_mempolicy
+    gulong mask[CPU_SETSIZE / (8 * sizeof(gulong))] = { 0 };
+    if (node < 0 || node >= CPU_SETSIZE) {
+        return FALSE;
+    }
+    mask[node / (8 * sizeof(gulong))] |= 1UL << (node % (8 * sizeof(gulong)));
+    /* preferred, not bound, so a full node doesn't fail the allocation */
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                (gulong) CPU_SETSIZE + 1) == 0) {
+        return TRUE;
+    }
+    g_warning("fail to prefer memory of node %d: %s", node,
+              g_strerror(errno));
+#endif
+    return FALSE;
+}
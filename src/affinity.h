@@ -0,0 +1,59 @@
+/*
+ * affinity.h
+ *
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __JA_AFFINITY_H__
+#define __JA_AFFINITY_H__
+
+#include <glib.h>
+
+/*
+ * CPU and NUMA placement of the server process and its workers
+ * CPUs are listed as arrays of CPU numbers, sorted, freed by g_free()
+ */
+
+
+/*
+ * Parses a CPU list like "0-3,8,10-11", the format of cpuset(7)
+ * Returns NULL if the list is invalid or empty
+ */
+gint *ja_cpu_list_parse(const gchar * list, gint * count);
+
+/*
+ * Gets the CPUs of the NUMA node, from sysfs
+ * Returns NULL if there is no such node
+ */
+gint *ja_numa_node_cpus(gint node, gint * count);
+
+/*
+ * Restricts the current process (all its threads created later) to cpus
+ */
+gboolean ja_cpu_set_process(const gint * cpus, gint count);
+
+/*
+ * Pins the calling thread to the CPU
+ */
+gboolean ja_cpu_pin_thread(gint cpu);
+
+/*
+ * Prefers the memory of the NUMA node for the calling thread
+ * and the threads created by it later
+ */
+gboolean ja_numa_prefer_node(gint node);
+
+
+#endif
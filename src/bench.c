@@ -0,0 +1,543 @@
+/*
+ * bench.c
+ *
+ * Copyright (C) 2015 - Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the request path
+ *
+ * A client pipelines requests to a JSocket through a socketpair,
+ * the requests are handled the way a worker does: parsed in place,
+ * wrapped in JaRequest, responded and writen back with the write queue.
+ * malloc() is counted after warming up, it should be zero,
+ * since JSocket, JaRequest and their buffers come from JPool.
+ * The slabs mapped should be zero too, even if the requests are so large
+ * that the read buffer grows past the biggest class of JPool.
+ *
+ * In stream mode, large responses are sent through TCP loopback,
+ * copied and with MSG_ZEROCOPY, the CPU time of sending thread per GB
+ * is compared.
+ *
+ * In push mode, threads push frames by ja_push() to the connections of
+ * a worker, a client thread reads them all; the pushes refused because
+ * a connection is overloaded are counted.
+ *
+ * Usage: bench [requests] [pipeline] [request size]
+ *        bench stream [response size] [megabytes]
+ *        bench push [connections] [pushes] [frame size] [threads]
+ */
+
+#include "io/jio.h"
+#include "io/pack.h"
+#include "jac/jac.h"
+#include "jconf/jconf.h"
+#include "worker.h"
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/* count the calls of malloc family */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 malloc_count = 0;
+
+void *malloc(size_t size)
+{
+    malloc_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    malloc_count++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    malloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+
+#define WARMUP_ROUNDS   1000
+#define REQUEST_SIZE    64
+
+static gsize request_size = REQUEST_SIZE;
+
+static void queue_segment(const JaResponseSegment * seg, gpointer user_data)
+{
+    if (ja_response_segment_is_file(seg)) {
+        j_socket_queue_file((JSocket *) user_data, seg->fd, seg->offset,
+                            seg->len, seg->destroy, seg->destroy_data);
+        return;
+    }
+    j_socket_queue((JSocket *) user_data, seg->data, seg->len,
+                   seg->destroy, seg->destroy_data);
+}
+
+/*
+ * Sends pipeline requests and handles them, returns the bytes of responses
+ */
+static gsize bench_round(JSocket * server, gint client,
+                         const gchar * requests, gsize length,
+                         gchar * buf, gsize size)
+{
+    if (write(client, requests, length) != length) {
+        g_error("fail to write requests");
+    }
+    gint ret;
+    while ((ret = j_socket_recv(server)) > 0) {
+        while (j_socket_next_package(server) > 0) {
+            JaRequest *req = ja_request_borrow(j_socket_data(server),
+                                               j_socket_data_length(server),
+                                               NULL, 0);
+            ja_response_append(req, "hello all", 9);
+            j_socket_queue_header(server, ja_response_data_length(req));
+            ja_response_take(req, queue_segment, server);
+            ja_request_free(req);
+        }
+        if (j_socket_unparsed_length(server) == 0) {
+            break;
+        }
+    }
+    if (ret < 0 || j_socket_flush(server) != 1) {
+        g_error("fail to handle requests");
+    }
+
+    gsize total = 0;
+    gsize expected = 13 * (length / (request_size + 4));
+    while (total < expected) {
+        gssize n = read(client, buf, size);
+        if (n <= 0) {
+            g_error("fail to read responses");
+        }
+        total += n;
+    }
+    return total;
+}
+
+
+/* the buffers of responses in stream mode, reused after released */
+#define STREAM_BUFFERS  64
+
+static gpointer stream_buffers[STREAM_BUFFERS];
+static guint stream_free = 0;
+
+static void stream_release(gpointer data)
+{
+    stream_buffers[stream_free++] = data;
+}
+
+static gpointer stream_reader(gpointer data)
+{
+    gint fd = GPOINTER_TO_INT(data);
+    gchar buf[256 * 1024];
+    while (read(fd, buf, sizeof(buf)) > 0);
+    return NULL;
+}
+
+/* CPU time of current thread, in seconds */
+static gdouble bench_cpu_time(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * Connects a pair of TCP sockets through loopback
+ */
+static void bench_tcp_pair(gint sv[2])
+{
+    gint listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *) &addr, &addrlen) < 0) {
+        g_error("fail to listen on loopback");
+    }
+    sv[1] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sv[1], (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        (sv[0] = accept(listenfd, NULL, NULL)) < 0) {
+        g_error("fail to connect through loopback");
+    }
+    close(listenfd);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+}
+
+/*
+ * Waits until the socket is writable, or the acknowledgements of
+ * MSG_ZEROCOPY arrive
+ */
+static void bench_stream_wait(JSocket * jsock)
+{
+    struct pollfd pfd;
+    pfd.fd = j_socket_fd(jsock);
+    pfd.events = j_socket_write_pending(jsock) ? POLLOUT : 0;
+    if (poll(&pfd, 1, -1) < 0) {
+        g_error("fail to poll");
+    }
+    if ((pfd.revents & POLLERR) && j_socket_zerocopy_complete(jsock) < 0) {
+        g_error("fail to send");
+    }
+}
+
+/*
+ * Streams total bytes of responses of size bytes,
+ * with MSG_ZEROCOPY if zerocopy is TRUE
+ * Returns the CPU seconds of sending, negative if not supported
+ */
+static gdouble bench_stream(gsize size, guint64 total, gboolean zerocopy)
+{
+    gint sv[2];
+    bench_tcp_pair(sv);
+    JSocket *jsock = j_socket_new_fromfd(sv[0], NULL, 0);
+    if (zerocopy && !j_socket_set_zerocopy(jsock, size)) {
+        j_socket_close(jsock);
+        close(sv[1]);
+        return -1;
+    }
+    GThread *reader = g_thread_new("reader", stream_reader,
+                                   GINT_TO_POINTER(sv[1]));
+
+    gdouble start = bench_cpu_time();
+    guint64 sent = 0;
+    while (sent < total) {
+        while (stream_free == 0) {  /* all are being sent */
+            bench_stream_wait(jsock);
+            if (j_socket_flush(jsock) < 0) {
+                g_error("fail to send");
+            }
+        }
+        gpointer data = stream_buffers[--stream_free];
+        j_socket_queue_header(jsock, size);
+        j_socket_queue(jsock, data, size, stream_release, data);
+        if (j_socket_flush(jsock) < 0) {
+            g_error("fail to send");
+        }
+        sent += size;
+    }
+    while (j_socket_write_pending(jsock)
+           || j_socket_zerocopy_pending(jsock)) {
+        bench_stream_wait(jsock);
+        if (j_socket_flush(jsock) < 0) {
+            g_error("fail to send");
+        }
+    }
+    gdouble cpu = bench_cpu_time() - start;
+
+    shutdown(sv[0], SHUT_WR);
+    g_thread_join(reader);
+    j_socket_close(jsock);
+    close(sv[1]);
+    return cpu;
+}
+
+static gint bench_stream_main(gint argc, const char *argv[])
+{
+    gsize size = 512 * 1024;
+    guint64 megabytes = 4096;
+    if (argc > 2) {
+        size = g_ascii_strtoull(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        megabytes = g_ascii_strtoull(argv[3], NULL, 10);
+    }
+    if (size == 0 || megabytes == 0) {
+        g_printf("Usage: %s stream [response size] [megabytes]\n",
+                 argv[0]);
+        return 1;
+    }
+    guint i;
+    for (i = 0; i < STREAM_BUFFERS; i++) {
+        stream_buffers[i] = g_malloc(size);
+        memset(stream_buffers[i], 'a' + i % 26, size);
+    }
+    stream_free = STREAM_BUFFERS;
+
+    guint64 total = megabytes * 1024 * 1024;
+    gdouble gb = total / (1024.0 * 1024 * 1024);
+    g_printf("response size: %" G_GSIZE_FORMAT ", sent: %" G_GUINT64_FORMAT
+             "MB\n", size, megabytes);
+    gdouble copy = bench_stream(size, total, FALSE);
+    g_printf("copy: %.3fs CPU, %.3fs per GB\n", copy, copy / gb);
+    gdouble zerocopy = bench_stream(size, total, TRUE);
+    if (zerocopy < 0) {
+        g_printf("zerocopy: not supported\n");
+    } else {
+        g_printf("zerocopy: %.3fs CPU, %.3fs per GB\n", zerocopy,
+                 zerocopy / gb);
+    }
+    for (i = 0; i < STREAM_BUFFERS; i++) {
+        g_free(stream_buffers[i]);
+    }
+    return 0;
+}
+
+
+/* the connections pushed to, and what the threads pushing share */
+typedef struct {
+    guint64 *ids;
+    gint *fds;                  /* the clients */
+    guint count;
+    guint64 pushes;             /* by every thread */
+    gsize size;
+    guint64 accepted;
+    guint64 refused;
+    guint64 received;           /* the bytes read by clients */
+    guint started;              /* the threads started, to spread them */
+    gint done;                  /* set when all pushed */
+} BenchPush;
+
+/* the response to a request is the id of its connection */
+static JaAction bench_push_hook(JaRequest * req)
+{
+    guint64 id = ja_request_connection_id(req);
+    ja_response_append(req, &id, sizeof(id));
+    return JA_ACTION_RESPONSE | JA_ACTION_KEEP;
+}
+
+static gpointer bench_pusher(gpointer data)
+{
+    BenchPush *bp = (BenchPush *) data;
+    gchar *frame = g_malloc(bp->size);
+    memset(frame, 'p', bp->size);
+    guint64 i, accepted = 0;
+    guint c = __atomic_fetch_add(&bp->started, 1, __ATOMIC_RELAXED) *
+        bp->count / 8 % bp->count;
+    for (i = 0; i < bp->pushes; i++) {
+        if (ja_push(bp->ids[c], frame, bp->size)) {
+            accepted++;
+        }
+        c = (c + 1) % bp->count;
+    }
+    __atomic_add_fetch(&bp->accepted, accepted, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bp->refused, bp->pushes - accepted,
+                       __ATOMIC_RELAXED);
+    g_free(frame);
+    return NULL;
+}
+
+/*
+ * Reads the clients until nothing arrives for 100 milliseconds after all
+ * pushed
+ */
+static gpointer bench_push_reader(gpointer data)
+{
+    BenchPush *bp = (BenchPush *) data;
+    struct pollfd *pfds = g_new(struct pollfd, bp->count);
+    guint i;
+    for (i = 0; i < bp->count; i++) {
+        pfds[i].fd = bp->fds[i];
+        pfds[i].events = POLLIN;
+    }
+    gchar buf[64 * 1024];
+    gint n;
+    while ((n = poll(pfds, bp->count, 100)) > 0
+           || !__atomic_load_n(&bp->done, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < bp->count && n > 0; i++) {
+            if (pfds[i].revents & POLLIN) {
+                gssize len = read(bp->fds[i], buf, sizeof(buf));
+                bp->received += len > 0 ? len : 0;
+            }
+        }
+    }
+    g_free(pfds);
+    return NULL;
+}
+
+static gint bench_push_main(gint argc, const char *argv[])
+{
+    guint count = 64, threads = 4;
+    guint64 pushes = 1000000;
+    gsize size = 64;
+    if (argc > 2) {
+        count = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        pushes = g_ascii_strtoull(argv[3], NULL, 10);
+    }
+    if (argc > 4) {
+        size = g_ascii_strtoull(argv[4], NULL, 10);
+    }
+    if (argc > 5) {
+        threads = atoi(argv[5]);
+    }
+    if (count == 0 || pushes == 0 || size == 0 || threads == 0) {
+        g_printf("Usage: %s push [connections] [pushes] [frame size] "
+                 "[threads]\n", argv[0]);
+        return 1;
+    }
+
+    gchar path[] = "/tmp/jacques-bench-XXXXXX";
+    gint fd = mkstemp(path);
+    const gchar *text = "KeepAlive -1\n";
+    if (fd < 0 || write(fd, text, strlen(text)) != strlen(text)) {
+        g_error("fail to write configuration");
+    }
+    close(fd);
+    JaConfig *cfg = j_parse(path, NULL);
+    unlink(path);
+    ja_hook_register(bench_push_hook, JA_HOOK_TYPE_REQUEST);
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, NULL);
+    if (cfg == NULL || jw == NULL) {
+        g_error("fail to create worker");
+    }
+
+    BenchPush bp = { g_new(guint64, count), g_new(gint, count), count,
+        pushes / threads, size, 0, 0, 0, 0, 0
+    };
+    guint i;
+    for (i = 0; i < count; i++) {
+        gint sv[2];
+        gchar request[5];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            g_error("fail to create socketpair");
+        }
+        ja_worker_add(jw, j_socket_new_fromfd(sv[0], NULL, 0));
+        pack_length4_into(1, request);
+        request[4] = 'i';
+        gchar response[4 + sizeof(guint64)];
+        if (write(sv[1], request, sizeof(request)) != sizeof(request) ||
+            read(sv[1], response, sizeof(response)) != sizeof(response)) {
+            g_error("fail to get the connection id");
+        }
+        memcpy(&bp.ids[i], response + 4, sizeof(guint64));
+        bp.fds[i] = sv[1];
+    }
+
+    GThread *reader = g_thread_new("reader", bench_push_reader, &bp);
+    GThread **pushers = g_new(GThread *, threads);
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < threads; i++) {
+        pushers[i] = g_thread_new("pusher", bench_pusher, &bp);
+    }
+    for (i = 0; i < threads; i++) {
+        g_thread_join(pushers[i]);
+    }
+    gint64 pushed = g_get_monotonic_time() - start;
+    __atomic_store_n(&bp.done, 1, __ATOMIC_RELEASE);
+    g_thread_join(reader);
+
+    g_printf("connections: %u, threads: %u, frame size: %" G_GSIZE_FORMAT
+             "\n", count, threads, size);
+    g_printf("pushed: %" G_GUINT64_FORMAT ", refused: %" G_GUINT64_FORMAT
+             ", received: %" G_GUINT64_FORMAT "\n", bp.accepted,
+             bp.refused, bp.received / (size + 4));
+    g_printf("time: %.3fs, %.0f pushes/s\n", pushed / 1e6,
+             (bp.accepted + bp.refused) * 1e6 / (pushed ? pushed : 1));
+
+    for (i = 0; i < count; i++) {
+        close(bp.fds[i]);
+    }
+    g_free(pushers);
+    g_free(bp.ids);
+    g_free(bp.fds);
+    return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc > 1 && g_strcmp0(argv[1], "stream") == 0) {
+        return bench_stream_main(argc, argv);
+    }
+    if (argc > 1 && g_strcmp0(argv[1], "push") == 0) {
+        return bench_push_main(argc, argv);
+    }
+    guint64 requests = 1000000;
+    guint pipeline = 16;
+    if (argc > 1) {
+        requests = g_ascii_strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        pipeline = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        request_size = g_ascii_strtoull(argv[3], NULL, 10);
+    }
+    if (requests == 0 || pipeline == 0 || request_size == 0) {
+        g_printf("Usage: %s [requests] [pipeline] [request size]\n",
+                 argv[0]);
+        return 1;
+    }
+
+    gint sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        g_error("fail to create socketpair");
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    JSocket *server = j_socket_new_fromfd(sv[0], NULL, 0);
+
+    gsize length = (request_size + 4) * pipeline;
+    gchar *packages = g_malloc(length);
+    guint i;
+    for (i = 0; i < pipeline; i++) {
+        gchar *p = packages + i * (request_size + 4);
+        pack_length4_into(request_size, p);
+        memset(p + 4, 'a' + i % 26, request_size);
+    }
+    gsize size = 64 * 1024;
+    gchar *buf = g_malloc(size);
+
+    for (i = 0; i < WARMUP_ROUNDS; i++) {
+        bench_round(server, sv[1], packages, length, buf, size);
+    }
+
+    guint64 rounds = (requests + pipeline - 1) / pipeline;
+    guint64 mallocs = malloc_count;
+    guint64 maps = j_pool_get_map_count();
+    gint64 start = g_get_monotonic_time();
+    guint64 r;
+    for (r = 0; r < rounds; r++) {
+        bench_round(server, sv[1], packages, length, buf, size);
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    mallocs = malloc_count - mallocs;
+    maps = j_pool_get_map_count() - maps;
+
+    guint64 handled = rounds * pipeline;
+    g_printf("requests: %" G_GUINT64_FORMAT ", pipeline: %u, size: %"
+             G_GSIZE_FORMAT "\n", handled, pipeline, request_size);
+    g_printf("time: %.3fs, %.0f requests/s\n", elapsed / 1e6,
+             handled * 1e6 / (elapsed ? elapsed : 1));
+    g_printf("malloc calls: %" G_GUINT64_FORMAT ", slabs mapped: %"
+             G_GUINT64_FORMAT "\n", mallocs, maps);
+
+    j_socket_close(server);
+    close(sv[1]);
+    g_free(packages);
+    g_free(buf);
+    return mallocs == 0 && maps == 0 ? 0 : 1;
+}
@@ -17,6 +17,7 @@
  */
 
 #include "config.h"
+#include "blocking.h"
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -36,19 +37,42 @@ JaConfig *ja_config_load(GError ** error)
 
 static gchar *get_module_name(const gchar * name);
 
+/*
+ * Creates the pool of blocking hooks of module name,
+ * configured by the group <Module name> if there is
+ */
+static inline JaHookPool *ja_config_module_pool(JaConfig * cfg,
+                                                const gchar * name)
+{
+    JaHookPool *pool = ja_hook_pool_new(name);
+    GList *ptr = j_parser_get_group(cfg, GROUP_MODULE);
+    while (ptr) {
+        JGroup *g = (JGroup *) ptr->data;
+        if (g_strcmp0(j_group_get_value(g), name) == 0) {
+            ja_hook_pool_configure(pool, g);
+        }
+        ptr = g_list_next(ptr);
+    }
+    return pool;
+}
+
 /*
  * Loads modules based on configuration
  */
 void ja_config_load_modules(JaConfig * cfg)
 {
+    GList *pools = NULL;        /* the pool of every module loaded */
     GList *ptr = j_parser_get_root(cfg);
     while (ptr) {
         JNode *n = (JNode *) ptr->data;
         if (j_node_is_directive(n)) {
             JDirective *d = j_node_get_directive(n);
+            const gchar *name = j_directive_get_value(d);
             if (g_strcmp0(DIRECTIVE_LOADMODULE,
-                          j_directive_get_name(d)) == 0) {
-                ja_load_module(j_directive_get_value(d));
+                          j_directive_get_name(d)) == 0
+                && ja_load_module(name)) {
+                pools = g_list_append(pools,
+                                      ja_config_module_pool(cfg, name));
             }
         }
         ptr = g_list_next(ptr);
@@ -56,14 +80,25 @@ void ja_config_load_modules(JaConfig * cfg)
 
     /* register hooks */
     ptr = ja_get_modules();
-    while (ptr) {
+    GList *pool = pools;
+    while (ptr && pool) {
         JaModule *mod = (JaModule *) ptr->data;
         JaModuleHooksInit hook_init = mod->hooks_init_func;
         if (hook_init) {
+            ja_hook_set_module(mod);
+            ja_hook_set_pool((JaHookPool *) pool->data);
             hook_init();
         }
         ptr = g_list_next(ptr);
+        pool = g_list_next(pool);
     }
+    ja_hook_set_module(NULL);
+    ja_hook_set_pool(NULL);
+    g_list_free(pools);
+
+    ja_hook_compile(g_strcmp0(j_parser_get_directive_text(cfg,
+                                                          DIRECTIVE_OPCODE),
+                              "varint") == 0);
 }
 
 
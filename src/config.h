@@ -98,6 +98,12 @@ JaConfig *ja_config_load(GError ** error);
 
 #define DIRECTIVE_LOADMODULE    "LoadModule"
 
+/*
+ * Opcode byte|varint: the format of opcode at the beginning of request,
+ * which routes it to the hooks registered for the opcode. byte by default
+ */
+#define DIRECTIVE_OPCODE    "Opcode"
+
 /*
  * Loads modules based on configuration
  */
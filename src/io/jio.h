@@ -22,6 +22,7 @@
 
 #include "jsocket.h"
 #include "jpoll.h"
+#include "jpool.h"
 
 
 #endif                          /* __J_JIO_H__ */
@@ -17,28 +17,81 @@
  */
 
 #include "jpoll.h"
+#include "juring.h"
 #include <time.h>
 #include <glib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 
+/* the submission queue size of io_uring backend */
+#define J_POLL_URING_ENTRIES    256
+
+/* the slots of timer wheel, one second per slot */
+#define J_POLL_WHEEL_SIZE   64
+
+/*
+ * A JSocket closed with MSG_ZEROCOPY sends not acknowledged lingers,
+ * its error queue is checked every J_POLL_LINGER_INTERVAL ms,
+ * and it's closed anyway after J_POLL_LINGER_TIMEOUT seconds
+ */
+#define J_POLL_LINGER_INTERVAL  10
+#define J_POLL_LINGER_TIMEOUT   10
+
 struct _JPoll {
+    JPollBackend backend;
     gint epollfd;
-    GList *jsocks;              /* the list of JSockets registered */
+    JURing *uring;
+    GQueue jsocks;              /* the list of JSockets registered */
     gint count;                 /* the length of jsocks */
+
+    /*
+     * Timer wheel. A JSocket is put in the slot of its active time,
+     * when it's active again, only its active time is updated. It's moved
+     * to the right slot when its old slot is due. So both refreshing and
+     * expiring are O(1)
+     */
+    GQueue wheel[J_POLL_WHEEL_SIZE];
+    guint64 wheel_time;         /* the last second whose slot is visited */
+
+    GQueue lingering;           /* linked by poll_link, in order of closing */
 };
 
 
+static inline void j_poll_wheel_add(JPoll * jp, JSocket * jsock)
+{
+    if (j_socket_is_persistent(jsock)) {
+        return;
+    }
+    guint64 active = j_socket_active_time(jsock);
+    if (active <= jp->wheel_time) {
+        active = jp->wheel_time + 1;    /* don't put it in a passed slot */
+    }
+    jsock->timer_slot = active % J_POLL_WHEEL_SIZE;
+    g_queue_push_tail_link(&jp->wheel[jsock->timer_slot],
+                           &jsock->timer_link);
+}
+
+static inline void j_poll_wheel_remove(JPoll * jp, JSocket * jsock)
+{
+    if (j_socket_is_persistent(jsock)) {
+        return;
+    }
+    g_queue_unlink(&jp->wheel[jsock->timer_slot], &jsock->timer_link);
+}
+
 static inline void j_poll_add_jsocket(JPoll * jp, JSocket * jsock)
 {
-    jp->jsocks = g_list_append(jp->jsocks, jsock);
+    g_queue_push_tail_link(&jp->jsocks, &jsock->poll_link);
+    j_poll_wheel_add(jp, jsock);
     jp->count++;
 }
 
 static inline void j_poll_remove_jsocket(JPoll * jp, JSocket * jsock)
 {
-    jp->jsocks = g_list_remove(jp->jsocks, jsock);
+    g_queue_unlink(&jp->jsocks, &jsock->poll_link);
+    j_poll_wheel_remove(jp, jsock);
     jp->count--;
 }
 
@@ -51,7 +104,7 @@ static inline void j_poll_remove_jsocket(JPoll * jp, JSocket * jsock)
  */
 GList *j_poll_all(JPoll * jp)
 {
-    return jp->jsocks;
+    return jp->jsocks.head;
 }
 
 /*
@@ -82,16 +135,95 @@ JPoll *j_poll_new()
     return j_poll_new_fromfd(fd);
 }
 
+/*
+ * Creates a JPoll using the specified backend
+ * If the backend is not supported, falls back to epoll
+ */
+JPoll *j_poll_new_with_backend(JPollBackend backend)
+{
+    if (backend == J_POLL_BACKEND_URING) {
+        JURing *ring = j_uring_new(J_POLL_URING_ENTRIES);
+        if (ring) {
+            JPoll *jp = j_poll_new_fromfd(-1);
+            jp->backend = J_POLL_BACKEND_URING;
+            jp->uring = ring;
+            return jp;
+        }
+        g_warning("io_uring is not supported, use epoll instead");
+    }
+    return j_poll_new();
+}
+
+/*
+ * Gets the backend that JPoll really uses
+ */
+JPollBackend j_poll_get_backend(JPoll * jp)
+{
+    return jp->backend;
+}
+
 
 static inline JPoll *j_poll_new_fromfd(gint fd)
 {
     JPoll *jp = (JPoll *) g_slice_alloc(sizeof(JPoll));
+    jp->backend = J_POLL_BACKEND_EPOLL;
     jp->epollfd = fd;
-    jp->jsocks = NULL;
+    jp->uring = NULL;
+    g_queue_init(&jp->jsocks);
     jp->count = 0;
+    gint i;
+    for (i = 0; i < J_POLL_WHEEL_SIZE; i++) {
+        g_queue_init(&jp->wheel[i]);
+    }
+    jp->wheel_time = j_socket_get_clock() - 1;
+    g_queue_init(&jp->lingering);
     return jp;
 }
 
+/*
+ * Closes the lingering JSockets whose sends are all acknowledged,
+ * or lingering for J_POLL_LINGER_TIMEOUT
+ */
+static inline void j_poll_linger(JPoll * jp)
+{
+    guint64 now = j_socket_get_clock();
+    GList *ptr = jp->lingering.head;
+    while (ptr) {
+        GList *next = g_list_next(ptr);
+        JSocket *jsock = (JSocket *) ptr->data;
+        j_socket_zerocopy_complete(jsock);
+        guint32 pending = j_socket_zerocopy_pending(jsock);
+        if (pending == 0
+            || now >= j_socket_active_time(jsock) + J_POLL_LINGER_TIMEOUT) {
+            if (pending > 0) {
+                g_warning("%u zerocopy sends not acknowledged in %d seconds",
+                          pending, J_POLL_LINGER_TIMEOUT);
+            }
+            g_queue_unlink(&jp->lingering, ptr);
+            j_socket_close(jsock);
+        }
+        ptr = next;
+    }
+}
+
+/*
+ * Waits for events on io_uring backend
+ */
+static inline gint j_poll_wait_uring(JPoll * jp, JPollEvent * jevents,
+                                     guint maxevents, gint timeout)
+{
+    guint32 types[128];
+    gpointer datas[128];
+    gint n = j_uring_wait(jp->uring, types, datas, maxevents, timeout);
+    j_socket_set_clock((guint64) time(NULL));
+    gint i;
+    for (i = 0; i < n; i++) {
+        jevents[i].type = types[i];
+        jevents[i].jsock = (JSocket *) datas[i];
+    }
+    return n;
+}
+
 /*
  * Waits for events on JPoll instance. Up to maxevents
  * When successfully, j_poll_wait() returns a number of ready JSocket.
@@ -107,10 +239,20 @@ gint j_poll_wait(JPoll * jp, JPollEvent * jevents, guint maxevents,
     } else if (maxevents == 0) {
         return 0;
     }
+    if (!g_queue_is_empty(&jp->lingering)) {
+        j_poll_linger(jp);
+        if (timeout < 0 || timeout > J_POLL_LINGER_INTERVAL) {
+            timeout = J_POLL_LINGER_INTERVAL;
+        }
+    }
+    if (jp->backend == J_POLL_BACKEND_URING) {
+        return j_poll_wait_uring(jp, jevents, maxevents, timeout);
+    }
     gint epollfd = j_poll_fd(jp);
     gint n;
   AGAIN:
     n = epoll_wait(epollfd, events, maxevents, timeout);
+    j_socket_set_clock((guint64) time(NULL));
     if (n < 0) {
         if (errno == EINTR) {
             goto AGAIN;
@@ -132,6 +274,14 @@ gint j_poll_wait(JPoll * jp, JPollEvent * jevents, guint maxevents,
 /* Registers a JSocket */
 gint j_poll_register(JPoll * jp, JSocket * jsock, guint32 events)
 {
+    jsock->events = events;
+    if (jp->backend == J_POLL_BACKEND_URING) {
+        jsock->poll_data =
+            j_uring_add(jp->uring, j_socket_fd(jsock),
+                        events & ~J_POLL_EVENT_ET, jsock);
+        j_poll_add_jsocket(jp, jsock);
+        return jsock->poll_data != NULL;
+    }
     gint epollfd = j_poll_fd(jp);
     gint sockfd = j_socket_fd(jsock);
 
@@ -144,12 +294,82 @@ gint j_poll_register(JPoll * jp, JSocket * jsock, guint32 events)
     return !epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &event);
 }
 
+/* Registers a connected JSocket */
+gint j_poll_register_stream(JPoll * jp, JSocket * jsock, guint32 events)
+{
+    if (jp->backend != J_POLL_BACKEND_URING) {
+        return j_poll_register(jp, jsock, events);
+    }
+    jsock->events = events;
+    jsock->poll_data = j_uring_add_stream(jp->uring, jsock,
+                                          events & ~J_POLL_EVENT_ET);
+    j_poll_add_jsocket(jp, jsock);
+    return jsock->poll_data != NULL;
+}
+
+/* Registers a listening JSocket */
+gint j_poll_register_passive(JPoll * jp, JSocket * jsock)
+{
+    if (jp->backend != J_POLL_BACKEND_URING) {
+        return j_poll_register(jp, jsock, J_POLL_EVENT_IN);
+    }
+    jsock->events = J_POLL_EVENT_IN;
+    jsock->poll_data = j_uring_add_passive(jp->uring, jsock);
+    j_poll_add_jsocket(jp, jsock);
+    return jsock->poll_data != NULL;
+}
+
+gint j_poll_recv(JPoll * jp, JSocket * jsock)
+{
+    if (jp->backend != J_POLL_BACKEND_URING) {
+        return j_socket_recv(jsock);
+    }
+    return j_uring_recv(jp->uring, (JURingPoll *) jsock->poll_data);
+}
+
+gint j_poll_flush(JPoll * jp, JSocket * jsock)
+{
+    if (jp->backend != J_POLL_BACKEND_URING) {
+        return j_socket_flush(jsock);
+    }
+    return j_uring_flush(jp->uring, (JURingPoll *) jsock->poll_data);
+}
+
+/*
+ * The ring accepts without the address, it's got by getpeername()
+ */
+JSocket *j_poll_accept(JPoll * jp, JSocket * jsock)
+{
+    if (jp->backend != J_POLL_BACKEND_URING) {
+        return j_socket_accept_nonblock(jsock);
+    }
+    gint fd = j_uring_accept(jp->uring, (JURingPoll *) jsock->poll_data);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *) &addr, &addrlen) < 0) {
+        addrlen = 0;
+    }
+    return j_socket_new_fromfd(fd, (struct sockaddr *) &addr, addrlen);
+}
+
 /*
  * Modify the event associated to the JSocket
  * Returns 1 on success, otherwise 0
  */
 gint j_poll_modify(JPoll * jp, JSocket * jsock, guint32 events)
 {
+    if (jsock->events == events) {
+        return 1;
+    }
+    jsock->events = events;
+    if (jp->backend == J_POLL_BACKEND_URING) {
+        j_uring_modify(jp->uring, (JURingPoll *) jsock->poll_data,
+                       events & ~J_POLL_EVENT_ET);
+        return 1;
+    }
     gint epollfd = j_poll_fd(jp);
     gint sockfd = j_socket_fd(jsock);
 
@@ -161,30 +381,58 @@ gint j_poll_modify(JPoll * jp, JSocket * jsock, guint32 events)
 }
 
 /*
- * Unregisters the JSocket
- * Returns 1 on success, otherwise 0
+ * Unregisters the JSocket, which is going to be closed or not
+ * io_uring doesn't wait for the data in flight if it's closing
  */
-gint j_poll_delete(JPoll * jp, JSocket * jsock)
+static inline gint j_poll_unregister(JPoll * jp, JSocket * jsock,
+                                     gboolean closing)
 {
     gint epollfd = j_poll_fd(jp);
     gint sockfd = j_socket_fd(jsock);
 
     j_poll_remove_jsocket(jp, jsock);
+    jsock->events = 0;
+
+    if (jp->backend == J_POLL_BACKEND_URING) {
+        j_uring_delete(jp->uring, (JURingPoll *) jsock->poll_data,
+                       closing);
+        jsock->poll_data = NULL;
+        return 1;
+    }
 
     struct epoll_event event;   /* linux 2.6.9 required a non-null pointer in event */
     return !epoll_ctl(epollfd, EPOLL_CTL_DEL, sockfd, &event);
 }
 
+/*
+ * Unregisters the JSocket
+ * Returns 1 on success, otherwise 0
+ */
+gint j_poll_delete(JPoll * jp, JSocket * jsock)
+{
+    return j_poll_unregister(jp, jsock, FALSE);
+}
+
 /*
  * Unregisters the Jsocket and close it
+ * If the kernel may still use its data, it lingers until it doesn't
  */
 gint j_poll_delete_close(JPoll * jp, JSocket * jsock)
 {
-    gint ret = j_poll_delete(jp, jsock);
-    j_socket_close(jsock);
+    gint ret = j_poll_unregister(jp, jsock, TRUE);
+    if (j_socket_linger(jsock)) {
+        g_queue_push_tail_link(&jp->lingering, &jsock->poll_link);
+    } else {
+        j_socket_close(jsock);
+    }
     return ret;
 }
 
+guint32 j_poll_lingering(JPoll * jp)
+{
+    return jp->lingering.length;
+}
+
 /*
  * Closes JPoll
  * This function will close JPoll and free all the memory used by JPoll
@@ -195,7 +443,16 @@ gint j_poll_close(JPoll * jp)
 {
     gint epollfd = j_poll_fd(jp);
 
-    gint ret = close(epollfd);
+    gint ret = 0;
+    GList *link;
+    while ((link = g_queue_pop_head_link(&jp->lingering)) != NULL) {
+        j_socket_close((JSocket *) link->data);
+    }
+    if (jp->backend == J_POLL_BACKEND_URING) {
+        j_uring_free(jp->uring);
+    } else {
+        ret = close(epollfd);
+    }
     g_slice_free1(sizeof(JPoll), jp);
 
     return ret;
@@ -206,8 +463,17 @@ gint j_poll_close(JPoll * jp)
  */
 gint j_poll_close_all(JPoll * jp)
 {
-    GList *jsocks = j_poll_all(jp);
-    g_list_free_full(jsocks, (GDestroyNotify) j_socket_close);
+    GList *ptr = j_poll_all(jp);
+    while (ptr) {
+        GList *next = g_list_next(ptr);
+        if (jp->backend == J_POLL_BACKEND_URING) {
+            /* the kernel may be sending its write queue */
+            j_poll_delete_close(jp, (JSocket *) ptr->data);
+        } else {
+            j_socket_close((JSocket *) ptr->data);
+        }
+        ptr = next;
+    }
     return j_poll_close(jp);
 }
 
@@ -227,30 +493,69 @@ static inline void j_poll_event_free(JPollEvent * jpe)
 /*
  * Removes all JSockets that are not active during last timeout seconds
  */
-guint32 j_poll_remove_timeout(JPoll * jp, guint64 timeout)
+guint32 j_poll_remove_timeout(JPoll * jp, guint64 timeout, GFunc func,
+                              gpointer user_data)
 {
-    guint64 now = (guint64) time(NULL);
-    GList *ptr = jp->jsocks;
+    guint64 now = j_socket_get_clock();
+    if (now <= timeout + 1) {
+        return 0;
+    }
+    /* JSockets active before or at deadline are timeout */
+    guint64 deadline = now - timeout - 1;
+    if (deadline <= jp->wheel_time) {
+        return 0;
+    }
+    guint64 t = jp->wheel_time + 1;
+    if (deadline - t >= J_POLL_WHEEL_SIZE) {
+        t = deadline - J_POLL_WHEEL_SIZE + 1;   /* every slot is visited once */
+    }
+
     guint32 count = 0;
-    while (ptr) {
-        JSocket *jsock = (JSocket *) ptr->data;
-        GList *next = g_list_next(ptr);
-        if (j_socket_active_time(jsock) + timeout < now) {
-            GList *prev = ptr->prev;
-            if (prev) {
-                prev->next = next;
-            } else {
-                jp->jsocks = next;
+    for (; t <= deadline; t++) {
+        guint32 slot = t % J_POLL_WHEEL_SIZE;
+        GList *ptr = jp->wheel[slot].head;
+        while (ptr) {
+            JSocket *jsock = (JSocket *) ptr->data;
+            GList *next = g_list_next(ptr);
+            guint64 active = j_socket_active_time(jsock);
+            if (active <= deadline) {
+                if (func) {
+                    func(jsock, user_data);
+                }
+                j_poll_delete_close(jp, jsock);
+                count++;
+            } else if (active % J_POLL_WHEEL_SIZE != slot) {
+                /* active again, move it to the slot of its active time */
+                g_queue_unlink(&jp->wheel[slot], ptr);
+                j_poll_wheel_add(jp, jsock);
             }
-            if (next) {
-                next->prev = prev;
-            }
-            j_socket_close(jsock);
-            g_list_free1(ptr);
-            jp->count--;
-            count++;
+            ptr = next;
         }
-        ptr = next;
     }
+    jp->wheel_time = deadline;
     return count;
 }
+
+/*
+ * Gets the milliseconds until j_poll_remove_timeout() has something to do
+ */
+gint j_poll_next_timeout(JPoll * jp, guint64 timeout)
+{
+    guint64 t;
+    for (t = jp->wheel_time + 1; t <= jp->wheel_time + J_POLL_WHEEL_SIZE;
+         t++) {
+        if (!g_queue_is_empty(&jp->wheel[t % J_POLL_WHEEL_SIZE])) {
+            break;
+        }
+    }
+    if (t > jp->wheel_time + J_POLL_WHEEL_SIZE) {
+        return -1;
+    }
+    /* the slot of second t is due at the beginning of second t+timeout+1 */
+    gint64 due = (gint64) (t + timeout + 1) * G_USEC_PER_SEC;
+    gint64 now = g_get_real_time();
+    if (due <= now) {
+        return 0;
+    }
+    return (gint) ((due - now + 999) / 1000);
+}
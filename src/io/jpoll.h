@@ -26,10 +26,31 @@
 typedef struct _JPoll JPoll;
 
 
+/*
+ * The event notification mechanism used by JPoll
+ * J_POLL_BACKEND_EPOLL is always available,
+ * J_POLL_BACKEND_URING requires a kernel with multishot recv (6.0 or newer)
+ *
+ * With io_uring, the JSockets registered by j_poll_register_stream() and
+ * j_poll_register_passive() are received, sent and accepted by the ring,
+ * use j_poll_recv(), j_poll_flush() and j_poll_accept() on them instead
+ * of the JSocket functions. With epoll, those are the JSocket functions
+ */
+typedef enum {
+    J_POLL_BACKEND_EPOLL,
+    J_POLL_BACKEND_URING,
+} JPollBackend;
+
+
 #define J_POLL_EVENT_IN EPOLLIN
 #define J_POLL_EVENT_OUT EPOLLOUT
 #define J_POLL_EVENT_HUP EPOLLHUP
 #define J_POLL_EVENT_ERR EPOLLERR
+/*
+ * Edge-triggered, the JSocket must be read/writen until EAGAIN
+ * Only epoll supports it, io_uring backend ignores it
+ */
+#define J_POLL_EVENT_ET EPOLLET
 
 
 /* this structure is public */
@@ -45,6 +66,18 @@ typedef struct {
  */
 JPoll *j_poll_new();
 
+/*
+ * Creates a JPoll using the specified backend
+ * If the backend is not supported, falls back to epoll
+ * Returns NULL on error
+ */
+JPoll *j_poll_new_with_backend(JPollBackend backend);
+
+/*
+ * Gets the backend that JPoll really uses
+ */
+JPollBackend j_poll_get_backend(JPoll * jp);
+
 /*
  * Gets all the JSockets that is registered in JPoll
  * The return GList is maintained by JPoll
@@ -75,15 +108,54 @@ gint j_poll_wait(JPoll * jp, JPollEvent * jevents, guint maxevents,
  */
 gint j_poll_register(JPoll * jp, JSocket * jsock, guint32 types);
 
+/*
+ * Registers a connected JSocket, which is read by j_poll_recv()
+ * and writen by j_poll_flush()
+ * Returns 1 on success, otherwise 0
+ */
+gint j_poll_register_stream(JPoll * jp, JSocket * jsock, guint32 types);
+
+/*
+ * Registers a non-blocking listening JSocket for J_POLL_EVENT_IN,
+ * which is accepted by j_poll_accept()
+ * Returns 1 on success, otherwise 0
+ */
+gint j_poll_register_passive(JPoll * jp, JSocket * jsock);
+
+
+/*
+ * Receives data of a stream into its read buffer, like j_socket_recv()
+ * Returns the count of bytes received, 0 if nothing
+ * Returns -1 if error occurs or the peer closed the connection
+ */
+gint j_poll_recv(JPoll * jp, JSocket * jsock);
+
+/*
+ * Writes the queued data of a stream, like j_socket_flush()
+ * Returns 1 if all data is writen
+ * Returns 0 if some is not writen yet, J_POLL_EVENT_OUT is reported
+ * when it can go on (with io_uring, when the send in flight completes)
+ * Returns -1 if error occurs
+ */
+gint j_poll_flush(JPoll * jp, JSocket * jsock);
+
+/*
+ * Accepts a connection of a passive JSocket, like j_socket_accept_nonblock()
+ * Returns NULL if none
+ */
+JSocket *j_poll_accept(JPoll * jp, JSocket * jsock);
+
 
 /*
  * Modify the event associated to the JSocket
+ * Nothing is done if the events are not changed
  * Returns 1 on success, otherwise 0
  */
 gint j_poll_modify(JPoll * jp, JSocket * jsock, guint32 type);
 
 /*
  * Unregisters the JSocket
+ * The data received by the ring goes with the JSocket
  * Returns 1 on success, otherwise 0
  */
 gint j_poll_delete(JPoll * jp, JSocket * jsock);
@@ -91,13 +163,22 @@ gint j_poll_delete(JPoll * jp, JSocket * jsock);
 
 /*
  * Unregisters the Jsocket and close it
+ * If some MSG_ZEROCOPY sends are not acknowledged (see j_socket_linger()),
+ * the descriptor and the data are kept until they are, or for 10 seconds
+ * at most, checked in j_poll_wait()
  */
 gint j_poll_delete_close(JPoll * jp, JSocket * jsock);
 
+/*
+ * Gets the count of JSockets closed but lingering
+ */
+guint32 j_poll_lingering(JPoll * jp);
+
 
 /*
  * Closes JPoll
  * This function will close JPoll and free all the memory used by JPoll
+ * The JSockets lingering are closed at once,
  * But not free JSockets registered.
  * So get all JSockets registered before close the JPoll
  */
@@ -113,8 +194,20 @@ gint j_poll_close_all(JPoll * jp);
 /*
  * Removes all JSockets that are not active during last timeout seconds
  * Returns the count of JSockets that are removed
+ *
+ * JSockets are kept in a timer wheel with one slot per second,
+ * only the slots that are due are visited
+ * func(jsock, user_data) is called before a JSocket is closed, if not NULL
+ */
+guint32 j_poll_remove_timeout(JPoll * jp, guint64 timeout, GFunc func,
+                              gpointer user_data);
+
+/*
+ * Gets the milliseconds until j_poll_remove_timeout() has something to do,
+ * it's the timeout to pass to j_poll_wait()
+ * Returns -1 if no JSocket can time out
  */
-guint32 j_poll_remove_timeout(JPoll * jp, guint64 timeout);
+gint j_poll_next_timeout(JPoll * jp, guint64 timeout);
 
 
 
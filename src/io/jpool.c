@@ -0,0 +1,363 @@
+/*
+ * jpool.c
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jpool.h"
+#include <string.h>
+#include <sys/mman.h>
+
+
+/* slabs are aligned to their size, so a block finds its slab by masking */
+#define SLAB_SHIFT  21
+#define SLAB_SIZE   (1UL << SLAB_SHIFT)
+#define SLAB_MASK   (~(SLAB_SIZE - 1))
+/* the header at the beginning of slab, keeps blocks cache line aligned */
+#define SLAB_HEADER_SIZE    64
+
+/* size classes are powers of two, from 64 bytes to 128K */
+#define CLASS_MIN_SHIFT 6
+#define CLASS_MAX_SHIFT 17
+#define CLASS_COUNT (CLASS_MAX_SHIFT - CLASS_MIN_SHIFT + 1)
+#define CLASS_LARGE CLASS_COUNT
+
+#define class_size(k)   (1UL << ((k) + CLASS_MIN_SHIFT))
+
+/* every thread caches about 1M of free blocks of a class */
+#define CACHE_BYTES (1UL << 20)
+#define cache_limit(k)  MAX(8, CACHE_BYTES / class_size(k))
+
+/*
+ * every thread keeps one freed mapping of every size up to this many slabs,
+ * so that a buffer growing past the biggest class doesn't map every time
+ */
+#define LARGE_CACHE_SLABS   4
+
+
+typedef struct {
+    guint32 klass;
+    gsize size;                 /* the size of mapping */
+} JPoolSlab;
+
+typedef struct _JPoolBlock JPoolBlock;
+struct _JPoolBlock {
+    JPoolBlock *next;
+};
+
+/* the rest of a slab left by an exited thread, stored at its beginning */
+typedef struct _JPoolSpare JPoolSpare;
+struct _JPoolSpare {
+    JPoolSpare *next;
+    gchar *end;
+};
+
+/* free blocks and the slab being carved, of every class */
+typedef struct {
+    JPoolBlock *free[CLASS_COUNT];
+    guint count[CLASS_COUNT];
+    gchar *bump[CLASS_COUNT];
+    gchar *end[CLASS_COUNT];
+    JPoolSlab *large[LARGE_CACHE_SLABS];    /* indexed by slabs - 1 */
+    guint64 maps;
+    gboolean registered;        /* flushed when the thread exits */
+} JPoolCache;
+
+/* blocks given back by the threads, shared by all */
+typedef struct {
+    GMutex lock;
+    JPoolBlock *free;
+    guint count;
+    JPoolSpare *spares;
+} JPoolDepot;
+
+
+static __thread JPoolCache cache;
+static JPoolDepot depots[CLASS_COUNT];
+static gboolean use_hugepages = FALSE;
+
+static void j_pool_thread_exit(gpointer data)
+{
+    j_pool_thread_flush();
+}
+
+static GPrivate thread_key = G_PRIVATE_INIT(j_pool_thread_exit);
+
+/* makes sure j_pool_thread_flush() is called when current thread exits */
+static inline void j_pool_thread_init(void)
+{
+    if (G_UNLIKELY(!cache.registered)) {
+        cache.registered = TRUE;
+        g_private_set(&thread_key, &cache);
+    }
+}
+
+
+void j_pool_set_hugepages(gboolean enable)
+{
+    use_hugepages = enable;
+}
+
+guint64 j_pool_get_map_count(void)
+{
+    return cache.maps;
+}
+
+#define j_pool_slab(mem)    ((JPoolSlab*)((gsize)(mem) & SLAB_MASK))
+
+static inline guint32 j_pool_class(gsize size)
+{
+    if (size <= class_size(0)) {
+        return 0;
+    }
+    guint32 shift = sizeof(gulong) * 8 - __builtin_clzl(size - 1);
+    if (shift > CLASS_MAX_SHIFT) {
+        return CLASS_LARGE;
+    }
+    return shift - CLASS_MIN_SHIFT;
+}
+
+/*
+ * Maps size (a multiple of SLAB_SIZE) bytes aligned to SLAB_SIZE
+ */
+static gpointer j_pool_map(gsize size)
+{
+    gchar *mem;
+    cache.maps++;
+#ifdef MAP_HUGETLB
+    if (use_hugepages) {        /* hugetlb pages are aligned naturally */
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            return mem;
+        }
+    }
+#endif
+    mem = mmap(NULL, size + SLAB_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        g_error("fail to map %" G_GSIZE_FORMAT " bytes", size);
+    }
+    gchar *aligned = (gchar *) (((gsize) mem + SLAB_SIZE - 1) & SLAB_MASK);
+    if (aligned > mem) {
+        munmap(mem, aligned - mem);
+    }
+    munmap(aligned + size, mem + SLAB_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+    if (use_hugepages) {        /* transparent hugepages at least */
+        madvise(aligned, size, MADV_HUGEPAGE);
+    }
+#endif
+    return aligned;
+}
+
+#define j_pool_large_index(total)   (((total) >> SLAB_SHIFT) - 1)
+
+static gpointer j_pool_alloc_large(gsize size)
+{
+    gsize total = (size + SLAB_HEADER_SIZE + SLAB_SIZE - 1) & SLAB_MASK;
+    gsize i = j_pool_large_index(total);
+    JPoolSlab *slab;
+    if (i < LARGE_CACHE_SLABS && cache.large[i]) {
+        slab = cache.large[i];
+        cache.large[i] = NULL;
+        return (gchar *) slab + SLAB_HEADER_SIZE;
+    }
+    j_pool_thread_init();
+    slab = (JPoolSlab *) j_pool_map(total);
+    slab->klass = CLASS_LARGE;
+    slab->size = total;
+    return (gchar *) slab + SLAB_HEADER_SIZE;
+}
+
+/*
+ * Refills the free list of class k from the depot
+ */
+static inline gboolean j_pool_refill(guint32 k)
+{
+    JPoolDepot *depot = &depots[k];
+    if (depot->free == NULL) {  /* racy peek, only to skip the lock */
+        return FALSE;
+    }
+    guint want = cache_limit(k) / 2;
+    j_pool_thread_init();
+    g_mutex_lock(&depot->lock);
+    while (depot->free && cache.count[k] < want) {
+        JPoolBlock *b = depot->free;
+        depot->free = b->next;
+        depot->count--;
+        b->next = cache.free[k];
+        cache.free[k] = b;
+        cache.count[k]++;
+    }
+    g_mutex_unlock(&depot->lock);
+    return cache.free[k] != NULL;
+}
+
+/*
+ * Gives the free list of class k back to the depot, but keep blocks
+ */
+static inline void j_pool_drain(guint32 k, guint keep)
+{
+    JPoolDepot *depot = &depots[k];
+    g_mutex_lock(&depot->lock);
+    while (cache.count[k] > keep) {
+        JPoolBlock *b = cache.free[k];
+        cache.free[k] = b->next;
+        cache.count[k]--;
+        b->next = depot->free;
+        depot->free = b;
+        depot->count++;
+    }
+    g_mutex_unlock(&depot->lock);
+}
+
+/*
+ * Starts carving another slab of class k,
+ * the rest of a slab left by an exited thread if any
+ */
+static void j_pool_carve(guint32 k)
+{
+    JPoolDepot *depot = &depots[k];
+    JPoolSpare *spare = NULL;
+    j_pool_thread_init();
+    if (depot->spares) {        /* racy peek, only to skip the lock */
+        g_mutex_lock(&depot->lock);
+        spare = depot->spares;
+        if (spare) {
+            depot->spares = spare->next;
+        }
+        g_mutex_unlock(&depot->lock);
+    }
+    if (spare) {
+        cache.bump[k] = (gchar *) spare;
+        cache.end[k] = spare->end;
+        return;
+    }
+    JPoolSlab *slab = (JPoolSlab *) j_pool_map(SLAB_SIZE);
+    slab->klass = k;
+    slab->size = SLAB_SIZE;
+    cache.bump[k] = (gchar *) slab + SLAB_HEADER_SIZE;
+    cache.end[k] = (gchar *) slab + SLAB_SIZE;
+}
+
+gpointer j_pool_alloc(gsize size)
+{
+    guint32 k = j_pool_class(size);
+    if (G_UNLIKELY(k == CLASS_LARGE)) {
+        return j_pool_alloc_large(size);
+    }
+
+    if (cache.free[k] || j_pool_refill(k)) {
+        JPoolBlock *b = cache.free[k];
+        cache.free[k] = b->next;
+        cache.count[k]--;
+        return b;
+    }
+
+    gsize bsize = class_size(k);
+    if (cache.bump[k] == NULL || cache.bump[k] + bsize > cache.end[k]) {
+        j_pool_carve(k);
+    }
+    gpointer mem = cache.bump[k];
+    cache.bump[k] += bsize;
+    return mem;
+}
+
+gpointer j_pool_alloc0(gsize size)
+{
+    gpointer mem = j_pool_alloc(size);
+    memset(mem, 0, size);
+    return mem;
+}
+
+void j_pool_free(gpointer mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+    JPoolSlab *slab = j_pool_slab(mem);
+    guint32 k = slab->klass;
+    j_pool_thread_init();
+    if (G_UNLIKELY(k == CLASS_LARGE)) {
+        gsize i = j_pool_large_index(slab->size);
+        if (i < LARGE_CACHE_SLABS && cache.large[i] == NULL) {
+            cache.large[i] = slab;
+        } else {
+            munmap(slab, slab->size);
+        }
+        return;
+    }
+    JPoolBlock *b = (JPoolBlock *) mem;
+    b->next = cache.free[k];
+    cache.free[k] = b;
+    if (++cache.count[k] > cache_limit(k)) {
+        j_pool_drain(k, cache_limit(k) / 2);
+    }
+}
+
+void j_pool_thread_flush(void)
+{
+    guint32 k;
+    for (k = 0; k < CLASS_COUNT; k++) {
+        if (cache.count[k] > 0) {
+            j_pool_drain(k, 0);
+        }
+        /* the rest of slab being carved is left for the others */
+        gchar *bump = cache.bump[k];
+        if (bump && bump + class_size(k) <= cache.end[k]) {
+            JPoolSpare *spare = (JPoolSpare *) bump;
+            JPoolDepot *depot = &depots[k];
+            spare->end = cache.end[k];
+            g_mutex_lock(&depot->lock);
+            spare->next = depot->spares;
+            depot->spares = spare;
+            g_mutex_unlock(&depot->lock);
+        }
+        cache.bump[k] = cache.end[k] = NULL;
+    }
+    for (k = 0; k < LARGE_CACHE_SLABS; k++) {
+        if (cache.large[k]) {
+            munmap(cache.large[k], cache.large[k]->size);
+            cache.large[k] = NULL;
+        }
+    }
+    /* anything freed after this is flushed again */
+    cache.registered = FALSE;
+}
+
+gsize j_pool_block_size(gpointer mem)
+{
+    JPoolSlab *slab = j_pool_slab(mem);
+    if (slab->klass == CLASS_LARGE) {
+        return slab->size - SLAB_HEADER_SIZE;
+    }
+    return class_size(slab->klass);
+}
+
+gpointer j_pool_realloc(gpointer mem, gsize size)
+{
+    if (mem == NULL) {
+        return j_pool_alloc(size);
+    }
+    gsize old = j_pool_block_size(mem);
+    if (old >= size) {
+        return mem;
+    }
+    gpointer new_mem = j_pool_alloc(size);
+    memcpy(new_mem, mem, old);
+    j_pool_free(mem);
+    return new_mem;
+}
@@ -0,0 +1,87 @@
+/*
+ * jpool.h
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __J_POOL_H__
+#define __J_POOL_H__
+
+#include <glib.h>
+
+/*
+ * JPool - size-classed memory pool for objects and buffers
+ *
+ * Memory is carved from 2MB slabs, one size class per slab.
+ * Every thread keeps its own free list of every class, so allocating and
+ * freeing take no lock; a thread that frees more than it allocates
+ * (like a worker freeing connections accepted by the server) gives the
+ * extra blocks back to a shared depot, where the others take them from.
+ * When a thread exits, all its free blocks go to the depot.
+ * Slabs are never returned to the system.
+ *
+ * Blocks larger than the biggest class are mapped one by one.
+ * When freed, every thread keeps one mapping of every size up to 8MB
+ * for the next block of that size, and unmaps the others.
+ */
+
+
+/*
+ * Allocates a block of at least size bytes, never returns NULL
+ */
+gpointer j_pool_alloc(gsize size);
+
+/*
+ * Allocates a block filled with zero
+ */
+gpointer j_pool_alloc0(gsize size);
+
+/*
+ * Frees a block allocated by j_pool_alloc(), mem can be NULL
+ * It can be called in any thread, and used as GDestroyNotify
+ */
+void j_pool_free(gpointer mem);
+
+/*
+ * Gets the real size of block, which may be larger than the size asked
+ */
+gsize j_pool_block_size(gpointer mem);
+
+/*
+ * Resizes the block, the data is kept
+ * The block is not moved if it's large enough already
+ */
+gpointer j_pool_realloc(gpointer mem, gsize size);
+
+/*
+ * Gives the free blocks cached by current thread back to the depot,
+ * and unmaps the large blocks it keeps
+ * It's called automatically when a thread that used JPool exits
+ */
+void j_pool_thread_flush(void);
+
+/*
+ * Uses hugepages for slabs allocated later, if the system supports
+ */
+void j_pool_set_hugepages(gboolean enable);
+
+/*
+ * Gets the count of slabs and large blocks mapped by current thread
+ * It stops growing once the pool is warm
+ */
+guint64 j_pool_get_map_count(void);
+
+
+#endif                          /* __J_POOL_H__ */
@@ -19,36 +19,116 @@
 
 #include "jsocket.h"
 #include "pack.h"
+#include "jpool.h"
 #include <glib.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
 
 
-/* macros for read buffer */
-#define j_socket_set_rdata_length(jsock, len) g_byte_array_set_size((jsock)->rbuf,(len))
-#define j_socket_clear_rdata(jsock)  j_socket_set_rdata_length((jsock),0)
-#define j_socket_append_rdata(jsock,data,len) g_byte_array_append((jsock)->rbuf,(void*)(data),(len))
-#define j_socket_total_length(jsock) (jsock)->total_len
-#define j_socket_set_total_length(jsock, len) (jsock)->total_len = (len)
-#define j_socket_left_length(jsock) j_socket_total_length(jsock) - j_socket_data_length(jsock)
+/*
+ * The read buffer is allocated at the first read, READ_BUFFER_SIZE bytes,
+ * and doubled when a package doesn't fit in it.
+ * Every read needs at least READ_BUFFER_MIN bytes free at the end
+ */
+#define READ_BUFFER_SIZE    (64 * 1024)
+#define READ_BUFFER_MIN     4096
 
-/* macros for write buffer */
-#define j_socket_set_wdata_length(jsock, len) g_byte_array_set_size((jsock)->wbuf,(len))
-#define j_socket_clear_wdata(jsock) j_socket_set_wdata_length((jsock),0)
-#define j_socket_wdata_length(jsock)    (jsock)->wbuf->len
-#define j_socket_wdata(jsock)   (jsock)->wbuf->data
-#define j_socket_wdata_pop(jsock,len)   g_byte_array_remove_range((jsock)->wbuf,0,len)
-#define j_socket_wdata_append(jsock,data,len)   g_byte_array_append((jsock)->wbuf,(void*)(data),(len))
+/*
+ * A package longer than max_package is invalid,
+ * so a peer can't make the read buffer grow without bound
+ */
+#define DEFAULT_MAX_PACKAGE (16 * 1024 * 1024)
+static guint32 max_package = DEFAULT_MAX_PACKAGE;
 
+/*
+ * A segment in write queue
+ * The header of package is stored in head, and data is NULL then
+ * A range of file has fd, and is sent by sendfile()
+ */
+typedef struct {
+    const void *data;
+    gsize len;
+    GDestroyNotify destroy;
+    gpointer destroy_data;
+    gint fd;                    /* -1 if it's not a file */
+    gchar head[4];
+    off_t offset;
+} JSocketSegment;
+
+#define j_socket_segment_data(seg) ((seg)->data?(seg)->data:(seg)->head)
+#define j_socket_segment_is_file(seg)   ((seg)->fd>=0)
+#define j_socket_segment(jsock,i) (((JSocketSegment*)(jsock)->wqueue)+(i))
+
+/* the max segments writen by one syscall */
+#define WRITE_IOV_MAX   64
+/* the writen segments are removed from the queue only when this many */
+#define WRITE_QUEUE_COMPACT 32
+/* the initial capacity of write queue */
+#define WRITE_QUEUE_SIZE    16
 
-#define j_socket_update_active(jsock)   (jsock)->active=(guint64)time(NULL)
+/*
+ * A segment (or the data it belongs to) writen with MSG_ZEROCOPY,
+ * released after the kernel acknowledges the send id
+ */
+typedef struct {
+    guint32 id;
+    GDestroyNotify destroy;
+    gpointer destroy_data;
+} JSocketRelease;
+
+/*
+ * Every successful sendmsg() with MSG_ZEROCOPY takes the next id,
+ * the kernel acknowledges ranges of them.
+ * TCP acknowledges them in order, so all sends before done are completed
+ */
+typedef struct {
+    gsize threshold;
+    guint32 next;               /* the id of next send */
+    guint32 done;               /* the first send not acknowledged */
+    JSocketRelease *releases;
+    guint32 rcount;
+    guint32 rstart;
+    guint32 rcapacity;
+} JSocketZeroCopy;
+
+#define j_socket_zerocopy_busy(zc)  ((zc)->next!=(zc)->done)
+
+
+#define j_socket_update_active(jsock)   (jsock)->active=j_socket_get_clock()
+
+
+/* the coarse clock of current thread, 0 if not set */
+static __thread guint64 coarse_clock = 0;
+
+void j_socket_set_max_package(guint32 max)
+{
+    max_package = max > 0 ? max : DEFAULT_MAX_PACKAGE;
+}
+
+void j_socket_set_clock(guint64 now)
+{
+    coarse_clock = now;
+}
+
+guint64 j_socket_get_clock(void)
+{
+    if (G_UNLIKELY(coarse_clock == 0)) {
+        return (guint64) time(NULL);
+    }
+    return coarse_clock;
+}
 
 /*
  * Creates a new JSocket from a native socket descriptor
@@ -56,30 +136,54 @@
 JSocket *j_socket_new_fromfd(gint sockfd, struct sockaddr * addr,
                              socklen_t addrlen)
 {
-    JSocket *jsock = (JSocket *) g_slice_alloc(sizeof(JSocket));
+    JSocket *jsock = (JSocket *) j_pool_alloc(sizeof(JSocket));
     jsock->sockfd = sockfd;
-    jsock->rbuf = g_byte_array_new();
-    jsock->wbuf = g_byte_array_new();
-    jsock->total_len = 0;
+    jsock->rbuf = NULL;
+    jsock->rsize = 0;
+    jsock->rstart = jsock->rend = 0;
+    jsock->frame = NULL;
+    jsock->frame_len = 0;
+    jsock->wqueue = NULL;
+    jsock->wcount = 0;
+    jsock->wcapacity = 0;
+    jsock->wstart = 0;
+    jsock->woffset = 0;
+    jsock->wlength = 0;
+    jsock->zerocopy = NULL;
+    jsock->poll_data = NULL;
+    jsock->load_time = jsock->last_time = 0;
+    jsock->load_events = jsock->last_events = 0;
+    jsock->persistent = FALSE;
+    jsock->poll_link.data = jsock;
+    jsock->poll_link.prev = jsock->poll_link.next = NULL;
+    jsock->timer_link.data = jsock;
+    jsock->timer_link.prev = jsock->timer_link.next = NULL;
+    jsock->timer_slot = 0;
+    jsock->events = 0;
+    jsock->flag = 0;
+    jsock->ptr = NULL;
+    jsock->ptr_destroy = NULL;
     j_socket_update_active(jsock);
 
     if (addr) {
         memcpy(&(jsock->addr), addr, addrlen);
+        jsock->addrlen = addrlen;
     } else {
         memset(&(jsock->addr), 0, sizeof(jsock->addr));
+        jsock->addrlen = 0;
     }
 
     return jsock;
 }
 
-/*
- * Creates a new passive IPv4 socket, which listens on port
- *
- * Returns NULL on error;
- */
-JSocket *j_server_socket_new(gushort port, guint32 backlog)
+static JSocket *j_server_socket_new_full(gushort port, guint32 backlog,
+                                        gboolean reuseport)
 {
-    gint sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    gint type = SOCK_STREAM;
+    if (reuseport) {
+        type |= SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    gint sockfd = socket(AF_INET, type, 0);
     if (sockfd < 0) {
         return NULL;
     }
@@ -87,6 +191,11 @@ JSocket *j_server_socket_new(gushort port, guint32 backlog)
     gint set = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const gchar *) &set,
                sizeof(set));
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                                (const gchar *) &set, sizeof(set)) < 0) {
+        close(sockfd);
+        return NULL;
+    }
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -107,6 +216,56 @@ JSocket *j_server_socket_new(gushort port, guint32 backlog)
                                sizeof(addr));
 }
 
+/*
+ * Creates a new passive IPv4 socket, which listens on port
+ *
+ * Returns NULL on error;
+ */
+JSocket *j_server_socket_new(gushort port, guint32 backlog)
+{
+    return j_server_socket_new_full(port, backlog, FALSE);
+}
+
+/*
+ * Creates a new non-blocking passive IPv4 socket with SO_REUSEPORT
+ * Returns NULL on error
+ */
+JSocket *j_server_socket_new_reuseport(gushort port, guint32 backlog)
+{
+    return j_server_socket_new_full(port, backlog, TRUE);
+}
+
+/*
+ * Attaches a classic BPF program to the SO_REUSEPORT group of jsock,
+ * a chain of jeq, one for every pinned socket, returning its index.
+ * The index count is out of the group, so the kernel falls back to hashing
+ */
+gint j_socket_reuseport_steer_cpu(JSocket * jsock, const gint * cpus,
+                                  guint32 count)
+{
+    if (count == 0 || count > (BPF_MAXINSNS - 2) / 2) {
+        return 0;
+    }
+    struct sock_filter code[count * 2 + 2];
+    guint32 i, n = 0;
+    code[n++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (i = 0; i < count; i++) {
+        if (cpus[i] < 0) {
+            continue;
+        }
+        code[n++] = (struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (guint32) cpus[i], 0, 1);
+        code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, count);
+    struct sock_fprog prog;
+    prog.len = n;
+    prog.filter = code;
+    return !setsockopt(j_socket_fd(jsock), SOL_SOCKET,
+                       SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
 /*
  * Creates a new client IPv4 socket, connect to remote in blocking way
  * Returns NULL on error
@@ -139,7 +298,7 @@ JSocket *j_client_socket_new(const gchar * remote, gushort port)
 JSocket *j_socket_accept(JSocket * jsock)
 {
     struct sockaddr_storage addr;
-    socklen_t addrlen;
+    socklen_t addrlen = sizeof(addr);
 
     gint fd =
         j_socket_accept_raw(jsock, (struct sockaddr *) &addr, &addrlen);
@@ -150,15 +309,59 @@ JSocket *j_socket_accept(JSocket * jsock)
     return j_socket_new_fromfd(fd, (struct sockaddr *) &addr, addrlen);
 }
 
+/*
+ * Accepts a connection from a non-blocking passive socket
+ * Returns NULL if no pending connection (errno is EAGAIN) or on error
+ */
+JSocket *j_socket_accept_nonblock(JSocket * jsock)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    gint fd;
+  AGAIN:
+    fd = accept4(j_socket_fd(jsock), (struct sockaddr *) &addr, &addrlen,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+            goto AGAIN;
+        }
+        return NULL;
+    }
+    j_socket_update_active(jsock);
+    return j_socket_new_fromfd(fd, (struct sockaddr *) &addr, addrlen);
+}
+
 /*
  * Closes the JSocket
  */
 void j_socket_close(JSocket * jsock)
 {
+    if (jsock->ptr_destroy) {
+        jsock->ptr_destroy(jsock->ptr);
+    }
     close(j_socket_fd(jsock));
-    g_byte_array_free(jsock->rbuf, TRUE);
-    g_byte_array_free(jsock->wbuf, TRUE);
-    g_slice_free1(sizeof(JSocket), jsock);
+    j_pool_free(jsock->rbuf);
+    guint i;
+    for (i = jsock->wstart; i < jsock->wcount; i++) {
+        JSocketSegment *seg = j_socket_segment(jsock, i);
+        if (seg->destroy) {
+            seg->destroy(seg->destroy_data);
+        }
+    }
+    j_pool_free(jsock->wqueue);
+    JSocketZeroCopy *zc = (JSocketZeroCopy *) jsock->zerocopy;
+    if (zc) {
+        /*
+         * released even if not acknowledged, the kernel may still send it,
+         * j_socket_linger() first to be safe
+         */
+        for (i = zc->rstart; i < zc->rcount; i++) {
+            zc->releases[i].destroy(zc->releases[i].destroy_data);
+        }
+        j_pool_free(zc->releases);
+        j_pool_free(zc);
+    }
+    j_pool_free(jsock);
 }
 
 gint j_socket_accept_raw(JSocket * jsock, struct sockaddr *addr,
@@ -199,6 +402,31 @@ gint j_socket_write_raw(JSocket * jsock, const void *rbuf, guint32 count)
     return n;
 }
 
+static inline gssize j_socket_sendmsg(JSocket * jsock,
+                                      const struct iovec *iov,
+                                      gint iovcnt, gint flags)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+    gssize n;
+  AGAIN:
+    errno = 0;
+    n = sendmsg(j_socket_fd(jsock), &msg,
+                MSG_DONTWAIT | MSG_NOSIGNAL | flags);
+    if (n < 0 && errno == EINTR) {
+        goto AGAIN;
+    }
+    return n;
+}
+
+gssize j_socket_writev_raw(JSocket * jsock, const struct iovec *iov,
+                           gint iovcnt)
+{
+    return j_socket_sendmsg(jsock, iov, iovcnt, 0);
+}
+
 gint j_socket_read_raw(JSocket * jsock, void *buf, guint32 count)
 {
     gint sockfd = j_socket_fd(jsock);
@@ -212,66 +440,516 @@ gint j_socket_read_raw(JSocket * jsock, void *buf, guint32 count)
     return n;
 }
 
+void j_socket_queue(JSocket * jsock, const void *data, gsize len,
+                    GDestroyNotify destroy, gpointer destroy_data)
+{
+    if (jsock->wstart >= WRITE_QUEUE_COMPACT) {
+        memmove(jsock->wqueue, j_socket_segment(jsock, jsock->wstart),
+                sizeof(JSocketSegment) * (jsock->wcount - jsock->wstart));
+        jsock->wcount -= jsock->wstart;
+        jsock->wstart = 0;
+    }
+    if (jsock->wcount == jsock->wcapacity) {
+        guint32 capacity = MAX(WRITE_QUEUE_SIZE, jsock->wcapacity * 2);
+        jsock->wqueue = j_pool_realloc(jsock->wqueue,
+                                       sizeof(JSocketSegment) * capacity);
+        jsock->wcapacity = j_pool_block_size(jsock->wqueue) /
+            sizeof(JSocketSegment);
+    }
+    JSocketSegment *seg = j_socket_segment(jsock, jsock->wcount++);
+    seg->data = data;
+    seg->len = len;
+    seg->destroy = destroy;
+    seg->destroy_data = destroy_data;
+    seg->fd = -1;
+    if (data == NULL && len != 0) {     /* must be a mistake */
+        seg->len = 0;
+    }
+    jsock->wlength += seg->len;
+}
+
+void j_socket_queue_header(JSocket * jsock, guint32 length)
+{
+    j_socket_queue(jsock, NULL, 0, NULL, NULL);
+    JSocketSegment *seg = j_socket_segment(jsock, jsock->wcount - 1);
+    pack_length4_into(length, seg->head);
+    seg->len = 4;
+    jsock->wlength += 4;
+}
+
+void j_socket_queue_file(JSocket * jsock, gint fd, off_t offset, gsize len,
+                         GDestroyNotify destroy, gpointer destroy_data)
+{
+    j_socket_queue(jsock, NULL, 0, destroy, destroy_data);
+    JSocketSegment *seg = j_socket_segment(jsock, jsock->wcount - 1);
+    seg->fd = fd;
+    seg->offset = offset;
+    seg->len = len;
+    jsock->wlength += len;
+}
+
+/*
+ * Sends the rest of a file segment
+ * The file is shorter than the segment if nothing is sent, that's an error
+ */
+static inline gssize j_socket_sendfile(JSocket * jsock,
+                                       JSocketSegment * seg)
+{
+    off_t offset = seg->offset + jsock->woffset;
+    gsize count = seg->len - jsock->woffset;
+    gssize n;
+  AGAIN:
+    errno = 0;
+    n = sendfile(j_socket_fd(jsock), seg->fd, &offset, count);
+    if (n < 0 && errno == EINTR) {
+        goto AGAIN;
+    } else if (n == 0 && count > 0) {
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * Releases the data writen
+ * If some MSG_ZEROCOPY sends are not acknowledged, the kernel may still use
+ * the data (a segment without destroy may point into the data released by
+ * a later one), so it's released after the last send is acknowledged
+ */
+static inline void j_socket_release(JSocket * jsock, GDestroyNotify destroy,
+                                    gpointer destroy_data)
+{
+    JSocketZeroCopy *zc = (JSocketZeroCopy *) jsock->zerocopy;
+    if (zc == NULL || !j_socket_zerocopy_busy(zc)) {
+        destroy(destroy_data);
+        return;
+    }
+    if (zc->rstart >= WRITE_QUEUE_COMPACT) {
+        memmove(zc->releases, zc->releases + zc->rstart,
+                sizeof(JSocketRelease) * (zc->rcount - zc->rstart));
+        zc->rcount -= zc->rstart;
+        zc->rstart = 0;
+    }
+    if (zc->rcount == zc->rcapacity) {
+        guint32 capacity = MAX(WRITE_QUEUE_SIZE, zc->rcapacity * 2);
+        zc->releases = j_pool_realloc(zc->releases,
+                                      sizeof(JSocketRelease) * capacity);
+        zc->rcapacity = j_pool_block_size(zc->releases) /
+            sizeof(JSocketRelease);
+    }
+    JSocketRelease *r = zc->releases + zc->rcount++;
+    r->id = zc->next - 1;
+    r->destroy = destroy;
+    r->destroy_data = destroy_data;
+}
+
+/*
+ * Removes count bytes writen from the queue
+ * Segments are released as soon as they are writen completely
+ */
+static inline void j_socket_queue_pop(JSocket * jsock, gsize count)
+{
+    jsock->wlength -= count;
+    while (jsock->wstart < jsock->wcount) {
+        JSocketSegment *seg = j_socket_segment(jsock, jsock->wstart);
+        gsize left = seg->len - jsock->woffset;
+        if (count < left) {
+            jsock->woffset += count;
+            return;
+        }
+        count -= left;
+        if (seg->destroy) {
+            j_socket_release(jsock, seg->destroy, seg->destroy_data);
+        }
+        jsock->wstart++;
+        jsock->woffset = 0;
+    }
+}
+
+/*
+ * If the segment is sent with MSG_ZEROCOPY
+ * Headers are stored in the queue itself, which moves, so they're copied
+ */
+#define j_socket_segment_zerocopy(zc,seg)   \
+    ((zc)&&(seg)->data&&(seg)->len>=(zc)->threshold)
+
+/*
+ * Collects the segments at the head of queue sent in the same way,
+ * MSG_ZEROCOPY or not, into at most max iovecs
+ * Files are sent one by one, so it stops at a file
+ * If heads is not NULL, package headers are copied into it
+ */
+static inline gint j_socket_collect(JSocket * jsock, struct iovec *iov,
+                                    guint32 * heads, gint max,
+                                    gboolean * zerocopy)
+{
+    JSocketZeroCopy *zc = (JSocketZeroCopy *) jsock->zerocopy;
+    JSocketSegment *first = j_socket_segment(jsock, jsock->wstart);
+    gsize offset = jsock->woffset;
+    gint n = 0;
+    guint i;
+    *zerocopy = j_socket_segment_zerocopy(zc, first);
+    for (i = jsock->wstart; i < jsock->wcount && n < max; i++) {
+        JSocketSegment *seg = j_socket_segment(jsock, i);
+        if (seg->len > offset) {
+            if (j_socket_segment_is_file(seg)
+                || j_socket_segment_zerocopy(zc, seg) != *zerocopy) {
+                break;
+            }
+            const gchar *data = j_socket_segment_data(seg);
+            if (heads && seg->data == NULL) {
+                memcpy(heads + n, seg->head, sizeof(seg->head));
+                data = (const gchar *) (heads + n);
+            }
+            iov[n].iov_base = (gchar *) data + offset;
+            iov[n].iov_len = seg->len - offset;
+            n++;
+        }
+        offset = 0;
+    }
+    return n;
+}
+
+/* the queue is empty, the segments are reused from the beginning */
+static inline void j_socket_queue_reset(JSocket * jsock)
+{
+    jsock->wcount = 0;
+    jsock->wstart = 0;
+    jsock->woffset = 0;
+    jsock->wlength = 0;
+}
+
+gint j_socket_flush(JSocket * jsock)
+{
+    j_socket_update_active(jsock);
+    JSocketZeroCopy *zc = (JSocketZeroCopy *) jsock->zerocopy;
+    struct iovec iov[WRITE_IOV_MAX];
+    while (jsock->wstart < jsock->wcount) {
+        JSocketSegment *first = j_socket_segment(jsock, jsock->wstart);
+        gboolean zerocopy;
+        gint n = j_socket_collect(jsock, iov, NULL, WRITE_IOV_MAX,
+                                  &zerocopy);
+        gssize w = 0;
+        if (n == 0 && j_socket_segment_is_file(first)) {
+            w = j_socket_sendfile(jsock, first);
+            if (w < 0) {
+                if (errno == EAGAIN) {
+                    return 0;
+                }
+                return -1;
+            }
+        } else if (n > 0) {
+#ifdef MSG_ZEROCOPY
+            if (zerocopy) {
+                w = j_socket_sendmsg(jsock, iov, n, MSG_ZEROCOPY);
+                if (w >= 0) {
+                    zc->next++;
+                } else if (errno == ENOBUFS) {  /* out of optmem, copy it */
+                    w = j_socket_writev_raw(jsock, iov, n);
+                }
+            } else
+#endif
+                w = j_socket_writev_raw(jsock, iov, n);
+            if (w < 0) {
+                if (errno == EAGAIN) {
+                    return 0;
+                }
+                return -1;      /* It's a real error */
+            }
+        }
+        j_socket_queue_pop(jsock, w);
+    }
+    j_socket_queue_reset(jsock);
+    return 1;
+}
+
+gint j_socket_gather(JSocket * jsock, struct iovec *iov, guint32 * heads,
+                     gint max, gint * flags)
+{
+    *flags = 0;
+    if (jsock->wstart >= jsock->wcount) {
+        return 0;
+    }
+    gboolean zerocopy;
+    gint n = j_socket_collect(jsock, iov, heads, max, &zerocopy);
+#ifdef MSG_ZEROCOPY
+    if (zerocopy) {
+        *flags = MSG_ZEROCOPY;
+    }
+#endif
+    return n;
+}
+
+void j_socket_sent(JSocket * jsock, gsize count, gint flags)
+{
+    j_socket_update_active(jsock);
+#ifdef MSG_ZEROCOPY
+    if (flags & MSG_ZEROCOPY) {
+        ((JSocketZeroCopy *) jsock->zerocopy)->next++;
+    }
+#endif
+    j_socket_queue_pop(jsock, count);
+    if (jsock->wstart >= jsock->wcount) {
+        j_socket_queue_reset(jsock);
+    }
+}
+
+gint j_socket_set_zerocopy(JSocket * jsock, gsize threshold)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (jsock->zerocopy) {
+        ((JSocketZeroCopy *) jsock->zerocopy)->threshold = threshold;
+        return 1;
+    }
+    gint set = 1;
+    if (setsockopt(j_socket_fd(jsock), SOL_SOCKET, SO_ZEROCOPY, &set,
+                   sizeof(set)) < 0) {
+        return 0;
+    }
+    JSocketZeroCopy *zc =
+        (JSocketZeroCopy *) j_pool_alloc0(sizeof(JSocketZeroCopy));
+    zc->threshold = MAX(threshold, 1);
+    jsock->zerocopy = zc;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Releases the data of sends acknowledged
+ */
+static inline void j_socket_zerocopy_release(JSocketZeroCopy * zc)
+{
+    while (zc->rstart < zc->rcount) {
+        JSocketRelease *r = zc->releases + zc->rstart;
+        if ((gint32) (r->id - zc->done) >= 0) {
+            break;
+        }
+        r->destroy(r->destroy_data);
+        zc->rstart++;
+    }
+    if (zc->rstart == zc->rcount) {
+        zc->rstart = zc->rcount = 0;
+    }
+}
+
+gint j_socket_zerocopy_complete(JSocket * jsock)
+{
+    JSocketZeroCopy *zc = (JSocketZeroCopy *) jsock->zerocopy;
+    if (zc == NULL) {
+        return 0;
+    }
+    gint count = 0;
+    gchar control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 2];
+    while (TRUE) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(j_socket_fd(jsock), &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;              /* EAGAIN, the queue is empty */
+        }
+        struct cmsghdr *cm;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                  || (cm->cmsg_level == SOL_IPV6
+                      && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err *err =
+                (struct sock_extended_err *) CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                /* like an ICMP error, the stream itself reports it if fatal */
+                continue;
+            }
+            if (err->ee_errno != 0) {
+                return -1;
+            }
+            /* [ee_info, ee_data] are acknowledged */
+            if ((gint32) (err->ee_data + 1 - zc->done) > 0) {
+                zc->done = err->ee_data + 1;
+            }
+            count++;
+        }
+    }
+    j_socket_zerocopy_release(zc);
+    return count;
+}
+
+guint32 j_socket_zerocopy_pending(JSocket * jsock)
+{
+    JSocketZeroCopy *zc = (JSocketZeroCopy *) jsock->zerocopy;
+    if (zc == NULL) {
+        return 0;
+    }
+    return zc->next - zc->done;
+}
+
+/*
+ * The data not writen may be the rest of a segment sent in part,
+ * so it's released after the sends too
+ */
+gboolean j_socket_linger(JSocket * jsock)
+{
+    JSocketZeroCopy *zc = (JSocketZeroCopy *) jsock->zerocopy;
+    if (zc == NULL || !j_socket_zerocopy_busy(zc)) {
+        return FALSE;
+    }
+    if (jsock->ptr_destroy) {
+        jsock->ptr_destroy(jsock->ptr);
+        jsock->ptr_destroy = NULL;
+    }
+    jsock->ptr = NULL;
+    j_pool_free(jsock->rbuf);
+    jsock->rbuf = NULL;
+    jsock->rsize = jsock->rstart = jsock->rend = 0;
+    jsock->frame = NULL;
+    jsock->frame_len = 0;
+    guint32 i;
+    for (i = jsock->wstart; i < jsock->wcount; i++) {
+        JSocketSegment *seg = j_socket_segment(jsock, i);
+        if (seg->destroy) {
+            j_socket_release(jsock, seg->destroy, seg->destroy_data);
+        }
+    }
+    j_socket_queue_reset(jsock);
+    j_socket_update_active(jsock);
+    shutdown(j_socket_fd(jsock), SHUT_RDWR);
+    return TRUE;
+}
+
 /*
  * Packs up the buf and write to socket in non-blocking way
  * If all data is writen, return 1
  * If only part of data is writen, return 0, to be continue next time
  * If error occurs, return -1
  *
+ * buf is copied, so it can be freed after this call.
  * Note, if j_socket_write() returns 0, then you can call it with NULL in buf next time, until all data is writen
  */
 gint j_socket_write(JSocket * jsock, const void *buf, guint32 count)
 {
-    j_socket_update_active(jsock);
-    guint32 size = j_socket_wdata_length(jsock);
-    if (size == 0) {
-        /* new data to write */
-        if (buf == NULL || count == 0) {
-            return 1;           /* no data? must be a mistake */
-        }
-        gchar *len = pack_length4(count);
-        j_socket_wdata_append(jsock, len, 4);
-        j_socket_wdata_append(jsock, buf, count);
-        g_free(len);
-        size = j_socket_wdata_length(jsock);
+    if (buf != NULL && count > 0) {
+        j_socket_queue_header(jsock, count);
+        gpointer data = j_pool_alloc(count);
+        memcpy(data, buf, count);
+        j_socket_queue(jsock, data, count, j_pool_free, data);
     }
+    return j_socket_flush(jsock);
+}
 
-    gint n;
-    count = size > 4096 ? 4096 : size;
 
-    while (count > 0) {         /* writes segmentation */
-        n = j_socket_write_raw(jsock, j_socket_wdata(jsock), count);
-        if (n < 0) {
-            if (errno == EAGAIN) {
-                return 0;
+/*
+ * Makes room for the next read, at least need bytes
+ * The unparsed data is moved to the beginning of buffer only when the free
+ * space at the end is not enough, so normally the partial package is not
+ * copied at all. If the partial package fills the buffer, the buffer grows
+ * Returns FALSE if the buffer would be larger than G_MAXUINT32
+ */
+static inline gboolean j_socket_reserve_rdata(JSocket * jsock, guint32 need)
+{
+    need = MAX(need, READ_BUFFER_MIN);
+    if (jsock->rstart == jsock->rend) {
+        jsock->rstart = jsock->rend = 0;
+    }
+    if (jsock->rsize - jsock->rend >= need) {
+        return TRUE;
+    }
+    if (jsock->rstart > 0) {
+        memmove(jsock->rbuf, jsock->rbuf + jsock->rstart,
+                jsock->rend - jsock->rstart);
+        jsock->rend -= jsock->rstart;
+        jsock->rstart = 0;
+    }
+    if (jsock->rsize - jsock->rend < need) {
+        gsize size = jsock->rsize == 0 ? READ_BUFFER_SIZE : jsock->rsize;
+        while (size - jsock->rend < need) {
+            if (size > G_MAXUINT32 / 2) {
+                errno = ENOMEM;
+                return FALSE;
             }
-            return -1;          /* It's a real error */
+            size *= 2;
         }
-        j_socket_wdata_pop(jsock, n);
-        size = j_socket_wdata_length(jsock);
-        count = size > 4096 ? 4096 : size;
+        jsock->rbuf = (gchar *) j_pool_realloc(jsock->rbuf, size);
+        jsock->rsize = size;
     }
-    return 1;
+    return TRUE;
 }
 
+/*
+ * Receives data into the read buffer
+ * One recv() is enough, if it fills the buffer, the socket is still readable
+ * and will be read again after the packages parsed
+ */
+gint j_socket_recv(JSocket * jsock)
+{
+    j_socket_update_active(jsock);
+    if (!j_socket_reserve_rdata(jsock, READ_BUFFER_MIN)) {
+        return -1;
+    }
+    jsock->frame = NULL;
+    jsock->frame_len = 0;
+
+    gint n = j_socket_read_raw(jsock, jsock->rbuf + jsock->rend,
+                               jsock->rsize - jsock->rend);
+    if (n < 0) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        return -1;
+    } else if (n == 0) {        /* EOF */
+        return -1;
+    }
+    jsock->rend += n;
+    return n;
+}
+
+gboolean j_socket_received(JSocket * jsock, const void *data, guint32 len)
+{
+    j_socket_update_active(jsock);
+    if (!j_socket_reserve_rdata(jsock, len)) {
+        return FALSE;
+    }
+    jsock->frame = NULL;
+    jsock->frame_len = 0;
+    memcpy(jsock->rbuf + jsock->rend, data, len);
+    jsock->rend += len;
+    return TRUE;
+}
 
 /*
- * Reads the length of a package
- * Returns 1 if success, 0 otherwise
+ * Parses the next package in read buffer, no data is copied
  */
-static gint j_socket_read_length(JSocket * jsock)
+gint j_socket_next_package(JSocket * jsock)
 {
-    gchar lenbuf[4];
-    gint n = j_socket_read_raw(jsock, lenbuf, 4);
-    if (n != 4) {               /* error */
+    guint32 avail = j_socket_unparsed_length(jsock);
+    if (avail == 0 && jsock->rbuf) {
+        /* all parsed, an idle connection doesn't hold the buffer */
+        j_pool_free(jsock->rbuf);
+        jsock->rbuf = NULL;
+        jsock->rsize = 0;
+        jsock->rstart = jsock->rend = 0;
+        jsock->frame = NULL;
+        jsock->frame_len = 0;
+        return 0;
+    }
+    if (avail < 4) {
         return 0;
     }
-    guint32 length = unpack_length4(lenbuf);
-    if (length == 0) {
+    guint32 length = unpack_length4(jsock->rbuf + jsock->rstart);
+    if (length == 0 || length > max_package) {
+        return -1;
+    }
+    if (avail - 4 < length) {
         return 0;
     }
-    j_socket_set_total_length(jsock, length);
-    j_socket_clear_rdata(jsock);
+    jsock->frame = jsock->rbuf + jsock->rstart + 4;
+    jsock->frame_len = length;
+    jsock->rstart += 4 + length;
     return 1;
 }
 
@@ -287,34 +965,14 @@ static gint j_socket_read_length(JSocket * jsock)
  */
 gint j_socket_read(JSocket * jsock)
 {
-    if (j_socket_total_length(jsock) == 0 && j_socket_read_length(jsock) == 0) {    /* read the length of a new package */
-        /* error */
-        return -1;
-    }
-    j_socket_update_active(jsock);
-
-    gchar databuf[4096];
-    gint32 left = j_socket_left_length(jsock);
-    guint32 count = sizeof(databuf) > left ? left : sizeof(databuf);
-    while (left > 0) {
-        gint n = j_socket_read_raw(jsock, databuf, count);  /* in non-blocking way */
-        if (n < 0) {
-            if (errno == EAGAIN) {
-                return 0;
-            }
-            return -1;
-        } else if (n == 0) {
-            return -1;
-        }
-        j_socket_append_rdata(jsock, databuf, n);
-        left = j_socket_left_length(jsock);
-        count = sizeof(databuf) > left ? left : sizeof(databuf);
+    gint ret = j_socket_next_package(jsock);
+    if (ret != 0) {
+        return ret;
     }
-    if (left != 0) {            /* unknown error, will hanppen? */
+    if (j_socket_recv(jsock) < 0) {
         return -1;
     }
-    j_socket_set_total_length(jsock, 0);    /* a whole package read successfully */
-    return 1;
+    return j_socket_next_package(jsock);
 }
 
 
@@ -323,5 +981,38 @@ gint j_socket_read(JSocket * jsock)
  */
 const gchar *j_socket_address(JSocket * jsock)
 {
-    return NULL;
+    static __thread gchar buf[J_SOCKET_ADDRESS_LENGTH];
+    gchar host[INET6_ADDRSTRLEN];
+    if (jsock->addrlen == 0) {
+        return NULL;
+    }
+    if (jsock->addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *) &jsock->addr;
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        g_snprintf(buf, sizeof(buf), "%s:%u", host, ntohs(in->sin_port));
+    } else if (jsock->addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &jsock->addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        g_snprintf(buf, sizeof(buf), "[%s]:%u", host,
+                   ntohs(in6->sin6_port));
+    } else if (jsock->addr.ss_family == AF_UNIX) {
+        struct sockaddr_un *un = (struct sockaddr_un *) &jsock->addr;
+        if (jsock->addrlen <= offsetof(struct sockaddr_un, sun_path)
+            || un->sun_path[0] == '\0') {
+            return "unix";      /* unnamed or abstract */
+        }
+        /* the path may fill sun_path without '\0' */
+        gsize len = MIN(jsock->addrlen - offsetof(struct sockaddr_un,
+                                                  sun_path),
+                        sizeof(un->sun_path));
+        const gchar *end = memchr(un->sun_path, '\0', len);
+        if (end) {
+            len = end - un->sun_path;
+        }
+        memcpy(buf, un->sun_path, len);
+        buf[len] = '\0';
+    } else {
+        return NULL;
+    }
+    return buf;
 }
@@ -20,8 +20,10 @@
 #ifndef __J_SOCKET_H__
 #define __J_SOCKET_H__
 
+#include <sys/types.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <glib.h>
 
 /*
@@ -29,42 +31,90 @@
  *
  * Every package starts with 4 bytes which means the length of rest data
  * When JSocket writes data, it preppend the 4 bytes,
- * When JSocket reads data, it parses the first 4 bytes and reads the real data,
- * in a non-blocking way
+ * When JSocket reads data, it receives as much as possible into a large buffer
+ * in a non-blocking way, then parses packages out of it one by one
  */
 typedef struct _JSocket JSocket;
 
+/*
+ * The fields used by every event are put together at the beginning,
+ * the rarely used ones (like the address) at the end,
+ * JSocket is allocated from JPool, so it's cache line aligned
+ */
 struct _JSocket {
+    /* hot */
     gint sockfd;                /* native socket descriptor */
+    guint32 events;             /* the events registered in JPoll */
+    gint64 flag;                /* extra data */
 
-    /* read buffer */
-    GByteArray *rbuf;
-    guint32 total_len;          /* the total size of the whole package */
+    /* read buffer, [rstart, rend) is received but not parsed yet */
+    gchar *rbuf;
+    guint32 rsize;
+    guint32 rstart;
+    guint32 rend;
+    guint32 frame_len;
+    const gchar *frame;         /* the last package parsed, points into rbuf */
 
-    /* write buffer */
-    GByteArray *wbuf;
+    guint64 active;             /* the timestamp of last action */
+    gpointer poll_data;         /* maintained by JPoll backend */
 
-    struct sockaddr_storage addr;
-    socklen_t addrlen;
+    /*
+     * the load of connection, maintained by the user,
+     * the time (ns) and events handled in current and last window
+     */
+    guint64 load_time;
+    guint32 load_events;
+    guint32 last_events;
+    guint64 last_time;
 
-    guint64 active;             /* the timestamp of last action */
+    /* write queue, segments not writen completely yet */
+    gpointer wqueue;
+    guint32 wcount;             /* segments in queue */
+    guint32 wstart;             /* the first segment not writen */
+    guint32 wcapacity;
+    gboolean persistent;        /* never removed by timeout, like listening sockets */
+    gsize woffset;              /* bytes of the first segment writen */
+    gsize wlength;              /* bytes not writen */
+    gpointer zerocopy;          /* MSG_ZEROCOPY state, NULL if disabled */
 
+    GList poll_link;            /* the link in JPoll, maintained by JPoll */
+    GList timer_link;           /* the link in JPoll timer wheel */
+    guint32 timer_slot;
 
-    /* extra data */
-    gint64 flag;
-    gpointer ptr;
+    /* cold */
+    gpointer ptr;               /* extra data */
+    GDestroyNotify ptr_destroy; /* called with ptr when closed, may be NULL */
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
 };
 /* use macros to access the members */
 
 #define j_socket_fd(jsock) (jsock)->sockfd
-/* get read buffer data & length */
-#define j_socket_data(jsock) ((void*)((jsock)->rbuf)->data)
-#define j_socket_data_length(jsock) (((jsock)->rbuf)->len)
+/* get the data & length of the last package parsed */
+#define j_socket_data(jsock) ((void*)(jsock)->frame)
+#define j_socket_data_length(jsock) ((jsock)->frame_len)
+/* the received data not parsed yet */
+#define j_socket_unparsed_length(jsock) ((jsock)->rend-(jsock)->rstart)
+/* if there is data in write queue */
+#define j_socket_write_pending(jsock) ((jsock)->wstart<(jsock)->wcount)
+/* the events registered in JPoll, 0 if not registered */
+#define j_socket_poll_events(jsock) ((jsock)->events)
+/* the bytes in write queue */
+#define j_socket_write_pending_length(jsock) ((jsock)->wlength)
+
+/* accounts the time (ns) spent on an event of JSocket */
+#define j_socket_load_add(jsock,ns) do{(jsock)->load_time+=(ns);(jsock)->load_events++;}while(0)
+/* ends the window of load accounting */
+#define j_socket_load_roll(jsock) do{(jsock)->last_time=(jsock)->load_time;(jsock)->last_events=(jsock)->load_events;(jsock)->load_time=0;(jsock)->load_events=0;}while(0)
+/* the load of last window */
+#define j_socket_load_time(jsock) ((jsock)->last_time)
+#define j_socket_load_events(jsock) ((jsock)->last_events)
 
 
 /* extra */
 #define j_socket_set_flag(jsock,f)   ((jsock)->flag=f)
 #define j_socket_set_pointer(jsock,ptr)   ((jsock)->ptr=ptr)
+#define j_socket_set_pointer_full(jsock,p,destroy)   do{(jsock)->ptr=(p);(jsock)->ptr_destroy=(destroy);}while(0)
 #define j_socket_get_flag(jsock)        ((jsock)->flag)
 #define j_socket_get_pointer(jsock)        ((jsock)->ptr)
 
@@ -72,12 +122,50 @@ struct _JSocket {
 /* get the timestamp of JSocket last action */
 #define j_socket_active_time(jsock) ((jsock)->active)
 
+/*
+ * Sets the coarse clock (in seconds) of current thread, which is used as
+ * the timestamp of JSocket actions instead of calling time() every time.
+ * JPoll updates it after every wait. If never set, time() is used
+ */
+void j_socket_set_clock(guint64 now);
+guint64 j_socket_get_clock(void);
+
+/*
+ * Sets the length of the largest package j_socket_next_package() accepts,
+ * for all JSocket. 0 restores the default, 16MB
+ */
+void j_socket_set_max_package(guint32 max);
+
+/* persistent JSocket is never removed by j_poll_remove_timeout() */
+#define j_socket_set_persistent(jsock,p)    ((jsock)->persistent=(p))
+#define j_socket_is_persistent(jsock)   ((jsock)->persistent)
+
 /*
  * Creates a new passive IPv4 socket, which listens on port
  * Returns NULL on error;
  */
 JSocket *j_server_socket_new(gushort port, guint32 backlog);
 
+/*
+ * Creates a new non-blocking passive IPv4 socket with SO_REUSEPORT,
+ * several of them can listen on the same port, the kernel distributes
+ * incoming connections among them.
+ * Returns NULL on error
+ */
+JSocket *j_server_socket_new_reuseport(gushort port, guint32 backlog);
+
+/*
+ * Attaches a classic BPF program to the SO_REUSEPORT group of jsock,
+ * which selects the i-th socket of the group for the connections
+ * received on CPU cpus[i]. A negative CPU is never matched,
+ * the connections received on CPUs not listed are hashed as without it.
+ * The i-th socket is the i-th one listening, when one is closed,
+ * the last one takes its place
+ * Returns 1 on success, 0 otherwise
+ */
+gint j_socket_reuseport_steer_cpu(JSocket * jsock, const gint * cpus,
+                                  guint32 count);
+
 /*
  * Creates a new client IPv4 socket, connect to remote in blocking way
  * Returns NULL on error
@@ -97,6 +185,13 @@ JSocket *j_socket_new_fromfd(gint sockfd, struct sockaddr *addr,
  */
 JSocket *j_socket_accept(JSocket * jsock);
 
+/*
+ * Accepts a connection from a non-blocking passive socket
+ * The new JSocket is non-blocking too
+ * Returns NULL if no pending connection (errno is EAGAIN) or on error
+ */
+JSocket *j_socket_accept_nonblock(JSocket * jsock);
+
 /*
  * Closes the JSocket
  */
@@ -106,6 +201,8 @@ void j_socket_close(JSocket * jsock);
 /* wrappers for syscalls, non-blocking */
 gint j_socket_write_raw(JSocket * jsock, const void *buf, guint32 count);
 gint j_socket_read_raw(JSocket * jsock, void *buf, guint32 count);
+gssize j_socket_writev_raw(JSocket * jsock, const struct iovec *iov,
+                           gint iovcnt);
 /* blocking */
 gint j_socket_accept_raw(JSocket * jsock, struct sockaddr *addr,
                          socklen_t * addrlen);
@@ -120,6 +217,125 @@ gint j_socket_accept_raw(JSocket * jsock, struct sockaddr *addr,
  */
 gint j_socket_write(JSocket * jsock, const void *buf, guint32 count);
 
+/*
+ * Queues the header of a package with length bytes of data,
+ * the data is queued by j_socket_queue() then
+ */
+void j_socket_queue_header(JSocket * jsock, guint32 length);
+
+/*
+ * Queues data to write without copying it
+ * After data is writen (or the JSocket is closed), destroy(destroy_data)
+ * is called if destroy is not NULL, so data must be valid until then.
+ * data can be NULL with len 0, to release destroy_data after all data
+ * queued before is writen
+ */
+void j_socket_queue(JSocket * jsock, const void *data, gsize len,
+                    GDestroyNotify destroy, gpointer destroy_data);
+
+/*
+ * Queues len bytes of file fd from offset, which are sent by sendfile()
+ * After sent (or the JSocket is closed), destroy(destroy_data) is called
+ * if destroy is not NULL, fd must be valid until then
+ */
+void j_socket_queue_file(JSocket * jsock, gint fd, off_t offset, gsize len,
+                         GDestroyNotify destroy, gpointer destroy_data);
+
+/*
+ * Writes the queued data in non-blocking way, with as few syscalls as possible
+ * Returns 1 if all data is writen
+ * Returns 0 if only part of data is writen, should continue next time
+ * Returns -1 if error occurs
+ */
+gint j_socket_flush(JSocket * jsock);
+
+/*
+ * Gathers the queued data into at most max iovecs for an asynchronous send,
+ * like the io_uring backend of JPoll does, instead of j_socket_flush().
+ * The send must use the flags returned, MSG_ZEROCOPY or not.
+ * The package headers are copied into heads (max of them), because the
+ * queue moves when more data is queued
+ * Returns the count of iovecs, 0 if the queue is empty or it starts
+ * with a file, which is sent by j_socket_flush()
+ */
+gint j_socket_gather(JSocket * jsock, struct iovec *iov, guint32 * heads,
+                     gint max, gint * flags);
+
+/*
+ * Removes count bytes sent from the queue,
+ * when the send of the data gathered with flags completes
+ */
+void j_socket_sent(JSocket * jsock, gsize count, gint flags);
+
+/*
+ * Sends the queued segments of at least threshold bytes with MSG_ZEROCOPY,
+ * the kernel sends them from the user memory directly instead of copying.
+ * Such a segment (and everything queued after it) is released only after
+ * the kernel acknowledges it, the acknowledgements arrive in the error queue
+ * of socket, J_POLL_EVENT_ERR is reported then, and they must be reaped by
+ * j_socket_zerocopy_complete()
+ * Returns 1 on success, 0 if the system doesn't support it
+ */
+gint j_socket_set_zerocopy(JSocket * jsock, gsize threshold);
+
+/*
+ * Reaps the acknowledgements of MSG_ZEROCOPY sends, releases the segments
+ * that are not used by the kernel any more
+ * Returns the count of acknowledgements reaped, 0 if none,
+ * the other messages in the error queue are skipped
+ * Returns -1 if a MSG_ZEROCOPY send failed
+ */
+gint j_socket_zerocopy_complete(JSocket * jsock);
+
+/*
+ * Gets the count of MSG_ZEROCOPY sends not acknowledged yet
+ */
+guint32 j_socket_zerocopy_pending(JSocket * jsock);
+
+/*
+ * Gives the connection up, but keeps what the kernel may still use
+ * if some MSG_ZEROCOPY sends are not acknowledged: the user's pointer is
+ * destroyed, the connection is shut down, and the data queued is released
+ * after the sends. The descriptor is kept for the acknowledgements,
+ * reap them with j_socket_zerocopy_complete() and close it when
+ * j_socket_zerocopy_pending() drops to 0; j_socket_active_time() is when
+ * it started lingering
+ * Returns FALSE if no send is pending, close it at once
+ */
+gboolean j_socket_linger(JSocket * jsock);
+
+/*
+ * Receives as much data as the read buffer can hold, in non-blocking way
+ * Packages are not parsed, call j_socket_next_package() to get them
+ * Returns the count of bytes received, 0 if nothing to receive
+ * Returns -1 if error occurs or the peer closed the connection
+ *
+ * The data of packages parsed before becomes invalid
+ * The read buffer is allocated from JPool, and released when all data
+ * in it is parsed
+ */
+gint j_socket_recv(JSocket * jsock);
+
+/*
+ * Appends len bytes received by somebody else (like the io_uring backend
+ * of JPoll) to the read buffer, as j_socket_recv() does
+ * Returns FALSE if the read buffer can't hold them
+ */
+gboolean j_socket_received(JSocket * jsock, const void *data, guint32 len);
+
+/*
+ * Parses the next package from data received
+ * Returns 1 if a whole package is parsed
+ * Returns 0 if not all data of the package received yet
+ * Returns -1 if the package is invalid, or longer than the max package
+ *
+ * After a package parsed,
+ * call j_socket_data() to get the data
+ * call j_socket_data_length() to get the data length
+ * they are valid until next j_socket_recv() or j_socket_next_package()
+ */
+gint j_socket_next_package(JSocket * jsock);
+
 /*
  * Reads a whole package
  * Returns 0 if not all data recevied (should continue next time)
@@ -132,8 +348,16 @@ gint j_socket_write(JSocket * jsock, const void *buf, guint32 count);
  */
 gint j_socket_read(JSocket * jsock);
 
+#define j_socket_sockaddr(jsock)    ((struct sockaddr*)&(jsock)->addr)
+#define j_socket_sockaddr_length(jsock) ((jsock)->addrlen)
+
+/* the size of string j_socket_address() returns at most, with '\0' */
+#define J_SOCKET_ADDRESS_LENGTH MAX(INET6_ADDRSTRLEN + 8, sizeof(((struct sockaddr_un*)0)->sun_path) + 1)
+
 /*
- * Gets the socket address
+ * Gets the socket address, like "127.0.0.1:80", "[::1]:80" or the path of
+ * unix socket, NULL if it's unknown
+ * The string is valid until the next call in the same thread
  */
 const gchar *j_socket_address(JSocket * jsock);
 
@@ -0,0 +1,1157 @@
+/*
+ * juring.c
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "juring.h"
+#include "jpool.h"
+#include <glib.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define J_HAVE_URING 1
+#endif
+#endif
+
+#ifdef J_HAVE_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+
+/*
+ * The requests of a registration, the kind is stored in the low bits of
+ * user_data, registrations are allocated from JPool, so they're aligned
+ */
+#define J_URING_OP_POLL     0
+#define J_URING_OP_RECV     1
+#define J_URING_OP_SEND     2
+#define J_URING_OP_ACCEPT   3
+#define J_URING_OP_MASK     ((guint64) 7)
+
+#define j_uring_op_bit(op)  (1U<<(op))
+#define j_uring_user_data(jrp,op)   ((guint64)(guintptr)(jrp)|(op))
+
+/* user_data of the read request on the wakeup eventfd, no registration at 0 */
+#define J_URING_WAKE    ((guint64) J_URING_OP_RECV)
+
+/*
+ * The provided buffers of multishot recv, shared by all streams of a ring
+ * A buffer is given back as soon as its data is appended to the read buffer
+ */
+#define J_URING_BUFFER_GROUP    0
+#define J_URING_BUFFER_COUNT    256     /* power of 2 */
+#define J_URING_BUFFER_SIZE     (16 * 1024)
+
+/* the max segments of one sendmsg request */
+#define J_URING_IOV_MAX     16
+
+/* the completion queue is larger, every multishot request posts many */
+#define J_URING_CQ_FACTOR   8
+
+typedef enum {
+    J_URING_POLL,               /* watched by a poll request */
+    J_URING_STREAM,             /* received and sent by the ring */
+    J_URING_PASSIVE,            /* accepted by the ring */
+} JURingKind;
+
+typedef enum {
+    J_URING_QUEUE_NONE,
+    J_URING_QUEUE_PENDING,      /* added by j_uring_add(), protected by lock */
+    J_URING_QUEUE_ARM,          /* waits to be re-armed, owner only */
+} JURingQueue;
+
+struct _JURingPoll {
+    gint fd;
+    JURingKind kind;
+    guint32 events;
+    gpointer data;              /* NULL after j_uring_delete() */
+    guint32 inflight;           /* the requests in the kernel, bits of op */
+    guint32 cancelled;          /* the requests being cancelled */
+    guint32 poll_mask;          /* the events of the poll request */
+    guint32 ready;              /* the events to report, in ready queue if not 0 */
+    JURingQueue queue;
+    GList link;                 /* the link of pending or arm queue */
+    GList alink;                /* the link of all registrations */
+    GList rlink;                /* the link of ready queue */
+
+    /* stream */
+    guint32 received;           /* the bytes not reported by j_uring_recv() */
+    gboolean closed;            /* EOF or an error of recv */
+    gboolean failed;            /* an error of send */
+    gboolean copy;              /* out of optmem, the next send copies */
+    gint send_flags;
+    struct msghdr msg;
+    struct iovec iov[J_URING_IOV_MAX];
+    guint32 heads[J_URING_IOV_MAX];     /* package headers being sent */
+
+    /* passive, the connections accepted but not taken */
+    gint *accepted;
+    guint32 acount;
+    guint32 astart;
+    guint32 acapacity;
+};
+
+struct _JURing {
+    gint fd;
+
+    /* submission queue, shared with the kernel */
+    guint32 *sq_head;
+    guint32 *sq_tail;
+    guint32 *sq_array;
+    guint32 sq_mask;
+    guint32 sq_entries;
+    guint32 sq_local;           /* our tail, published on submission */
+    struct io_uring_sqe *sqes;
+
+    /* completion queue, shared with the kernel */
+    guint32 *cq_head;
+    guint32 *cq_tail;
+    guint32 cq_mask;
+    struct io_uring_cqe *cqes;
+
+    gpointer ring_ptr;
+    gsize ring_size;
+    gsize sqes_size;
+
+    gboolean recv_multishot;    /* FALSE if the kernel rejected it */
+
+    /* provided buffer ring */
+    struct io_uring_buf_ring *br;
+    guint16 br_tail;            /* our tail, published after reaping */
+    gchar *buffers;
+
+    GQueue arm;
+    GQueue all;
+    GQueue ready;               /* registrations with events to report */
+
+    GMutex lock;
+    GQueue pending;
+
+    gint wakefd;
+    gint waiting;               /* the owner is blocking in j_uring_wait() */
+    guint64 wakebuf;
+};
+
+
+static inline gint sys_io_uring_setup(guint entries,
+                                      struct io_uring_params *p)
+{
+    return (gint) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline gint sys_io_uring_enter(gint fd, guint to_submit,
+                                      guint min_complete, guint flags,
+                                      gpointer arg, gsize argsz)
+{
+    return (gint) syscall(__NR_io_uring_enter, fd, to_submit,
+                          min_complete, flags, arg, argsz);
+}
+
+static inline gint sys_io_uring_register(gint fd, guint opcode,
+                                         gpointer arg, guint nr_args)
+{
+    return (gint) syscall(__NR_io_uring_register, fd, opcode, arg,
+                          nr_args);
+}
+
+
+/* the opcodes the ring submits */
+static const guint8 j_uring_ops[] = {
+    IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_ASYNC_CANCEL,
+    IORING_OP_READ, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ACCEPT
+};
+
+/*
+ * Asks the kernel if it supports all opcodes of j_uring_ops
+ * The flags are not covered, the provided buffer ring and multishot
+ * accept come with IORING_REGISTER_PBUF_RING, which j_uring_new() needs
+ * as well, multishot recv is dropped if a recv fails with EINVAL
+ */
+static inline gboolean j_uring_probe(gint fd)
+{
+    gsize size = sizeof(struct io_uring_probe) +
+        IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) g_malloc0(size);
+    gboolean ok =
+        sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+                              IORING_OP_LAST) >= 0;
+    guint i;
+    for (i = 0; ok && i < G_N_ELEMENTS(j_uring_ops); i++) {
+        guint8 op = j_uring_ops[i];
+        ok = op < probe->ops_len
+            && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    g_free(probe);
+    return ok;
+}
+
+#define j_uring_buffer(ring,bid)    \
+    ((ring)->buffers+(gsize)(bid)*J_URING_BUFFER_SIZE)
+
+/* gives a buffer back to the kernel, published by j_uring_publish_buffers() */
+static inline void j_uring_recycle(JURing * ring, guint16 bid)
+{
+    struct io_uring_buf *buf =
+        &ring->br->bufs[ring->br_tail & (J_URING_BUFFER_COUNT - 1)];
+    buf->addr = (guint64) (guintptr) j_uring_buffer(ring, bid);
+    buf->len = J_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+}
+
+static inline void j_uring_publish_buffers(JURing * ring)
+{
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Registers the provided buffer ring
+ * Returns FALSE on error
+ */
+static inline gboolean j_uring_setup_buffers(JURing * ring)
+{
+    gsize size = J_URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        ring->br = NULL;
+        return FALSE;
+    }
+    ring->buffers = mmap(NULL, J_URING_BUFFER_COUNT * J_URING_BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        return FALSE;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (guint64) (guintptr) ring->br;
+    reg.ring_entries = J_URING_BUFFER_COUNT;
+    reg.bgid = J_URING_BUFFER_GROUP;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)
+        < 0) {
+        return FALSE;
+    }
+    ring->br_tail = 0;
+    guint16 bid;
+    for (bid = 0; bid < J_URING_BUFFER_COUNT; bid++) {
+        j_uring_recycle(ring, bid);
+    }
+    j_uring_publish_buffers(ring);
+    return TRUE;
+}
+
+static inline void j_uring_unmap(JURing * ring)
+{
+    if (ring->buffers) {
+        munmap(ring->buffers, J_URING_BUFFER_COUNT * J_URING_BUFFER_SIZE);
+    }
+    if (ring->br) {
+        munmap(ring->br,
+               J_URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+}
+
+
+static inline void j_uring_queue_wake(JURing * ring);
+
+/*
+ * Creates a JURing with at least entries submission slots
+ * Returns NULL on error, or if the kernel doesn't support io_uring
+ */
+JURing *j_uring_new(guint entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * J_URING_CQ_FACTOR;
+    gint fd = sys_io_uring_setup(entries, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+    /* a single mmap() for both rings and a timeout argument of io_uring_enter() */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG) || !j_uring_probe(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    gsize sq_size = params.sq_off.array + params.sq_entries * sizeof(guint32);
+    gsize cq_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    gsize ring_size = MAX(sq_size, cq_size);
+    gchar *ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    gsize sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    gpointer sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ptr, ring_size);
+        close(fd);
+        return NULL;
+    }
+
+    JURing *ring = (JURing *) g_slice_alloc0(sizeof(JURing));
+    ring->fd = fd;
+    ring->ring_ptr = ptr;
+    ring->ring_size = ring_size;
+    ring->sqes = (struct io_uring_sqe *) sqes;
+    ring->sqes_size = sqes_size;
+    ring->recv_multishot = TRUE;
+    ring->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->wakefd < 0 || !j_uring_setup_buffers(ring)) {
+        if (ring->wakefd >= 0) {
+            close(ring->wakefd);
+        }
+        j_uring_unmap(ring);
+        close(fd);
+        g_slice_free1(sizeof(JURing), ring);
+        return NULL;
+    }
+
+    ring->sq_head = (guint32 *) (ptr + params.sq_off.head);
+    ring->sq_tail = (guint32 *) (ptr + params.sq_off.tail);
+    ring->sq_array = (guint32 *) (ptr + params.sq_off.array);
+    ring->sq_mask = *(guint32 *) (ptr + params.sq_off.ring_mask);
+    ring->sq_entries = *(guint32 *) (ptr + params.sq_off.ring_entries);
+    ring->sq_local = *ring->sq_tail;
+
+    ring->cq_head = (guint32 *) (ptr + params.cq_off.head);
+    ring->cq_tail = (guint32 *) (ptr + params.cq_off.tail);
+    ring->cq_mask = *(guint32 *) (ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ptr + params.cq_off.cqes);
+
+    g_queue_init(&ring->arm);
+    g_queue_init(&ring->all);
+    g_queue_init(&ring->ready);
+    g_queue_init(&ring->pending);
+    g_mutex_init(&ring->lock);
+
+    ring->waiting = 0;
+    j_uring_queue_wake(ring);
+    return ring;
+}
+
+static inline void j_uring_poll_release(JURingPoll * jrp)
+{
+    guint32 i;
+    for (i = jrp->astart; i < jrp->acount; i++) {
+        close(jrp->accepted[i]);
+    }
+    j_pool_free(jrp->accepted);
+    j_pool_free(jrp);
+}
+
+/*
+ * Frees the JURing
+ */
+void j_uring_free(JURing * ring)
+{
+    /* closing the ring cancels all requests in the kernel */
+    close(ring->fd);
+    close(ring->wakefd);
+    j_uring_unmap(ring);
+
+    GList *ptr = ring->all.head;
+    while (ptr) {
+        GList *next = ptr->next;
+        j_uring_poll_release((JURingPoll *) ptr->data);
+        ptr = next;
+    }
+    g_mutex_clear(&ring->lock);
+    g_slice_free1(sizeof(JURing), ring);
+}
+
+/*
+ * Publishes the queued submissions and enters the kernel
+ * If min_complete is zero, only submits
+ */
+static gint j_uring_enter(JURing * ring, guint min_complete, gint timeout)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    guint32 submit =
+        ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    guint flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    gpointer argp = NULL;
+    gsize argsz = 0;
+    if (min_complete) {
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            arg.ts = (guint64) (guintptr) & ts;
+        }
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    } else if (submit == 0) {
+        return 0;
+    }
+
+    gint n;
+  AGAIN:
+    n = sys_io_uring_enter(ring->fd, submit, min_complete, flags, argp,
+                           argsz);
+    if (n < 0 && errno == EINTR) {
+        goto AGAIN;
+    }
+    return n;
+}
+
+/*
+ * Gets a free submission entry
+ * If the submission queue is full, submits it first
+ */
+static struct io_uring_sqe *j_uring_get_sqe(JURing * ring)
+{
+    guint32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local - head >= ring->sq_entries) {
+        j_uring_enter(ring, 0, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    guint32 index = ring->sq_local & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local++;
+    return sqe;
+}
+
+static inline gboolean j_uring_cq_empty(JURing * ring)
+{
+    return *ring->cq_head ==
+        __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+static inline guint32 j_uring_poll_mask(guint32 events)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);   /* word-reversed */
+#endif
+    return events;
+}
+
+/* reads the wakeup eventfd, the read completes on every j_uring_add() from other threads */
+static inline void j_uring_queue_wake(JURing * ring)
+{
+    struct io_uring_sqe *sqe = j_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->wakefd;
+    sqe->addr = (guint64) (guintptr) & ring->wakebuf;
+    sqe->len = sizeof(ring->wakebuf);
+    sqe->user_data = J_URING_WAKE;
+}
+
+/*
+ * The events a poll request should watch, 0 if no poll is needed
+ * Streams and passive registrations are driven by their own requests,
+ * a stream is polled for writing only when a file (sent by sendfile())
+ * is waiting, and for the error queue if MSG_ZEROCOPY is on
+ */
+static inline guint32 j_uring_poll_want(JURingPoll * jrp)
+{
+    if (jrp->data == NULL) {
+        return 0;
+    } else if (jrp->kind == J_URING_POLL) {
+        return jrp->events | POLLERR | POLLHUP;
+    } else if (jrp->kind == J_URING_PASSIVE) {
+        return 0;
+    }
+    guint32 mask = 0;
+    if ((jrp->events & POLLOUT)
+        && !(jrp->inflight & j_uring_op_bit(J_URING_OP_SEND))) {
+        mask |= POLLOUT;
+    }
+    if (((JSocket *) jrp->data)->zerocopy) {
+        mask |= POLLERR;
+    }
+    return mask ? mask | POLLERR | POLLHUP : 0;
+}
+
+/*
+ * Arms the requests a registration needs but not in the kernel
+ * A one-shot poll checks the readiness when it's armed, so it keeps the
+ * level-triggered semantics of epoll
+ * Returns FALSE if the submission queue is full
+ */
+static inline gboolean j_uring_arm(JURing * ring, JURingPoll * jrp)
+{
+    struct io_uring_sqe *sqe;
+    guint32 mask = j_uring_poll_want(jrp);
+    if (mask && !(jrp->inflight & j_uring_op_bit(J_URING_OP_POLL))) {
+        if ((sqe = j_uring_get_sqe(ring)) == NULL) {
+            return FALSE;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = jrp->fd;
+        sqe->poll32_events = j_uring_poll_mask(mask);
+        sqe->user_data = j_uring_user_data(jrp, J_URING_OP_POLL);
+        jrp->poll_mask = mask;
+        jrp->inflight |= j_uring_op_bit(J_URING_OP_POLL);
+    }
+    if (jrp->kind == J_URING_STREAM && jrp->data
+        && (jrp->events & POLLIN) && !jrp->closed
+        && !(jrp->inflight & j_uring_op_bit(J_URING_OP_RECV))) {
+        if ((sqe = j_uring_get_sqe(ring)) == NULL) {
+            return FALSE;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = jrp->fd;
+        sqe->ioprio = ring->recv_multishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = J_URING_BUFFER_GROUP;
+        sqe->user_data = j_uring_user_data(jrp, J_URING_OP_RECV);
+        jrp->inflight |= j_uring_op_bit(J_URING_OP_RECV);
+    }
+    if (jrp->kind == J_URING_PASSIVE && jrp->data
+        && !(jrp->inflight & j_uring_op_bit(J_URING_OP_ACCEPT))) {
+        if ((sqe = j_uring_get_sqe(ring)) == NULL) {
+            return FALSE;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = jrp->fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = j_uring_user_data(jrp, J_URING_OP_ACCEPT);
+        jrp->inflight |= j_uring_op_bit(J_URING_OP_ACCEPT);
+    }
+    return TRUE;
+}
+
+/* arms it in the next wait */
+static inline void j_uring_queue_arm(JURing * ring, JURingPoll * jrp)
+{
+    if (jrp->queue == J_URING_QUEUE_NONE) {
+        jrp->queue = J_URING_QUEUE_ARM;
+        g_queue_push_tail_link(&ring->arm, &jrp->link);
+    }
+}
+
+static inline void j_uring_unqueue(JURing * ring, JURingPoll * jrp)
+{
+    if (jrp->queue == J_URING_QUEUE_ARM) {
+        g_queue_unlink(&ring->arm, &jrp->link);
+    } else if (jrp->queue == J_URING_QUEUE_PENDING) {
+        g_mutex_lock(&ring->lock);
+        g_queue_unlink(&ring->pending, &jrp->link);
+        g_mutex_unlock(&ring->lock);
+    }
+    jrp->queue = J_URING_QUEUE_NONE;
+}
+
+/* the events are reported by the next wait, once per registration */
+static inline void j_uring_set_ready(JURing * ring, JURingPoll * jrp,
+                                     guint32 events)
+{
+    if (jrp->ready == 0) {
+        g_queue_push_tail_link(&ring->ready, &jrp->rlink);
+    }
+    jrp->ready |= events;
+}
+
+static inline void j_uring_unready(JURing * ring, JURingPoll * jrp)
+{
+    if (jrp->ready) {
+        g_queue_unlink(&ring->ready, &jrp->rlink);
+        jrp->ready = 0;
+    }
+}
+
+/*
+ * Cancels a request of the registration
+ * Its last completion arrives later
+ */
+static inline void j_uring_cancel(JURing * ring, JURingPoll * jrp,
+                                  guint op)
+{
+    guint32 bit = j_uring_op_bit(op);
+    if (!(jrp->inflight & bit) || (jrp->cancelled & bit)) {
+        return;
+    }
+    struct io_uring_sqe *sqe = j_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        g_warning("io_uring: fail to cancel request of fd %d", jrp->fd);
+        return;
+    }
+    sqe->opcode = op == J_URING_OP_POLL ?
+        IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+    sqe->addr = j_uring_user_data(jrp, op);
+    sqe->user_data = 0;
+    jrp->cancelled |= bit;
+}
+
+/*
+ * Makes the poll request of a registration follow its events
+ */
+static inline void j_uring_update(JURing * ring, JURingPoll * jrp)
+{
+    guint32 mask = j_uring_poll_want(jrp);
+    guint32 bit = j_uring_op_bit(J_URING_OP_POLL);
+    if (!(jrp->inflight & bit)) {
+        j_uring_queue_arm(ring, jrp);
+        return;
+    } else if (mask == jrp->poll_mask || (jrp->cancelled & bit)) {
+        return;                 /* re-armed by its last completion */
+    } else if (mask == 0) {
+        j_uring_cancel(ring, jrp, J_URING_OP_POLL);
+        return;
+    }
+    struct io_uring_sqe *sqe = j_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return;
+    }
+    /* if the poll has fired already, the update fails, but it will be
+     * re-armed with the new events after its completion is reaped */
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = j_uring_user_data(jrp, J_URING_OP_POLL);
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = j_uring_poll_mask(mask);
+    sqe->user_data = 0;
+    jrp->poll_mask = mask;
+}
+
+static inline JURingPoll *j_uring_add_full(JURing * ring, gint fd,
+                                           JURingKind kind,
+                                           guint32 events, gpointer data)
+{
+    JURingPoll *jrp = (JURingPoll *) j_pool_alloc0(sizeof(JURingPoll));
+    jrp->fd = fd;
+    jrp->kind = kind;
+    jrp->events = events;
+    jrp->data = data;
+    jrp->queue = J_URING_QUEUE_PENDING;
+    jrp->link.data = jrp;
+    jrp->alink.data = jrp;
+    jrp->rlink.data = jrp;
+    if (kind == J_URING_STREAM) {
+        /* handed off with data not handled, it's reported at once */
+        jrp->received = j_socket_unparsed_length((JSocket *) data);
+    }
+
+    g_mutex_lock(&ring->lock);
+    g_queue_push_tail_link(&ring->pending, &jrp->link);
+    g_queue_push_tail_link(&ring->all, &jrp->alink);
+    g_mutex_unlock(&ring->lock);
+
+    if (g_atomic_int_get(&ring->waiting)) {
+        /* the owner is sleeping in the kernel, wake it up */
+        guint64 one = 1;
+        if (write(ring->wakefd, &one, sizeof(one)) < 0) {
+            /* the counter is already non-zero */
+        }
+    }
+    return jrp;
+}
+
+/*
+ * Registers fd for events
+ */
+JURingPoll *j_uring_add(JURing * ring, gint fd, guint32 events,
+                        gpointer data)
+{
+    return j_uring_add_full(ring, fd, J_URING_POLL, events, data);
+}
+
+/*
+ * Registers a connected JSocket, which is received and sent by the ring
+ */
+JURingPoll *j_uring_add_stream(JURing * ring, JSocket * jsock,
+                               guint32 events)
+{
+    return j_uring_add_full(ring, j_socket_fd(jsock), J_URING_STREAM,
+                            events, jsock);
+}
+
+/*
+ * Registers a listening JSocket
+ */
+JURingPoll *j_uring_add_passive(JURing * ring, JSocket * jsock)
+{
+    return j_uring_add_full(ring, j_socket_fd(jsock), J_URING_PASSIVE,
+                            POLLIN, jsock);
+}
+
+/*
+ * Changes the events watched by a registration
+ */
+void j_uring_modify(JURing * ring, JURingPoll * jrp, guint32 events)
+{
+    guint32 old = jrp->events;
+    jrp->events = events;
+    if (jrp->queue == J_URING_QUEUE_PENDING) {
+        /* the new events will be used when it's armed */
+        return;
+    }
+    if (jrp->kind == J_URING_STREAM && (old & POLLIN)
+        && !(events & POLLIN)) {
+        /* reading is paused, the data in flight is still appended */
+        j_uring_cancel(ring, jrp, J_URING_OP_RECV);
+    }
+    j_uring_update(ring, jrp);
+}
+
+static inline void j_uring_poll_free(JURing * ring, JURingPoll * jrp)
+{
+    g_mutex_lock(&ring->lock);
+    g_queue_unlink(&ring->all, &jrp->alink);
+    g_mutex_unlock(&ring->lock);
+    j_uring_poll_release(jrp);
+}
+
+static void j_uring_reap(JURing * ring);
+
+/*
+ * Cancels the requests ops of a registration, and waits for their last
+ * completions. Other completions are reaped as usual, their events are
+ * reported by the next wait
+ */
+static inline void j_uring_quiesce(JURing * ring, JURingPoll * jrp,
+                                   guint32 ops)
+{
+    guint op;
+    for (op = J_URING_OP_POLL; op <= J_URING_OP_ACCEPT; op++) {
+        if (ops & j_uring_op_bit(op)) {
+            j_uring_cancel(ring, jrp, op);
+        }
+    }
+    while (jrp->inflight & ops) {
+        if (j_uring_enter(ring, j_uring_cq_empty(ring) ? 1 : 0, -1) < 0
+            && errno != EBUSY) {
+            g_warning("io_uring: fail to cancel requests of fd %d",
+                      jrp->fd);
+            return;
+        }
+        j_uring_reap(ring);
+    }
+}
+
+/*
+ * Releases a registration
+ */
+void j_uring_delete(JURing * ring, JURingPoll * jrp, gboolean closing)
+{
+    if (jrp->kind == J_URING_STREAM) {
+        jrp->events = 0;        /* not re-armed by the completions */
+        j_uring_quiesce(ring, jrp, j_uring_op_bit(J_URING_OP_SEND) |
+                        (closing ? 0 : j_uring_op_bit(J_URING_OP_RECV)));
+    }
+    jrp->data = NULL;
+    j_uring_unqueue(ring, jrp);
+    j_uring_unready(ring, jrp);
+
+    /* the requests hold references to the file, they must be removed,
+     * or the socket will never be closed. jrp is freed after their
+     * completions are reaped */
+    guint op;
+    for (op = J_URING_OP_POLL; op <= J_URING_OP_ACCEPT; op++) {
+        j_uring_cancel(ring, jrp, op);
+    }
+    if (jrp->inflight == 0) {
+        j_uring_poll_free(ring, jrp);
+    }
+}
+
+
+/*
+ * Gets the bytes appended to the read buffer of a stream since last call
+ */
+gint j_uring_recv(JURing * ring, JURingPoll * jrp)
+{
+    gint n = jrp->received;
+    jrp->received = 0;
+    if (n == 0) {
+        return jrp->closed ? -1 : 0;
+    } else if (jrp->closed) {
+        j_uring_set_ready(ring, jrp, POLLIN);   /* -1 next time */
+    }
+    return n;
+}
+
+/*
+ * Sends the write queue of a stream
+ * Only one send is in flight, the data queued meanwhile goes with the next
+ */
+gint j_uring_flush(JURing * ring, JURingPoll * jrp)
+{
+    JSocket *jsock = (JSocket *) jrp->data;
+    if (jrp->failed) {
+        return -1;
+    } else if (jrp->inflight & j_uring_op_bit(J_URING_OP_SEND)) {
+        return 0;
+    }
+    gint flags;
+    gint n = j_socket_gather(jsock, jrp->iov, jrp->heads, J_URING_IOV_MAX,
+                             &flags);
+    if (n == 0) {
+        /* a file is sent by sendfile(), J_POLL_EVENT_OUT is polled */
+        return j_socket_flush(jsock);
+    }
+    struct io_uring_sqe *sqe = j_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return j_socket_flush(jsock);
+    }
+#ifdef MSG_ZEROCOPY
+    if (jrp->copy) {
+        flags &= ~MSG_ZEROCOPY;
+        jrp->copy = FALSE;
+    }
+#endif
+    memset(&jrp->msg, 0, sizeof(jrp->msg));
+    jrp->msg.msg_iov = jrp->iov;
+    jrp->msg.msg_iovlen = n;
+    jrp->send_flags = flags;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = jrp->fd;
+    sqe->addr = (guint64) (guintptr) & jrp->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | flags;
+    sqe->user_data = j_uring_user_data(jrp, J_URING_OP_SEND);
+    jrp->inflight |= j_uring_op_bit(J_URING_OP_SEND);
+    j_uring_update(ring, jrp);  /* no POLLOUT while sending */
+    return 0;
+}
+
+/*
+ * Takes a connection accepted by a passive registration
+ * If some are left, it's reported again by the next wait
+ */
+gint j_uring_accept(JURing * ring, JURingPoll * jrp)
+{
+    if (jrp->astart == jrp->acount) {
+        j_uring_unready(ring, jrp);
+        errno = EAGAIN;
+        return -1;
+    }
+    gint fd = jrp->accepted[jrp->astart++];
+    if (jrp->astart == jrp->acount) {
+        jrp->astart = jrp->acount = 0;
+        j_uring_unready(ring, jrp);
+    } else {
+        j_uring_set_ready(ring, jrp, POLLIN);
+    }
+    return fd;
+}
+
+
+static inline void j_uring_poll_done(JURing * ring, JURingPoll * jrp,
+                                     gint32 res)
+{
+    if (jrp->data == NULL || res <= 0) {
+        return;
+    }
+    guint32 watched = jrp->kind == J_URING_POLL ?
+        jrp->events : (jrp->events & POLLOUT);
+    guint32 events = res & (watched | POLLERR | POLLHUP);
+    if (events) {
+        j_uring_set_ready(ring, jrp, events);
+    }
+}
+
+/*
+ * The data is appended to the read buffer, and the buffer is given back
+ * If the multishot recv stops without an error (out of buffers, cancelled),
+ * it's re-armed if reading is not paused
+ */
+static inline void j_uring_recv_done(JURing * ring, JURingPoll * jrp,
+                                     gint32 res, guint32 flags)
+{
+    if (flags & IORING_CQE_F_BUFFER) {
+        guint16 bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (jrp->data && res > 0) {
+            if (!j_socket_received((JSocket *) jrp->data,
+                                   j_uring_buffer(ring, bid), res)) {
+                jrp->closed = TRUE;
+            }
+            jrp->received += res;
+        }
+        j_uring_recycle(ring, bid);
+    }
+    if (res == -EINVAL && ring->recv_multishot) {
+        /* multishot recv is supported since linux 6.0, it's armed again */
+        ring->recv_multishot = FALSE;
+        return;
+    } else if (jrp->data == NULL || res == -ENOBUFS || res == -ECANCELED) {
+        return;
+    } else if (res <= 0) {
+        jrp->closed = TRUE;
+    }
+    j_uring_set_ready(ring, jrp, POLLIN);
+}
+
+/*
+ * The bytes sent are removed from the write queue
+ */
+static inline void j_uring_send_done(JURing * ring, JURingPoll * jrp,
+                                     gint32 res)
+{
+    if (jrp->data == NULL) {
+        return;
+    }
+    if (res >= 0) {
+        j_socket_sent((JSocket *) jrp->data, res, jrp->send_flags);
+#ifdef MSG_ZEROCOPY
+    } else if (res == -ENOBUFS && (jrp->send_flags & MSG_ZEROCOPY)) {
+        jrp->copy = TRUE;       /* out of optmem, copy it */
+#endif
+    } else if (res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+        jrp->failed = TRUE;
+    }
+    j_uring_set_ready(ring, jrp, POLLOUT);
+}
+
+static inline void j_uring_accept_done(JURing * ring, JURingPoll * jrp,
+                                       gint32 res)
+{
+    if (res < 0) {
+        return;
+    } else if (jrp->data == NULL) {
+        close(res);
+        return;
+    }
+    if (jrp->acount == jrp->acapacity) {
+        guint32 capacity = MAX(16, jrp->acapacity * 2);
+        jrp->accepted = (gint *) j_pool_realloc(jrp->accepted,
+                                                sizeof(gint) * capacity);
+        jrp->acapacity = j_pool_block_size(jrp->accepted) / sizeof(gint);
+    }
+    jrp->accepted[jrp->acount++] = res;
+    j_uring_set_ready(ring, jrp, POLLIN);
+}
+
+static inline void j_uring_complete(JURing * ring, JURingPoll * jrp,
+                                    guint op, gint32 res, guint32 flags)
+{
+    if (!(flags & IORING_CQE_F_MORE)) {
+        jrp->inflight &= ~j_uring_op_bit(op);
+        jrp->cancelled &= ~j_uring_op_bit(op);
+    }
+    switch (op) {
+    case J_URING_OP_POLL:
+        j_uring_poll_done(ring, jrp, res);
+        break;
+    case J_URING_OP_RECV:
+        j_uring_recv_done(ring, jrp, res, flags);
+        break;
+    case J_URING_OP_SEND:
+        j_uring_send_done(ring, jrp, res);
+        break;
+    case J_URING_OP_ACCEPT:
+        j_uring_accept_done(ring, jrp, res);
+        break;
+    }
+    if (flags & IORING_CQE_F_MORE) {
+        return;
+    } else if (jrp->data == NULL) {
+        if (jrp->inflight == 0) {
+            j_uring_poll_free(ring, jrp);
+        }
+    } else {
+        j_uring_queue_arm(ring, jrp);
+    }
+}
+
+/* arms all registrations that are waiting */
+static inline void j_uring_arm_queued(JURing * ring)
+{
+    g_mutex_lock(&ring->lock);
+    GList *link;
+    while ((link = g_queue_pop_head_link(&ring->pending))) {
+        JURingPoll *jrp = (JURingPoll *) link->data;
+        jrp->queue = J_URING_QUEUE_ARM;
+        g_queue_push_tail_link(&ring->arm, link);
+        if (jrp->received) {
+            j_uring_set_ready(ring, jrp, POLLIN);
+        }
+    }
+    g_mutex_unlock(&ring->lock);
+
+    while ((link = g_queue_peek_head_link(&ring->arm))) {
+        JURingPoll *jrp = (JURingPoll *) link->data;
+        if (!j_uring_arm(ring, jrp)) {
+            break;              /* try again next time */
+        }
+        g_queue_unlink(&ring->arm, link);
+        jrp->queue = J_URING_QUEUE_NONE;
+    }
+}
+
+static inline gboolean j_uring_has_pending(JURing * ring)
+{
+    g_mutex_lock(&ring->lock);
+    gboolean ret = !g_queue_is_empty(&ring->pending);
+    g_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+/*
+ * Handles all completions, the events are put in ready queue
+ * The buffers given back are published together
+ */
+static void j_uring_reap(JURing * ring)
+{
+    guint32 head = *ring->cq_head;
+    guint32 tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    guint16 br_tail = ring->br_tail;
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        guint64 user_data = cqe->user_data;
+        gint32 res = cqe->res;
+        guint32 flags = cqe->flags;
+        head++;
+
+        if (user_data == J_URING_WAKE) {
+            j_uring_queue_wake(ring);
+            continue;
+        } else if (user_data == 0) {
+            continue;           /* completion of a cancel or an update */
+        }
+        JURingPoll *jrp =
+            (JURingPoll *) (guintptr) (user_data & ~J_URING_OP_MASK);
+        j_uring_complete(ring, jrp, user_data & J_URING_OP_MASK, res,
+                         flags);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if (br_tail != ring->br_tail) {
+        j_uring_publish_buffers(ring);
+    }
+}
+
+/*
+ * Submits all queued changes and waits for events
+ */
+gint j_uring_wait(JURing * ring, guint32 * types, gpointer * datas,
+                  guint maxevents, gint timeout)
+{
+    j_uring_arm_queued(ring);
+    if (g_queue_is_empty(&ring->ready) && j_uring_cq_empty(ring)) {
+        g_atomic_int_set(&ring->waiting, 1);
+        if (j_uring_has_pending(ring)) {
+            j_uring_arm_queued(ring);
+        }
+        gint ret = j_uring_enter(ring, 1, timeout);
+        g_atomic_int_set(&ring->waiting, 0);
+        if (ret < 0 && errno != ETIME && errno != EBUSY) {
+            return -1;
+        }
+    } else {
+        j_uring_enter(ring, 0, 0);
+    }
+    j_uring_reap(ring);
+
+    gint n = 0;
+    GList *link;
+    while (n < maxevents && (link = g_queue_pop_head_link(&ring->ready))) {
+        JURingPoll *jrp = (JURingPoll *) link->data;
+        guint32 ready = jrp->ready;
+        jrp->ready = 0;
+        if (jrp->kind == J_URING_STREAM) {
+            /* POLLIN may be reported before reading is paused */
+            ready &= jrp->events | POLLERR | POLLHUP;
+            if (ready == 0) {
+                continue;
+            }
+        }
+        types[n] = ready;
+        datas[n] = jrp->data;
+        n++;
+    }
+    return n;
+}
+
+#else                           /* J_HAVE_URING */
+
+JURing *j_uring_new(guint entries)
+{
+    return NULL;
+}
+
+void j_uring_free(JURing * ring)
+{
+}
+
+JURingPoll *j_uring_add(JURing * ring, gint fd, guint32 events,
+                        gpointer data)
+{
+    return NULL;
+}
+
+void j_uring_modify(JURing * ring, JURingPoll * jrp, guint32 events)
+{
+}
+
+JURingPoll *j_uring_add_stream(JURing * ring, JSocket * jsock,
+                               guint32 events)
+{
+    return NULL;
+}
+
+JURingPoll *j_uring_add_passive(JURing * ring, JSocket * jsock)
+{
+    return NULL;
+}
+
+void j_uring_delete(JURing * ring, JURingPoll * jrp, gboolean closing)
+{
+}
+
+gint j_uring_recv(JURing * ring, JURingPoll * jrp)
+{
+    return -1;
+}
+
+gint j_uring_flush(JURing * ring, JURingPoll * jrp)
+{
+    return -1;
+}
+
+gint j_uring_accept(JURing * ring, JURingPoll * jrp)
+{
+    return -1;
+}
+
+gint j_uring_wait(JURing * ring, guint32 * types, gpointer * datas,
+                  guint maxevents, gint timeout)
+{
+    return -1;
+}
+
+#endif                          /* J_HAVE_URING */
@@ -0,0 +1,124 @@
+/*
+ * juring.h
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __J_URING_H__
+#define __J_URING_H__
+
+#include "jsocket.h"
+#include <glib.h>
+
+/*
+ * JURing - the io_uring backend of JPoll, private to libjio
+ *
+ * A plain registration is watched by a poll request on the ring, like epoll.
+ * A stream registration is driven by the ring itself: a multishot recv
+ * picks buffers from a provided buffer ring and the data is appended to
+ * the read buffer of JSocket when it's reaped, the write queue is sent by
+ * sendmsg requests. A passive registration accepts by a multishot accept.
+ * Registrations, modifications and re-arms are only queued in memory and
+ * submitted together with the wait, so one loop iteration of a worker costs
+ * one io_uring_enter() no matter how many sockets changed their interest.
+ */
+typedef struct _JURing JURing;
+
+/* a registration, one per file descriptor */
+typedef struct _JURingPoll JURingPoll;
+
+
+/*
+ * Creates a JURing with at least entries submission slots
+ * Returns NULL on error, or if the kernel doesn't support io_uring
+ */
+JURing *j_uring_new(guint entries);
+
+/*
+ * Frees the JURing
+ * All registrations are released, but the file descriptors are not closed
+ */
+void j_uring_free(JURing * ring);
+
+
+/*
+ * Registers fd for events, data is returned in events
+ * j_uring_add() is the only function that may be called from another thread
+ * while the owner is blocking in j_uring_wait()
+ */
+JURingPoll *j_uring_add(JURing * ring, gint fd, guint32 events,
+                        gpointer data);
+
+/*
+ * Registers a connected JSocket, which is received and sent by the ring
+ * POLLIN is reported when data is appended to the read buffer,
+ * POLLOUT when a send completes
+ */
+JURingPoll *j_uring_add_stream(JURing * ring, JSocket * jsock,
+                               guint32 events);
+
+/*
+ * Registers a listening JSocket, POLLIN is reported when connections
+ * are accepted
+ */
+JURingPoll *j_uring_add_passive(JURing * ring, JSocket * jsock);
+
+/*
+ * Changes the events watched by a registration
+ * Removing POLLIN from a stream cancels its recv request
+ */
+void j_uring_modify(JURing * ring, JURingPoll * jrp, guint32 events);
+
+/*
+ * Releases a registration
+ * After this call, no more event will be returned for it
+ * A stream waits for its send to complete or be cancelled, so the write
+ * queue may be released after this call, if it's not closing, the recv
+ * is cancelled and waited as well, the data received before goes with it
+ */
+void j_uring_delete(JURing * ring, JURingPoll * jrp, gboolean closing);
+
+
+/*
+ * Gets the bytes appended to the read buffer of a stream since last call
+ * Returns -1 if the peer closed the connection or an error occurs
+ */
+gint j_uring_recv(JURing * ring, JURingPoll * jrp);
+
+/*
+ * Sends the write queue of a stream
+ * Returns 1 if the queue is empty, 0 if a send is in flight,
+ * -1 if a send failed
+ */
+gint j_uring_flush(JURing * ring, JURingPoll * jrp);
+
+/*
+ * Takes a connection accepted by a passive registration
+ * Returns the file descriptor, or -1 if none
+ */
+gint j_uring_accept(JURing * ring, JURingPoll * jrp);
+
+
+/*
+ * Submits all queued changes and waits for events
+ * Returns the count of events, 0 on timeout, -1 on error
+ * @param types, the ready events of every registration
+ * @param datas, the data passed to j_uring_add()
+ */
+gint j_uring_wait(JURing * ring, guint32 * types, gpointer * datas,
+                  guint maxevents, gint timeout);
+
+
+#endif                          /* __J_URING_H__ */
@@ -27,21 +27,28 @@
 gchar *pack_length4(guint32 length)
 {
     gchar *bytes = (gchar *) g_malloc(sizeof(gchar) * 4);
+    pack_length4_into(length, bytes);
+    return bytes;
+}
+
+/*
+ * Converts integer to 4-bytes array, in bytes
+ */
+void pack_length4_into(guint32 length, gchar * bytes)
+{
     bytes[0] = length % 0x100;
     bytes[1] = length % 0x10000 / 0x100;
     bytes[2] = length % 0x1000000 / 0x10000;
     bytes[3] = length / 0x1000000;
-
-    return bytes;
 }
 
 /*
  * Converts 4-bytes array to integer
  */
-guint32 unpack_length4(gchar * bytes)
+guint32 unpack_length4(const gchar * bytes)
 {
+    const guchar *b = (const guchar *) bytes;  /* gchar may be signed */
     guint32 length =
-        bytes[0] + bytes[1] * 0x100 + bytes[2] * 0x10000 +
-        bytes[3] * 0x1000000;
+        b[0] + b[1] * 0x100 + b[2] * 0x10000 + ((guint32) b[3] << 24);
     return length;
 }
@@ -34,10 +34,15 @@
  */
 gchar *pack_length4(guint32 length);
 
+/*
+ * Converts integer to 4-bytes array, in bytes, without allocating memory
+ */
+void pack_length4_into(guint32 length, gchar * bytes);
+
 /*
  * Converts 4-bytes array to integer
  */
-guint32 unpack_length4(gchar * bytes);
+guint32 unpack_length4(const gchar * bytes);
 
 
 #endif                          /* __J_PACK_H__ */
@@ -0,0 +1,157 @@
+/*
+ * blocking.c
+ *
+ * Copyright (C) 2015 - Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "blocking.h"
+#include <jpool.h>
+#include <stdlib.h>
+
+
+struct _JaHookPool {
+    gchar *name;
+    GThreadPool *threads;
+    gint max_threads;
+    guint max_queued;
+    gint64 max_wait;            /* in microseconds, 0 means forever */
+    gboolean reject;            /* reject requests when the queue is full */
+
+    guint queued;               /* requests waiting for a thread */
+    guint64 rejected;
+    gint64 reject_log_time;     /* when the rejection was logged last */
+};
+
+/* a request queued to a blocking hook */
+typedef struct {
+    JaHook *hook;
+    JaRequest *req;
+    gint64 time;                /* when it's queued */
+} JaHookTask;
+
+
+JaHookPool *ja_hook_pool_new(const gchar * name)
+{
+    JaHookPool *pool = g_new0(JaHookPool, 1);
+    pool->name = g_strdup(name);
+    pool->max_threads = DEFAULT_BLOCKING_THREADS;
+    pool->max_queued = DEFAULT_BLOCKING_QUEUE;
+    pool->reject = TRUE;
+    return pool;
+}
+
+void ja_hook_pool_configure(JaHookPool * pool, JGroup * group)
+{
+    GList *ptr = j_group_get_nodes(group);
+    while (ptr) {
+        JNode *n = (JNode *) ptr->data;
+        ptr = g_list_next(ptr);
+        if (!j_node_is_directive(n)) {
+            continue;
+        }
+        JDirective *d = j_node_get_directive(n);
+        const gchar *name = j_directive_get_name(d);
+        const gchar *value = j_directive_get_value(d);
+        if (g_strcmp0(name, DIRECTIVE_BLOCKING_THREADS) == 0) {
+            gint threads = atoi(value);
+            pool->max_threads =
+                threads > 0 ? threads : DEFAULT_BLOCKING_THREADS;
+        } else if (g_strcmp0(name, DIRECTIVE_BLOCKING_QUEUE) == 0) {
+            gint queued = atoi(value);
+            pool->max_queued = queued > 0 ? queued : DEFAULT_BLOCKING_QUEUE;
+        } else if (g_strcmp0(name, DIRECTIVE_BLOCKING_WAIT) == 0) {
+            gint wait = atoi(value);
+            pool->max_wait = wait > 0 ? (gint64) wait * 1000 : 0;
+        } else if (g_strcmp0(name, DIRECTIVE_BLOCKING_SATURATION) == 0) {
+            pool->reject = g_strcmp0(value, "queue") != 0;
+        }
+    }
+}
+
+/*
+ * Rejects a request, it's completed with JA_ACTION_DROP,
+ * so that the client knows instead of waiting for the response
+ */
+static inline void ja_hook_pool_reject(JaHookPool * pool, JaRequest * req)
+{
+    guint64 rejected = __atomic_add_fetch(&pool->rejected, 1,
+                                          __ATOMIC_RELAXED);
+    gint64 now = g_get_monotonic_time();
+    gint64 last = __atomic_load_n(&pool->reject_log_time, __ATOMIC_RELAXED);
+    if (now - last >= G_USEC_PER_SEC
+        && __atomic_compare_exchange_n(&pool->reject_log_time, &last, now,
+                                       FALSE, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED)) {
+        g_warning("module %s: blocking pool is saturated, %"
+                  G_GUINT64_FORMAT " requests rejected", pool->name,
+                  rejected);
+    }
+    ja_request_complete(req, JA_ACTION_DROP);
+}
+
+static void ja_hook_pool_run(gpointer data, gpointer user_data)
+{
+    JaHookTask *task = (JaHookTask *) data;
+    JaHookPool *pool = (JaHookPool *) user_data;
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+
+    if (pool->max_wait
+        && g_get_monotonic_time() - task->time > pool->max_wait) {
+        ja_hook_pool_reject(pool, task->req);
+    } else {
+        JaAction act = task->hook->func(task->req);
+        if (!(act & JA_ACTION_PENDING)) {
+            ja_request_complete(task->req, act);
+        }
+    }
+    j_pool_free(task);
+}
+
+gboolean ja_hook_pool_start(JaHookPool * pool)
+{
+    if (pool->threads) {
+        return TRUE;
+    }
+    GError *error = NULL;
+    pool->threads = g_thread_pool_new(ja_hook_pool_run, pool,
+                                      pool->max_threads, TRUE, &error);
+    if (pool->threads == NULL) {
+        g_warning("module %s: fail to start blocking pool: %s",
+                  pool->name, error ? error->message : "");
+        g_clear_error(&error);
+        return FALSE;
+    }
+    g_message("module %s: %d blocking threads, queue %u, wait %"
+              G_GINT64_FORMAT "ms, %s when saturated", pool->name,
+              pool->max_threads, pool->max_queued, pool->max_wait / 1000,
+              pool->reject ? "reject" : "queue");
+    return TRUE;
+}
+
+void ja_hook_pool_push(JaHook * hook, JaRequest * req)
+{
+    JaHookPool *pool = hook->pool;
+    if (__atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED) >
+        pool->max_queued && pool->reject) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+        ja_hook_pool_reject(pool, req);
+        return;
+    }
+    JaHookTask *task = (JaHookTask *) j_pool_alloc(sizeof(JaHookTask));
+    task->hook = hook;
+    task->req = req;
+    task->time = g_get_monotonic_time();
+    g_thread_pool_push(pool->threads, task, NULL);
+}
@@ -0,0 +1,86 @@
+/*
+ * blocking.h
+ *
+ * Copyright (C) 2015 - Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __JA_BLOCKING_H__
+#define __JA_BLOCKING_H__
+
+#include "hooks.h"
+#include <jconf.h>
+
+/*
+ * JaHookPool - the threads running the blocking hooks of a module
+ *
+ * A blocking hook is not called in the worker, the request is queued
+ * to the pool of its module, and completed by ja_request_complete()
+ * after the hook returns in a thread of the pool.
+ * Every server process has its own pools
+ */
+
+
+/*
+ * The configuration of the pool, in the group of module in app config
+ *
+ * <Module hello>
+ *     BlockingThreads 8
+ *     BlockingQueue 1024
+ *     BlockingWait 200
+ *     BlockingSaturation reject
+ * </Module>
+ */
+#define GROUP_MODULE    "Module"
+/* the count of threads */
+#define DIRECTIVE_BLOCKING_THREADS  "BlockingThreads"
+/* the max count of requests waiting for a thread */
+#define DIRECTIVE_BLOCKING_QUEUE    "BlockingQueue"
+/* milliseconds a request can wait, rejected if it waited longer, 0 means forever */
+#define DIRECTIVE_BLOCKING_WAIT     "BlockingWait"
+/*
+ * reject: requests are rejected when the queue is full
+ * queue: they're queued anyway, BlockingWait still rejects them
+ */
+#define DIRECTIVE_BLOCKING_SATURATION   "BlockingSaturation"
+
+#define DEFAULT_BLOCKING_THREADS    4
+#define DEFAULT_BLOCKING_QUEUE      1024
+
+
+/*
+ * Creates a pool with the default configuration, no thread is started
+ */
+JaHookPool *ja_hook_pool_new(const gchar * name);
+
+/*
+ * Configures the pool by the directives in group
+ */
+void ja_hook_pool_configure(JaHookPool * pool, JGroup * group);
+
+/*
+ * Starts the threads, if not started yet
+ * Returns FALSE on error
+ */
+gboolean ja_hook_pool_start(JaHookPool * pool);
+
+/*
+ * Queues the request to the blocking hook, in the pool of hook
+ * The request must be detached, it's completed by ja_request_complete()
+ * with the action of hook, or JA_ACTION_DROP if it's rejected
+ */
+void ja_hook_pool_push(JaHook * hook, JaRequest * req);
+
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * coroutine.c
+ *
+ * Copyright (C) 2015 - Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "coroutine.h"
+#include <jpool.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/* the stacks kept by every thread for later coroutines */
+#define STACK_POOL_LIMIT    256
+
+struct _JaCoroutine {
+    ucontext_t context;
+    ucontext_t caller;          /* where it yields to */
+    JaCoroutineFunc func;
+    gpointer data;
+    gboolean done;
+
+    gchar *stack;               /* the mapping, starts with a guard page */
+    gsize stack_size;           /* the size of mapping */
+
+    /* what it waits for */
+    gint fd;
+    guint32 events;
+    gint timeout;
+    gboolean ready;
+};
+
+/* a free stack in the pool, the link is kept in the stack itself */
+typedef struct _JaStack JaStack;
+struct _JaStack {
+    JaStack *next;
+};
+
+static __thread JaCoroutine *current = NULL;
+static __thread JaStack *free_stacks = NULL;
+static __thread guint free_count = 0;
+static __thread gsize free_size = 0;    /* the size of stacks in pool */
+
+
+static inline gsize ja_coroutine_page_size(void)
+{
+    static gsize page_size = 0;
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    return page_size;
+}
+
+/*
+ * Takes a stack from the pool, or maps a new one
+ * The stack overflows into the guard page, not other memory
+ */
+static inline gchar *ja_coroutine_stack_alloc(gsize size)
+{
+    gsize page = ja_coroutine_page_size();
+    if (free_stacks && free_size == size) {
+        JaStack *s = free_stacks;
+        free_stacks = s->next;
+        free_count--;
+        return (gchar *) s - page;
+    }
+    gchar *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mem == MAP_FAILED) {
+        g_error("fail to map coroutine stack of %" G_GSIZE_FORMAT " bytes",
+                size);
+    }
+    mprotect(mem, page, PROT_NONE);
+    return mem;
+}
+
+static inline void ja_coroutine_stack_free(gchar * stack, gsize size)
+{
+    if (free_count >= STACK_POOL_LIMIT
+        || (free_count > 0 && free_size != size)) {
+        munmap(stack, size);
+        return;
+    }
+    JaStack *s = (JaStack *) (stack + ja_coroutine_page_size());
+    s->next = free_stacks;
+    free_stacks = s;
+    free_count++;
+    free_size = size;
+}
+
+static void ja_coroutine_entry(void)
+{
+    JaCoroutine *co = current;
+    co->func(co->data);
+    co->done = TRUE;
+    /* returns to caller through uc_link */
+}
+
+JaCoroutine *ja_coroutine_new(JaCoroutineFunc func, gpointer data,
+                              gsize stack_size)
+{
+    gsize page = ja_coroutine_page_size();
+    gsize size = ((stack_size + page - 1) / page + 1) * page;
+
+    JaCoroutine *co = (JaCoroutine *) j_pool_alloc(sizeof(JaCoroutine));
+    co->func = func;
+    co->data = data;
+    co->done = FALSE;
+    co->stack = ja_coroutine_stack_alloc(size);
+    co->stack_size = size;
+    co->fd = -1;
+    co->events = 0;
+    co->timeout = -1;
+    co->ready = FALSE;
+
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = co->stack + page;
+    co->context.uc_stack.ss_size = size - page;
+    co->context.uc_link = &co->caller;
+    makecontext(&co->context, ja_coroutine_entry, 0);
+    return co;
+}
+
+gboolean ja_coroutine_resume(JaCoroutine * co)
+{
+    JaCoroutine *prev = current;
+    current = co;
+    swapcontext(&co->caller, &co->context);
+    current = prev;
+    return co->done;
+}
+
+static inline void ja_coroutine_yield(JaCoroutine * co)
+{
+    swapcontext(&co->context, &co->caller);
+}
+
+void ja_coroutine_free(JaCoroutine * co)
+{
+    ja_coroutine_stack_free(co->stack, co->stack_size);
+    j_pool_free(co);
+}
+
+void ja_coroutine_get_wait(JaCoroutine * co, gint * fd, guint32 * events,
+                           gint * timeout)
+{
+    *fd = co->fd;
+    *events = co->events;
+    *timeout = co->timeout;
+}
+
+void ja_coroutine_set_ready(JaCoroutine * co, gboolean ready)
+{
+    co->ready = ready;
+}
+
+gboolean ja_coroutine_is_running(void)
+{
+    return current != NULL;
+}
+
+gboolean ja_coroutine_wait_fd(gint fd, guint32 events, gint timeout)
+{
+    JaCoroutine *co = current;
+    if (co == NULL) {
+        g_warning("ja_coroutine_wait_fd() is called out of coroutine");
+        return FALSE;
+    }
+    co->fd = fd;
+    co->events = events;
+    co->timeout = timeout;
+    co->ready = FALSE;
+    ja_coroutine_yield(co);
+    co->fd = -1;
+    return co->ready;
+}
+
+void ja_coroutine_sleep(guint ms)
+{
+    JaCoroutine *co = current;
+    if (co == NULL) {
+        g_warning("ja_coroutine_sleep() is called out of coroutine");
+        return;
+    }
+    co->fd = -1;
+    co->events = 0;
+    co->timeout = ms;
+    ja_coroutine_yield(co);
+}
@@ -0,0 +1,97 @@
+/*
+ * coroutine.h
+ *
+ * Copyright (C) 2015 - Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __JA_COROUTINE_H__
+#define __JA_COROUTINE_H__
+
+#include <glib.h>
+
+/*
+ * JaCoroutine - a request hook running on its own stack
+ *
+ * With "Coroutines on", the worker calls the request hooks in a coroutine,
+ * a hook can wait for a descriptor or sleep there, as if it blocks.
+ * The coroutine yields to the worker, which goes on with other requests,
+ * and resumes it when JPoll reports the descriptor ready or the time is up.
+ * The stacks are pooled by the worker thread, so a coroutine is cheap.
+ *
+ * A coroutine never moves to another thread, and the hooks must not
+ * block in other ways, the whole worker would block.
+ */
+typedef struct _JaCoroutine JaCoroutine;
+
+/* the events to wait for */
+#define JA_WAIT_READ    0x01
+#define JA_WAIT_WRITE   0x02
+
+
+/*
+ * Checks if current hook is running in a coroutine,
+ * the functions below can only be called in a coroutine
+ */
+gboolean ja_coroutine_is_running(void);
+
+/*
+ * Waits until the descriptor is ready for the events, or timeout milliseconds
+ * passed (negative means forever)
+ * Returns TRUE if it's ready, FALSE on timeout or error
+ */
+gboolean ja_coroutine_wait_fd(gint fd, guint32 events, gint timeout);
+
+/*
+ * Sleeps milliseconds
+ */
+void ja_coroutine_sleep(guint ms);
+
+
+/* the functions below are used by the worker only */
+
+typedef void (*JaCoroutineFunc) (gpointer data);
+
+/*
+ * Creates a coroutine which runs func(data), on a stack of the pool
+ * of current thread. It doesn't run until resumed
+ */
+JaCoroutine *ja_coroutine_new(JaCoroutineFunc func, gpointer data,
+                              gsize stack_size);
+
+/*
+ * Runs the coroutine until it yields or returns
+ * Returns TRUE if func returned, then the coroutine should be freed
+ */
+gboolean ja_coroutine_resume(JaCoroutine * co);
+
+/*
+ * Gets what the coroutine yields for, fd is -1 if it only sleeps,
+ * timeout is negative if it waits forever
+ */
+void ja_coroutine_get_wait(JaCoroutine * co, gint * fd, guint32 * events,
+                           gint * timeout);
+
+/*
+ * Sets the result of wait, before it's resumed
+ */
+void ja_coroutine_set_ready(JaCoroutine * co, gboolean ready);
+
+/*
+ * Frees the coroutine, its stack goes back to the pool
+ */
+void ja_coroutine_free(JaCoroutine * co);
+
+
+#endif
@@ -17,3 +17,14 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "hooks.h"
+
+
+void ja_request_complete(JaRequest * req, JaAction act)
+{
+    if (req->complete == NULL) {
+        g_warning("the request is not handled asynchronously");
+        return;
+    }
+    req->action = act & ~JA_ACTION_PENDING;
+    req->complete(req);
+}
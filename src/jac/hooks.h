@@ -27,6 +27,11 @@
 typedef enum {
     JA_HOOK_TYPE_REQUEST,
     JA_HOOK_TYPE_SERVER_QUIT,
+    JA_HOOK_TYPE_BLOCKING_REQUEST,  /* a request hook that may block */
+    JA_HOOK_TYPE_BATCH_REQUEST, /* a hook of all requests read in one loop */
+    JA_HOOK_TYPE_CONNECT,       /* a connection is accepted */
+    JA_HOOK_TYPE_DISCONNECT,    /* a connection is closed */
+    JA_HOOK_TYPE_TIMEOUT,       /* a connection is closed for keepalive timeout */
 } JaHookType;
 
 
@@ -35,11 +40,62 @@ typedef enum {
     JA_ACTION_RESPONSE = 0x01,
     JA_ACTION_DROP = 0x02,      /* drop the connection */
     JA_ACTION_KEEP = 0x04,      /* keep the connection */
+    JA_ACTION_PENDING = 0x08,   /* completed later by ja_request_complete() */
 } JaAction;
 
 /* handle request hook */
 typedef JaAction(*JaRequestHandler) (JaRequest * req);
 
+/*
+ * handle requests in batch hook
+ * reqs are the requests read by a worker in one iteration of its loop,
+ * in the order they're read; the hook sets acts[i] to the action of reqs[i],
+ * which is JA_ACTION_IGNORE when it's called.
+ * The actions mean what they mean for JaRequestHandler, a request can be
+ * left pending and completed later by ja_request_complete().
+ * The batch hooks are called before the request hooks, a request goes
+ * through the request hooks after all batch hooks unless it's dropped.
+ * The requests are detached already, they can be kept after the hook
+ * returns until they're completed
+ */
+typedef void (*JaBatchRequestHandler) (JaRequest ** reqs, JaAction * acts,
+                                       guint count);
+
+/*
+ * handle connection hook
+ * called in the worker of connection. For a connect hook, JA_ACTION_DROP
+ * closes the connection; the others are called when it's being closed,
+ * and their actions mean nothing. The disconnect hooks are called for
+ * every connection closed, after the timeout hooks if it's timeout
+ */
+typedef JaAction(*JaConnectionHandler) (JaConnection * conn);
+
+typedef struct _JaHookPool JaHookPool;
+
+/*
+ * A registered request hook
+ * A blocking one runs in the thread pool of its module, not in the worker
+ */
+typedef struct {
+    JaRequestHandler func;
+    JaHookPool *pool;           /* NULL if it's not blocking */
+    JaBatchRequestHandler batch;    /* not NULL if it's a batch hook */
+    JaConnectionHandler connection; /* not NULL if it's a connection hook */
+    gint module;                /* the index of module in ja_get_modules(), -1 if unknown */
+} JaHook;
+
+/*
+ * Completes a request whose hook returned JA_ACTION_PENDING, act is what
+ * the hook would have returned. It can be called once, from any thread,
+ * the request must not be touched after that.
+ *
+ * The hook must call ja_request_detach() before passing the request to
+ * another thread. The worker goes on with other requests meanwhile, and
+ * calls the hooks after the pending one when it's completed;
+ * the responses of a connection are still sent in the order of requests
+ */
+void ja_request_complete(JaRequest * req, JaAction act);
+
 
 /*
  * @param name: the server's name
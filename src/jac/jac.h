@@ -22,5 +22,7 @@
 #include "mod.h"
 #include "struct.h"
 #include "hooks.h"
+#include "coroutine.h"
+#include "push.h"
 
 #endif
@@ -17,6 +17,7 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "mod.h"
+#include "blocking.h"
 #include <gmodule.h>
 
 
@@ -26,10 +27,57 @@ static GList *loaded_modules = NULL;
 /* List of all different hooks */
 static GList *request_hooks = NULL;
 static GList *server_quit_hooks = NULL;
+static GList *batch_hooks = NULL;
+static GList *connect_hooks = NULL;
+static GList *disconnect_hooks = NULL;
+static GList *timeout_hooks = NULL;
+
+/* the index of module whose hooks are being registered */
+static gint hook_module = -1;
+
+/* the pool of blocking hooks being registered */
+static JaHookPool *hook_pool = NULL;
+
+/* a request hook registered for an opcode */
+typedef struct {
+    guint32 opcode;
+    JaHook *hook;
+} JaRoute;
+
+/*
+ * The request hooks of a route, hooks is a contiguous array of count
+ * JaHook followed by NULL, so a pointer to any of them is the rest of route
+ */
+typedef struct {
+    JaHook **hooks;
+    guint32 count;
+} JaRouteChain;
+
+/* the request hooks and the batch hooks, kept with their lists */
+static JaRouteChain request_chain = { NULL, 0 };
+static JaRouteChain batch_chain = { NULL, 0 };
+
+/*
+ * The routes registered, compiled into route_table by ja_hook_compile(),
+ * route_table[opcode] is the chain of JaHook of opcode
+ */
+static GList *routes = NULL;
+static JaRouteChain *route_table = NULL;
+static guint32 route_table_size = 0;
+static gboolean route_varint = FALSE;
 
 
 typedef void (*ModuleInitFunc) ();
 
+
+static inline void ja_route_chain_append(JaRouteChain * chain,
+                                         JaHook * hook)
+{
+    chain->hooks = g_renew(JaHook *, chain->hooks, chain->count + 2);
+    chain->hooks[chain->count++] = hook;
+    chain->hooks[chain->count] = NULL;
+}
+
 GList *ja_get_modules()
 {
     return loaded_modules;
@@ -42,6 +90,36 @@ GList *ja_get_request_hooks(void)
 }
 
 
+GList *ja_get_batch_hooks(void)
+{
+    return batch_hooks;
+}
+
+
+JaHook **ja_get_batch_route(void)
+{
+    return batch_chain.hooks;
+}
+
+
+GList *ja_get_connect_hooks(void)
+{
+    return connect_hooks;
+}
+
+
+GList *ja_get_disconnect_hooks(void)
+{
+    return disconnect_hooks;
+}
+
+
+GList *ja_get_timeout_hooks(void)
+{
+    return timeout_hooks;
+}
+
+
 GList *ja_get_server_quit_hooks(void)
 {
     return server_quit_hooks;
@@ -52,17 +130,180 @@ void ja_module_register(JaModule * mod)
 {
     loaded_modules = g_list_append(loaded_modules, mod);
 
+    ja_hook_set_module(mod);
     mod->init_func();
+    ja_hook_set_module(NULL);
+}
+
+void ja_hook_set_module(JaModule * mod)
+{
+    hook_module = mod ? g_list_index(loaded_modules, mod) : -1;
+}
+
+void ja_hook_set_pool(JaHookPool * pool)
+{
+    hook_pool = pool;
+}
+
+/*
+ * Creates a JaHook of request hook,
+ * a blocking one gets the pool being registered
+ */
+static inline JaHook *ja_hook_new(void *ptr, JaHookType type)
+{
+    JaHook *hook = g_new(JaHook, 1);
+    hook->func = (JaRequestHandler) ptr;
+    hook->pool = NULL;
+    hook->batch = NULL;
+    hook->connection = NULL;
+    hook->module = hook_module;
+    if (type != JA_HOOK_TYPE_BLOCKING_REQUEST) {
+        return hook;
+    }
+    if (hook_pool == NULL) {
+        hook_pool = ja_hook_pool_new("blocking");
+    }
+    if (ja_hook_pool_start(hook_pool)) {
+        hook->pool = hook_pool;
+    } else {
+        g_warning("blocking hook is called in the worker");
+    }
+    return hook;
+}
+
+static inline JaHook *ja_batch_hook_new(void *ptr)
+{
+    JaHook *hook = g_new0(JaHook, 1);
+    hook->batch = (JaBatchRequestHandler) ptr;
+    hook->module = hook_module;
+    return hook;
+}
+
+static inline JaHook *ja_connection_hook_new(void *ptr)
+{
+    JaHook *hook = g_new0(JaHook, 1);
+    hook->connection = (JaConnectionHandler) ptr;
+    hook->module = hook_module;
+    return hook;
 }
 
 void ja_hook_register(void *ptr, JaHookType type)
 {
+    JaHook *hook;
     switch (type) {
     case JA_HOOK_TYPE_REQUEST:
-        request_hooks = g_list_append(request_hooks, ptr);
+    case JA_HOOK_TYPE_BLOCKING_REQUEST:
+        hook = ja_hook_new(ptr, type);
+        request_hooks = g_list_append(request_hooks, hook);
+        ja_route_chain_append(&request_chain, hook);
+        break;
+    case JA_HOOK_TYPE_BATCH_REQUEST:
+        hook = ja_batch_hook_new(ptr);
+        batch_hooks = g_list_append(batch_hooks, hook);
+        ja_route_chain_append(&batch_chain, hook);
+        break;
+    case JA_HOOK_TYPE_CONNECT:
+        connect_hooks = g_list_append(connect_hooks,
+                                      ja_connection_hook_new(ptr));
+        break;
+    case JA_HOOK_TYPE_DISCONNECT:
+        disconnect_hooks = g_list_append(disconnect_hooks,
+                                         ja_connection_hook_new(ptr));
+        break;
+    case JA_HOOK_TYPE_TIMEOUT:
+        timeout_hooks = g_list_append(timeout_hooks,
+                                      ja_connection_hook_new(ptr));
         break;
     case JA_HOOK_TYPE_SERVER_QUIT:
         server_quit_hooks = g_list_append(server_quit_hooks, ptr);
         break;
     }
 }
+
+void ja_hook_register_opcode(void *ptr, JaHookType type, guint32 opcode)
+{
+    if (type != JA_HOOK_TYPE_REQUEST && type != JA_HOOK_TYPE_BLOCKING_REQUEST) {
+        g_warning("only request hooks can be registered for opcode");
+        return;
+    }
+    JaRoute *route = g_new(JaRoute, 1);
+    route->opcode = opcode;
+    route->hook = ja_hook_new(ptr, type);
+    routes = g_list_append(routes, route);
+}
+
+void ja_hook_compile(gboolean varint)
+{
+    guint32 i;
+    for (i = 0; i < route_table_size; i++) {
+        g_free(route_table[i].hooks);
+    }
+    g_free(route_table);
+    route_table = NULL;
+    route_table_size = 0;
+    route_varint = varint;
+    if (routes == NULL) {
+        return;
+    }
+
+    guint32 size = varint ? 0 : 256;
+    GList *ptr;
+    for (ptr = routes; ptr && varint; ptr = g_list_next(ptr)) {
+        JaRoute *route = (JaRoute *) ptr->data;
+        if (route->opcode < MAX_VARINT_OPCODE) {
+            size = MAX(size, route->opcode + 1);
+        }
+    }
+    route_table = g_new0(JaRouteChain, size);
+    route_table_size = size;
+    guint32 count = 0;
+    for (ptr = routes; ptr; ptr = g_list_next(ptr)) {
+        JaRoute *route = (JaRoute *) ptr->data;
+        if (route->opcode >= size) {
+            g_warning("opcode %u is out of range", route->opcode);
+            continue;
+        }
+        if (route_table[route->opcode].count == 0) {
+            count++;
+        }
+        ja_route_chain_append(&route_table[route->opcode], route->hook);
+    }
+    g_message("%u opcodes routed (%s)", count, varint ? "varint" : "byte");
+}
+
+/*
+ * Parses the opcode at the beginning of request
+ * Returns FALSE if the request is too short or the varint is invalid
+ */
+static inline gboolean ja_parse_opcode(const guint8 * data, guint len,
+                                       guint32 * opcode)
+{
+    if (!route_varint) {
+        if (len == 0) {
+            return FALSE;
+        }
+        *opcode = data[0];
+        return TRUE;
+    }
+    guint32 value = 0;
+    guint i;
+    for (i = 0; i < len && i < 5; i++) {
+        value |= (guint32) (data[i] & 0x7F) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            *opcode = value;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+JaHook **ja_get_request_route(const void *data, guint len)
+{
+    guint32 opcode;
+    if (route_table == NULL
+        || !ja_parse_opcode((const guint8 *) data, len, &opcode)
+        || opcode >= route_table_size || route_table[opcode].count == 0) {
+        return request_chain.hooks;
+    }
+    return route_table[opcode].hooks;
+}
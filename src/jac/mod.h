@@ -32,7 +32,12 @@ GList *ja_get_modules();
 
 
 /* Functions to get all different hook lists */
+/* the list of JaHook */
 GList *ja_get_request_hooks(void);
+GList *ja_get_batch_hooks(void);
+GList *ja_get_connect_hooks(void);
+GList *ja_get_disconnect_hooks(void);
+GList *ja_get_timeout_hooks(void);
 GList *ja_get_server_quit_hooks(void);
 
 
@@ -43,5 +48,50 @@ GList *ja_get_server_quit_hooks(void);
 /* Register a hook */
 void ja_hook_register(void *ptr, JaHookType type);
 
+/*
+ * Registers a request hook (JA_HOOK_TYPE_REQUEST or
+ * JA_HOOK_TYPE_BLOCKING_REQUEST) for the requests of opcode only.
+ * The opcode is the first byte of request, or a varint (LEB128) at the
+ * beginning if "Opcode varint" is set.
+ * The requests of an opcode are handled by its hooks, in the order they're
+ * registered, the other requests go through the hooks registered by
+ * ja_hook_register()
+ */
+void ja_hook_register_opcode(void *ptr, JaHookType type, guint32 opcode);
+
+/* the max varint opcode, the dispatch table is as large as the largest */
+#define MAX_VARINT_OPCODE   65536
+
+/*
+ * Compiles the opcode hooks into the dispatch table, after all modules
+ * registered their hooks
+ */
+void ja_hook_compile(gboolean varint);
+
+/*
+ * Gets the request hooks of request by its opcode, as an array of JaHook
+ * ending with NULL, they're the hooks of ja_get_request_hooks() if no hook
+ * is registered for it. NULL if there is no request hook
+ */
+JaHook **ja_get_request_route(const void *data, guint len);
+
+/*
+ * Gets the hooks of ja_get_batch_hooks() as an array ending with NULL,
+ * NULL if there is no batch hook
+ */
+JaHook **ja_get_batch_route(void);
+
+/*
+ * Sets the module whose hooks are registered after,
+ * they get the worker context of mod. NULL for none
+ */
+void ja_hook_set_module(JaModule * mod);
+
+/*
+ * Sets the pool of the blocking hooks registered after,
+ * it's the pool of the module whose hooks are registered
+ */
+void ja_hook_set_pool(JaHookPool * pool);
+
 
 #endif
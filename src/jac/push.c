@@ -0,0 +1,109 @@
+/*
+ * push.c
+ *
+ * Copyright (C) 2015 - Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "push.h"
+#include <jpool.h>
+#include <string.h>
+
+
+/* the registry is sharded by connection id */
+#define PUSH_SHARD_COUNT    64
+
+typedef struct {
+    GMutex lock;
+    GHashTable *owners;         /* &conn->id => owner */
+} JaPushShard;
+
+static JaPushShard shards[PUSH_SHARD_COUNT];
+static JaPushDeliver push_deliver = NULL;
+static gsize shards_ready = 0;
+
+static inline JaPushShard *ja_push_shard(guint64 conn_id)
+{
+    if (g_once_init_enter(&shards_ready)) {
+        guint i;
+        for (i = 0; i < PUSH_SHARD_COUNT; i++) {
+            g_mutex_init(&shards[i].lock);
+            shards[i].owners = g_hash_table_new(g_int64_hash,
+                                                g_int64_equal);
+        }
+        g_once_init_leave(&shards_ready, 1);
+    }
+    return &shards[conn_id % PUSH_SHARD_COUNT];
+}
+
+void ja_push_set_deliver(JaPushDeliver deliver)
+{
+    push_deliver = deliver;
+}
+
+void ja_push_register(JaConnection * conn, gpointer owner)
+{
+    JaPushShard *shard = ja_push_shard(conn->id);
+    g_mutex_lock(&shard->lock);
+    g_hash_table_insert(shard->owners, &conn->id, owner);
+    g_mutex_unlock(&shard->lock);
+}
+
+void ja_push_unregister(JaConnection * conn)
+{
+    JaPushShard *shard = ja_push_shard(conn->id);
+    g_mutex_lock(&shard->lock);
+    g_hash_table_remove(shard->owners, &conn->id);
+    g_mutex_unlock(&shard->lock);
+}
+
+gboolean ja_push_forward(JaPush * push, gpointer except)
+{
+    JaPushShard *shard = ja_push_shard(push->conn_id);
+    gboolean ok = FALSE;
+    /*
+     * delivered with the lock held, so the owner can't change meanwhile,
+     * a worker handing a connection off gets no push for it after that
+     */
+    g_mutex_lock(&shard->lock);
+    gpointer key, owner;
+    if (g_hash_table_lookup_extended(shard->owners, &push->conn_id, &key,
+                                     &owner)
+        && owner != except && push_deliver) {
+        /* the key is the id in JaConnection, which is kept while in there */
+        JaConnection *conn = G_STRUCT_MEMBER_P(key,
+                                               -G_STRUCT_OFFSET(JaConnection,
+                                                                id));
+        if (!__atomic_load_n(&conn->overloaded, __ATOMIC_RELAXED)) {
+            ok = push_deliver(owner, push);
+        }
+    }
+    g_mutex_unlock(&shard->lock);
+    if (!ok) {
+        j_pool_free(push);
+    }
+    return ok;
+}
+
+gboolean ja_push(guint64 conn_id, const void *data, gsize len)
+{
+    if (len == 0 || len > G_MAXUINT32) {   /* not a valid frame */
+        return FALSE;
+    }
+    JaPush *push = (JaPush *) j_pool_alloc(sizeof(JaPush) + len);
+    push->conn_id = conn_id;
+    push->len = len;
+    memcpy(push->data, data, len);
+    return ja_push_forward(push, NULL);
+}
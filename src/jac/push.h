@@ -0,0 +1,87 @@
+/*
+ * push.h
+ *
+ * Copyright (C) 2015 - Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __JA_PUSH_H__
+#define __JA_PUSH_H__
+
+#include "struct.h"
+
+/*
+ * Pushing - sends a frame to a connection without a request
+ *
+ * Every connection is in a global registry by its id, which is sharded
+ * by id with a lock per shard, so pushes to different connections rarely
+ * contend. ja_push() finds the worker of connection there, and hands the
+ * frame to it through its lock-free ring, waking it up if it's sleeping.
+ * The worker queues the frame like a response, so it's never mixed with
+ * one, but the client must tell pushes from responses itself.
+ * A client that doesn't read gets no more pushes: when the data to write
+ * to it reaches the high water mark, the pushes are refused or dropped,
+ * until it drops to the low water mark.
+ */
+
+
+/*
+ * Pushes a copy of data to the connection of conn_id (see
+ * ja_request_connection_id()), as one frame.
+ * It can be called from any thread.
+ * Returns FALSE if the connection is closed or overloaded, or its worker
+ * is; TRUE means the frame is queued, not that it's sent, it's still
+ * dropped if the connection gets overloaded before it's taken
+ */
+gboolean ja_push(guint64 conn_id, const void *data, gsize len);
+
+
+/* the functions below are used by the worker only */
+
+/* a frame pushed, allocated from JPool */
+typedef struct {
+    guint64 conn_id;
+    gsize len;
+    gchar data[];
+} JaPush;
+
+/*
+ * Hands a push to owner, the worker registered the connection,
+ * called with the lock of shard held, so it must not block
+ * Returns FALSE if it can't take the push
+ */
+typedef gboolean(*JaPushDeliver) (gpointer owner, JaPush * push);
+
+void ja_push_set_deliver(JaPushDeliver deliver);
+
+/*
+ * Sets the owner of connection, it's added to the registry if not yet
+ * The pushes after this call go to the new owner
+ */
+void ja_push_register(JaConnection * conn, gpointer owner);
+
+/*
+ * Removes the connection from the registry
+ */
+void ja_push_unregister(JaConnection * conn);
+
+/*
+ * Hands push to the owner of its connection, unless it's except
+ * If it fails, or the connection is overloaded,
+ * the push is freed and FALSE is returned
+ */
+gboolean ja_push_forward(JaPush * push, gpointer except);
+
+
+#endif
@@ -17,31 +17,412 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "struct.h"
+#include <jpool.h>
 #include <string.h>
 
 
-JaRequest *ja_request_new(const void *data, guint len,
-                          struct sockaddr *addr, socklen_t addrlen)
+/*
+ * The arena of request is a list of chunks, the last one is filled first
+ * Chunks come from JPool, so they're recycled by the thread cache of the
+ * worker. The first chunk is as large as the most memory a request of
+ * the thread used, up to ARENA_CHUNK_MAX, so that a request usually needs
+ * only one chunk
+ */
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_MIN 1024
+#define ARENA_CHUNK_MAX (64 * 1024)
+
+typedef struct _JaArenaChunk JaArenaChunk;
+struct _JaArenaChunk {
+    JaArenaChunk *next;         /* the chunk filled before */
+    gsize used;
+    gsize size;                 /* the room for data */
+};
+
+#define ARENA_HEADER_SIZE   ((sizeof(JaArenaChunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ja_arena_chunk_data(chunk)  ((gchar*)(chunk) + ARENA_HEADER_SIZE)
+
+static __thread gsize arena_high_water = 0;
+
+static inline JaArenaChunk *ja_arena_chunk_new(gsize size,
+                                               JaArenaChunk * next)
+{
+    JaArenaChunk *chunk =
+        (JaArenaChunk *) j_pool_alloc(ARENA_HEADER_SIZE + size);
+    chunk->next = next;
+    chunk->used = 0;
+    chunk->size = j_pool_block_size(chunk) - ARENA_HEADER_SIZE;
+    return chunk;
+}
+
+static void ja_arena_free(gpointer data)
+{
+    JaArenaChunk *chunk = (JaArenaChunk *) data;
+    while (chunk) {
+        JaArenaChunk *next = chunk->next;
+        j_pool_free(chunk);
+        chunk = next;
+    }
+}
+
+/*
+ * Takes the chunks away from request, and raises the high-water mark
+ */
+static inline gpointer ja_request_take_arena(JaRequest * req)
+{
+    JaArenaChunk *chunk = (JaArenaChunk *) req->arena, *ptr;
+    gsize used = 0;
+    for (ptr = chunk; ptr; ptr = ptr->next) {
+        used += ptr->used;
+    }
+    if (used > arena_high_water) {
+        arena_high_water = MIN(used, ARENA_CHUNK_MAX);
+    }
+    req->arena = NULL;
+    return chunk;
+}
+
+
+static inline JaRequest *ja_request_create(struct sockaddr *addr,
+                                           socklen_t addrlen)
 {
-    JaRequest *req = (JaRequest *) g_slice_alloc(sizeof(JaRequest));
-    req->request = g_byte_array_new();
-    g_byte_array_append(req->request, data, len);
+    JaRequest *req = (JaRequest *) j_pool_alloc(sizeof(JaRequest));
 
-    req->response = g_byte_array_new();
+    req->response = NULL;
+    req->response_copied = 0;
+    req->segments = NULL;
+    req->segment_count = 0;
+    req->segment_capacity = 0;
+    req->response_len = 0;
+    req->complete = NULL;
+    req->complete_data = NULL;
+    req->pending = NULL;
+    req->action = 0;
+    req->arena = NULL;
+    req->context = NULL;
+    req->connection = NULL;
 
     if (addr) {
         memcpy(&req->addr, addr, addrlen);
         req->addrlen = addrlen;
-    } else {
+    } else {                    /* the worker keeps the address in the connection */
         req->addrlen = 0;
-        memset(&req->addr, 0, sizeof(struct sockaddr_storage));
+        req->addr.ss_family = AF_UNSPEC;
     }
     return req;
 }
 
+JaRequest *ja_request_new(const void *data, guint len,
+                          struct sockaddr *addr, socklen_t addrlen)
+{
+    JaRequest *req = ja_request_create(addr, addrlen);
+    gchar *copy = (gchar *) j_pool_alloc(len);
+    memcpy(copy, data, len);
+    req->request = copy;
+    req->request_len = len;
+    req->request_owned = TRUE;
+    return req;
+}
+
+JaRequest *ja_request_borrow(const void *data, guint len,
+                             struct sockaddr *addr, socklen_t addrlen)
+{
+    JaRequest *req = ja_request_create(addr, addrlen);
+    req->request = (const gchar *) data;
+    req->request_len = len;
+    req->request_owned = FALSE;
+    return req;
+}
+
+/* if seg is appended by ja_response_append_static() from data of request */
+static inline gboolean ja_request_data_contains(JaRequest * req,
+                                                const JaResponseSegment *
+                                                seg)
+{
+    const gchar *data = (const gchar *) seg->data;
+    return seg->destroy == NULL && data >= req->request &&
+        data < req->request + req->request_len;
+}
+
+/*
+ * The segments pointing into the borrowed data are moved to the copy
+ */
+void ja_request_detach(JaRequest * req)
+{
+    if (req->request_owned) {
+        return;
+    }
+    gchar *copy = (gchar *) j_pool_alloc(req->request_len);
+    memcpy(copy, req->request, req->request_len);
+    guint i;
+    for (i = 0; i < req->segment_count; i++) {
+        JaResponseSegment *seg = &req->segments[i];
+        if (ja_request_data_contains(req, seg)) {
+            seg->data = copy + ((const gchar *) seg->data - req->request);
+        }
+    }
+    req->request = copy;
+    req->request_owned = TRUE;
+}
+
 void ja_request_free(JaRequest * req)
 {
-    g_byte_array_free(req->request, TRUE);
-    g_byte_array_free(req->response, TRUE);
-    g_slice_free1(sizeof(JaRequest), req);
+    if (req->request_owned) {
+        j_pool_free((gpointer) req->request);
+    }
+    ja_response_clear(req);
+    ja_arena_free(ja_request_take_arena(req));
+    if (req->connection) {
+        ja_connection_unref(req->connection);
+    }
+    j_pool_free(req->response);
+    j_pool_free(req->segments);
+    j_pool_free(req);
+}
+
+gpointer ja_request_alloc(JaRequest * req, gsize size)
+{
+    JaArenaChunk *chunk = (JaArenaChunk *) req->arena;
+    size = (size + ARENA_ALIGN - 1) & ~(gsize) (ARENA_ALIGN - 1);
+    if (G_UNLIKELY(chunk == NULL || chunk->used + size > chunk->size)) {
+        gsize want = chunk ? chunk->size * 2 :
+            CLAMP(arena_high_water, ARENA_CHUNK_MIN, ARENA_CHUNK_MAX);
+        chunk = ja_arena_chunk_new(MAX(want, size), chunk);
+        req->arena = chunk;
+    }
+    gpointer mem = ja_arena_chunk_data(chunk) + chunk->used;
+    chunk->used += size;
+    return mem;
+}
+
+gpointer ja_request_alloc0(JaRequest * req, gsize size)
+{
+    gpointer mem = ja_request_alloc(req, size);
+    memset(mem, 0, size);
+    return mem;
+}
+
+gchar *ja_request_strdup(JaRequest * req, const gchar * str)
+{
+    if (str == NULL) {
+        return NULL;
+    }
+    gsize len = strlen(str) + 1;
+    gchar *copy = (gchar *) ja_request_alloc(req, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+
+static inline void ja_response_append_segment(JaRequest * req,
+                                              const void *data, gsize len,
+                                              GDestroyNotify destroy,
+                                              gpointer destroy_data)
+{
+    if (req->segment_count == req->segment_capacity) {
+        req->segments = j_pool_realloc(req->segments,
+                                       sizeof(JaResponseSegment) *
+                                       (req->segment_count + 1));
+        req->segment_capacity = j_pool_block_size(req->segments) /
+            sizeof(JaResponseSegment);
+    }
+    JaResponseSegment *seg = &req->segments[req->segment_count++];
+    seg->data = data;
+    seg->len = len;
+    seg->destroy = destroy;
+    seg->destroy_data = destroy_data;
+    seg->fd = -1;
+    seg->offset = 0;
+    req->response_len += len;
+}
+
+/*
+ * The copied data is kept in req->response, consecutive copies
+ * make only one segment. The data pointer of segment is set when the
+ * response is taken, since the buffer may move until then
+ */
+void ja_response_append(JaRequest * req, const void *data, guint len)
+{
+    if (len == 0) {
+        return;
+    }
+    req->response = j_pool_realloc(req->response,
+                                   req->response_copied + len);
+    memcpy(req->response + req->response_copied, data, len);
+    req->response_copied += len;
+
+    if (req->segment_count > 0) {
+        JaResponseSegment *last = &req->segments[req->segment_count - 1];
+        if (last->data == NULL && !ja_response_segment_is_file(last)) {
+            last->len += len;
+            req->response_len += len;
+            return;
+        }
+    }
+    ja_response_append_segment(req, NULL, len, NULL, NULL);
+}
+
+void ja_response_append_static(JaRequest * req, const void *data,
+                               gsize len)
+{
+    if (len > 0) {
+        ja_response_append_segment(req, data, len, NULL, NULL);
+    }
+}
+
+void ja_response_append_take(JaRequest * req, gpointer data, gsize len,
+                             GDestroyNotify destroy)
+{
+    ja_response_append_segment(req, data, len, destroy, data);
+}
+
+void ja_response_append_file(JaRequest * req, gint fd, off_t offset,
+                             gsize len, GDestroyNotify destroy,
+                             gpointer destroy_data)
+{
+    ja_response_append_segment(req, NULL, len, destroy, destroy_data);
+    JaResponseSegment *seg = &req->segments[req->segment_count - 1];
+    seg->fd = fd;
+    seg->offset = offset;
+}
+
+void ja_response_clear(JaRequest * req)
+{
+    guint i;
+    for (i = 0; i < req->segment_count; i++) {
+        JaResponseSegment *seg = &req->segments[i];
+        if (seg->destroy) {
+            seg->destroy(seg->destroy_data);
+        }
+    }
+    req->segment_count = 0;
+    req->response_copied = 0;
+    req->response_len = 0;
+}
+
+void ja_response_take(JaRequest * req, JaResponseFunc func,
+                      gpointer user_data)
+{
+    gsize offset = 0;
+    gboolean borrowed = FALSE;  /* some data may be in the arena */
+    gboolean echoed = FALSE;    /* some data may be in the request */
+    guint i;
+    for (i = 0; i < req->segment_count && !echoed; i++) {
+        echoed = ja_request_data_contains(req, &req->segments[i]);
+    }
+    if (echoed) {
+        /* the read buffer is reused before it's sent */
+        ja_request_detach(req);
+    }
+    for (i = 0; i < req->segment_count; i++) {
+        JaResponseSegment *seg = &req->segments[i];
+        if (seg->data == NULL && !ja_response_segment_is_file(seg)) {
+            seg->data = req->response + offset;
+            offset += seg->len;
+        } else if (seg->data && seg->destroy == NULL) {
+            borrowed = TRUE;
+        }
+        func(seg, user_data);
+    }
+    if (echoed) {
+        /* the data of request is released after all sent */
+        JaResponseSegment seg =
+            { NULL, 0, j_pool_free, (gpointer) req->request, -1, 0 };
+        func(&seg, user_data);
+        req->request_owned = FALSE;
+    }
+    if (borrowed && req->arena) {
+        /* the arena is released after all sent */
+        JaResponseSegment seg = { NULL, 0, ja_arena_free,
+            ja_request_take_arena(req), -1, 0
+        };
+        func(&seg, user_data);
+    }
+    if (offset > 0) {
+        /* the buffer of copied data is released after all sent */
+        JaResponseSegment seg =
+            { NULL, 0, j_pool_free, req->response, -1, 0 };
+        func(&seg, user_data);
+        req->response = NULL;
+    }
+    req->segment_count = 0;
+    req->response_copied = 0;
+    req->response_len = 0;
+}
+
+
+/* the destroy notifies of connection slots, by slot */
+static GDestroyNotify *slot_destroys = NULL;
+static guint slot_count = 0;
+
+gint ja_connection_slot_new(GDestroyNotify destroy)
+{
+    slot_destroys = g_renew(GDestroyNotify, slot_destroys, slot_count + 1);
+    slot_destroys[slot_count] = destroy;
+    return slot_count++;
+}
+
+JaConnection *ja_connection_new(void)
+{
+    JaConnection *conn =
+        (JaConnection *) j_pool_alloc(sizeof(JaConnection));
+    conn->id = 0;
+    conn->worker_id = -1;
+    conn->addrlen = 0;
+    conn->address[0] = '\0';
+    conn->slots = NULL;
+    conn->slot_count = 0;
+    conn->context = NULL;
+    conn->worker = NULL;
+    g_queue_init(&conn->backlog);
+    conn->refs = 1;
+    conn->overloaded = 0;
+    return conn;
+}
+
+JaConnection *ja_connection_ref(JaConnection * conn)
+{
+    conn->refs++;
+    return conn;
+}
+
+void ja_connection_unref(JaConnection * conn)
+{
+    if (--conn->refs > 0) {
+        return;
+    }
+    guint i;
+    for (i = 0; i < conn->slot_count; i++) {
+        if (conn->slots[i] && slot_destroys[i]) {
+            slot_destroys[i] (conn->slots[i]);
+        }
+    }
+    j_pool_free(conn->slots);
+    j_pool_free(conn);
+}
+
+gpointer ja_connection_get_slot(JaConnection * conn, gint slot)
+{
+    if (slot < 0 || (guint) slot >= conn->slot_count) {
+        return NULL;
+    }
+    return conn->slots[slot];
+}
+
+void ja_connection_set_slot(JaConnection * conn, gint slot, gpointer data)
+{
+    if (slot < 0 || (guint) slot >= slot_count) {
+        g_warning("invalid connection slot %d", slot);
+        return;
+    }
+    if (conn->slots == NULL) {  /* all slots are allocated at first */
+        conn->slots = (gpointer *) j_pool_alloc0(sizeof(gpointer) *
+                                                 slot_count);
+        conn->slot_count = slot_count;
+    }
+    gpointer old = conn->slots[slot];
+    conn->slots[slot] = data;
+    if (old && old != data && slot_destroys[slot]) {
+        slot_destroys[slot] (old);
+    }
 }
@@ -20,33 +20,246 @@
 #define __JA_STRUCT_H__
 
 
+#include <sys/types.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <glib.h>
 #include <jconf.h>
 
-/* a client request */
+/*
+ * A segment of response
+ * The response is sent as a list of segments, without copying them together
+ * A segment is either data in memory, or a range of file sent by sendfile()
+ */
 typedef struct {
-    GByteArray *request;
-    GByteArray *response;
+    const void *data;
+    gsize len;
+    GDestroyNotify destroy;     /* releases data after sent, may be NULL */
+    gpointer destroy_data;
+    gint fd;                    /* the file, -1 if data is in memory */
+    off_t offset;               /* the offset of range in file */
+} JaResponseSegment;
+
+#define ja_response_segment_is_file(seg)    ((seg)->fd>=0)
 
+/*
+ * A client connection
+ * The worker creates one for every connection, and frees it after
+ * the connection is closed and all its requests are freed
+ */
+typedef struct _JaConnection JaConnection;
+struct _JaConnection {
+    /* set when it's accepted, never changed but worker_id */
+    guint64 id;                 /* unique in the process, never reused, 0 if unknown */
+    gint worker_id;             /* the worker handling it */
+    socklen_t addrlen;          /* 0 if the peer address is unknown */
     struct sockaddr_storage addr;
+    /* the peer address formatted, "" if unknown, or the path of unix socket */
+    gchar address[MAX(INET6_ADDRSTRLEN + 8,
+                      sizeof(((struct sockaddr_un *) 0)->sun_path) + 1)];
+
+    gpointer *slots;            /* the data of modules by slot, may be NULL */
+    guint slot_count;
+    gpointer context;           /* the worker context of the module of hook */
+
+    /* private to the worker */
+    gpointer worker;            /* the worker it belongs to, may be NULL */
+    GQueue backlog;             /* the requests not answered, in order */
+    guint refs;                 /* one while it's open, and one for every request */
+    gint overloaded;            /* the writes reach the high water mark, ja_push() fails */
+};
+
+/*
+ * A client request
+ * JaRequest and its buffers are allocated from JPool
+ */
+typedef struct _JaRequest JaRequest;
+struct _JaRequest {
+    const gchar *request;
+    guint request_len;
+    gboolean request_owned;     /* FALSE if request is borrowed */
+
+    gchar *response;            /* data copied by ja_response_append(), may be NULL */
+    gsize response_copied;
+    JaResponseSegment *segments;    /* data is NULL if it's in response */
+    guint segment_count;
+    guint segment_capacity;
+    gsize response_len;
+
+    /*
+     * private to the worker, for the request handled asynchronously,
+     * ja_request_complete() saves the action and calls complete
+     */
+    void (*complete) (JaRequest * req);
+    gpointer complete_data;
+    gpointer pending;
+    gint action;
+
+    gpointer arena;             /* the chunk of arena being filled, may be NULL */
+
+    gpointer context;           /* the worker context of the module of hook */
+    JaConnection *connection;   /* the connection it's read from, may be NULL */
+
     socklen_t addrlen;
-} JaRequest;
+    struct sockaddr_storage addr;
+};
 
+/*
+ * Creates a JaRequest with a copy of data
+ */
 JaRequest *ja_request_new(const void *data, guint len,
                           struct sockaddr *addr, socklen_t addrlen);
 
+/*
+ * Creates a JaRequest which points to data without copying it,
+ * data must be valid until ja_request_free() or ja_request_detach()
+ *
+ * The requests passed to hooks are created so, from the read buffer of
+ * connection, their data is valid only during the hook chain
+ */
+JaRequest *ja_request_borrow(const void *data, guint len,
+                             struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Makes the request own a copy of its data if it's borrowed,
+ * a module that keeps the request after the hook returns must call this.
+ * The response appended from the borrowed data is moved to the copy
+ */
+void ja_request_detach(JaRequest * req);
+
 void ja_request_free(JaRequest * req);
 
-#define ja_request_data(req) (req)->request->data
-#define ja_request_data_length(req)  (req)->request->len
+/*
+ * Allocates size bytes from the arena of request, aligned to 16 bytes.
+ * The memory is released all together with the request, it must not be
+ * freed. It can be appended to the response by ja_response_append_static(),
+ * the arena is kept until the response is sent then.
+ * It's not thread safe, only one thread can use the request at a time
+ */
+gpointer ja_request_alloc(JaRequest * req, gsize size);
 
-#define ja_response_data(req)    (req)->response->data
-#define ja_response_data_length(req) (req)->response->len
+/*
+ * Allocates size bytes filled with zero from the arena of request
+ */
+gpointer ja_request_alloc0(JaRequest * req, gsize size);
 
-#define ja_response_append(req,data,len)  g_byte_array_append( (req)->response, (data), (len) )
-#define ja_response_set(req,data,len)    do{g_byte_array_set_size ((req)->response, 0);ja_response_append(req,(data),(len));}while(0)
+/*
+ * Duplicates str in the arena of request, str can be NULL
+ */
+gchar *ja_request_strdup(JaRequest * req, const gchar * str);
+
+/*
+ * The context the module of the hook being called created for the worker
+ * handling the request, see JaModuleWorkerInit.
+ * It's NULL in blocking hooks, which don't run in the worker
+ */
+#define ja_request_context(req) (req)->context
+
+/*
+ * The connection the request is read from, NULL if it's not from one
+ * The connection is valid until the request is freed, even if it's closed.
+ * Like the connection itself, it must be used only in the worker
+ */
+#define ja_request_connection(req)  (req)->connection
+
+/*
+ * The identity of the connection the request is read from,
+ * precomputed when it's accepted. The connection id is 0, the worker id is
+ * -1 and the address is NULL for the requests not from a connection
+ */
+#define ja_request_connection_id(req)   ((req)->connection?(req)->connection->id:0)
+#define ja_request_worker_id(req)   ((req)->connection?(req)->connection->worker_id:-1)
+/* the peer address like "127.0.0.1:80", NULL if it's unknown */
+#define ja_request_peer_address(req)    ((req)->connection&&(req)->connection->address[0]?(req)->connection->address:NULL)
+/* the struct sockaddr of peer, and its length, 0 if unknown */
+#define ja_request_peer(req)    ((req)->connection?(const struct sockaddr*)&(req)->connection->addr:(const struct sockaddr*)&(req)->addr)
+#define ja_request_peer_length(req) ((req)->connection?(req)->connection->addrlen:(req)->addrlen)
+
+#define ja_request_data(req) (req)->request
+#define ja_request_data_length(req)  (req)->request_len
+
+#define ja_response_data_length(req) (req)->response_len
+
+/*
+ * Appends a copy of data to the response
+ */
+void ja_response_append(JaRequest * req, const void *data, guint len);
+
+/*
+ * Appends data to the response without copying it,
+ * data must be valid until it's sent, like a static string.
+ * A part of ja_request_data(req) is fine, the data of request is kept
+ * until it's sent, or copied first if the request is borrowed
+ */
+void ja_response_append_static(JaRequest * req, const void *data,
+                               gsize len);
+
+/*
+ * Appends data to the response without copying it,
+ * and takes the ownership of data, destroy(data) is called after it's sent
+ */
+void ja_response_append_take(JaRequest * req, gpointer data, gsize len,
+                             GDestroyNotify destroy);
+
+/*
+ * Appends len bytes of file fd from offset to the response,
+ * they're sent by sendfile() without being read into user space.
+ * fd must be valid until it's sent, then destroy(destroy_data) is called
+ * if destroy is not NULL, to close fd for example.
+ * (A region of shared mmap() is data in memory, it can be appended by
+ * ja_response_append_static() or ja_response_append_take())
+ */
+void ja_response_append_file(JaRequest * req, gint fd, off_t offset,
+                             gsize len, GDestroyNotify destroy,
+                             gpointer destroy_data);
+
+/*
+ * Removes all data of the response
+ */
+void ja_response_clear(JaRequest * req);
+
+#define ja_response_set(req,data,len)    do{ja_response_clear(req);ja_response_append(req,(data),(len));}while(0)
+
+typedef void (*JaResponseFunc) (const JaResponseSegment * seg,
+                                gpointer user_data);
+
+/*
+ * Passes every segment of the response to func in order,
+ * with the ownership of them, func must call seg->destroy(seg->destroy_data)
+ * after data is used, if it's not NULL.
+ * The response is empty after this call
+ */
+void ja_response_take(JaRequest * req, JaResponseFunc func,
+                      gpointer user_data);
+
+
+JaConnection *ja_connection_new(void);
+JaConnection *ja_connection_ref(JaConnection * conn);
+/* the slots are destroyed when the last reference is gone */
+void ja_connection_unref(JaConnection * conn);
+
+/*
+ * Allocates a slot of connection for a module, called when the module is
+ * loaded. Every connection has its own data in the slot, NULL at first,
+ * destroy(data) is called when it's replaced or the connection is freed
+ * Returns the index of slot
+ */
+gint ja_connection_slot_new(GDestroyNotify destroy);
+
+/*
+ * Gets and sets the data of connection in slot
+ * The connection and its slots are used by the worker thread only:
+ * by the connection hooks, and the request hooks not blocking
+ */
+gpointer ja_connection_get_slot(JaConnection * conn, gint slot);
+void ja_connection_set_slot(JaConnection * conn, gint slot, gpointer data);
+
+/*
+ * The context the module of the hook being called created for the worker,
+ * see ja_request_context()
+ */
+#define ja_connection_context(conn) (conn)->context
 
 
 /*******************************************************************/
@@ -56,6 +269,15 @@ void ja_request_free(JaRequest * req);
 typedef void (*JaModuleInit) (void);
 /* Registers hooks */
 typedef void (*JaModuleHooksInit) (void);
+/*
+ * Creates the context of module for a worker, called in the worker thread
+ * before it handles any request. The hooks of module get it by
+ * ja_request_context() when called in the worker, so the state in it
+ * is used by one thread only, and needs no lock
+ */
+typedef gpointer(*JaModuleWorkerInit) (gint worker_id);
+/* Frees the context of worker, called in the worker thread when it quits */
+typedef void (*JaModuleWorkerFree) (gpointer context);
 
 
 typedef struct {
@@ -64,6 +286,8 @@ typedef struct {
     JaModuleInit init_func;
     // JaModuleConfigHandler cfg_handler;
     JaModuleHooksInit hooks_init_func;
+    JaModuleWorkerInit worker_init_func;    /* may be NULL */
+    JaModuleWorkerFree worker_free_func;    /* may be NULL */
 } JaModule;
 
 
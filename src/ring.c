@@ -0,0 +1,123 @@
+/*
+ * ring.c
+ *
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ring.h"
+
+#define CACHELINE_SIZE  64
+
+/*
+ * Every cell has a sequence number, which tells whether the cell is
+ * ready for the producer at position seq (empty),
+ * or for the consumer at position seq-1 (full)
+ */
+typedef struct {
+    guint64 seq;
+    gpointer data;
+} JaRingCell;
+
+struct _JaRing {
+    guint64 mask;
+    JaRingCell *cells;
+
+    /* producers and the consumer don't share cache lines */
+    gchar pad0[CACHELINE_SIZE];
+    guint64 tail;               /* the next position to push */
+    gchar pad1[CACHELINE_SIZE];
+    guint64 head;               /* the next position to pop */
+    gchar pad2[CACHELINE_SIZE];
+};
+
+
+JaRing *ja_ring_new(guint32 size)
+{
+    guint64 capacity = 2;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    JaRing *ring = (JaRing *) g_slice_alloc(sizeof(JaRing));
+    ring->mask = capacity - 1;
+    ring->cells = (JaRingCell *) g_malloc(sizeof(JaRingCell) * capacity);
+    guint64 i;
+    for (i = 0; i < capacity; i++) {
+        ring->cells[i].seq = i;
+        ring->cells[i].data = NULL;
+    }
+    ring->tail = 0;
+    ring->head = 0;
+    return ring;
+}
+
+void ja_ring_free(JaRing * ring)
+{
+    g_free(ring->cells);
+    g_slice_free1(sizeof(JaRing), ring);
+}
+
+/*
+ * Pushes data into the ring
+ * Returns FALSE if the ring is full
+ */
+gboolean ja_ring_push(JaRing * ring, gpointer data)
+{
+    guint64 pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    JaRingCell *cell;
+    while (TRUE) {
+        cell = &ring->cells[pos & ring->mask];
+        guint64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        gint64 dif = (gint64) seq - (gint64) pos;
+        if (dif == 0) {
+            /* the cell is empty, try to take it */
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1,
+                                            TRUE, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return FALSE;       /* full */
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/*
+ * Pops the oldest data
+ * Returns NULL if the ring is empty
+ */
+gpointer ja_ring_pop(JaRing * ring)
+{
+    guint64 pos = ring->head;
+    JaRingCell *cell = &ring->cells[pos & ring->mask];
+    guint64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq != pos + 1) {
+        return NULL;            /* empty, or the producer isn't done */
+    }
+    gpointer data = cell->data;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->head = pos + 1;
+    return data;
+}
+
+gboolean ja_ring_is_empty(JaRing * ring)
+{
+    JaRingCell *cell = &ring->cells[ring->head & ring->mask];
+    return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != ring->head + 1;
+}
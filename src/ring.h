@@ -0,0 +1,57 @@
+/*
+ * ring.h
+ *
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __JA_RING_H__
+#define __JA_RING_H__
+
+#include <glib.h>
+
+/*
+ * JaRing - a bounded lock-free queue of pointers
+ * Any thread can push, but only one thread (the owner) can pop
+ */
+typedef struct _JaRing JaRing;
+
+
+/*
+ * Creates a JaRing
+ * @param size, the capacity, rounded up to a power of two
+ */
+JaRing *ja_ring_new(guint32 size);
+
+void ja_ring_free(JaRing * ring);
+
+/*
+ * Pushes data into the ring, data can't be NULL
+ * Returns FALSE if the ring is full
+ */
+gboolean ja_ring_push(JaRing * ring, gpointer data);
+
+/*
+ * Pops the oldest data
+ * Returns NULL if the ring is empty
+ */
+gpointer ja_ring_pop(JaRing * ring);
+
+/*
+ * Checks if the ring is empty, only meaningful for the owner
+ */
+gboolean ja_ring_is_empty(JaRing * ring);
+
+
+#endif                          /* __JA_RING_H__ */
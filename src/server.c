@@ -21,11 +21,31 @@
 #include "config.h"
 #include "utils.h"
 #include "log.h"
+#include "affinity.h"
 #include <signal.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
 #include <glib/gi18n-lib.h>
 
 
+/* the seconds between two checks of worker utilization */
+#define TICK_INTERVAL   1
+/* the workers are scaled every SCALE_TICKS checks */
+#define SCALE_TICKS     5
+/* adds a worker if the average utilization is higher */
+#define SCALE_UP_UTILIZATION    0.75
+/* retires a worker if the others would be utilized less than this after it */
+#define SCALE_DOWN_UTILIZATION  0.5
+/*
+ * the busiest worker hands connections off to the idlest one, if it's
+ * utilized more than BALANCE_UTILIZATION, and BALANCE_GAP more than that
+ */
+#define BALANCE_UTILIZATION     0.5
+#define BALANCE_GAP             0.2
+
+
 static JaServer *gServer = NULL;
 
 /*
@@ -36,6 +56,12 @@ static inline JaServer *ja_server_alloc(const gchar * name,
                                         gint max_pending,
                                         gint thread_count, JaConfig * cfg);
 
+/*
+ * Places the server process and its workers on the CPUs and NUMA node
+ * configured, before any worker is created
+ */
+static inline void ja_server_place(JaServer * server);
+
 /*
  * The main loop of server process
  * This function will never return, if error occurs or signal catched, it will call _exit() but not return
@@ -141,6 +167,44 @@ static inline void ja_server_create_from_file(const gchar * name,
 
     gServer =
         ja_server_alloc(name, listen_port, max_pending, thread_count, cfg);
+    gServer->reuse_port =
+        g_strcmp0(j_parser_get_directive_text(cfg, DIRECTIVE_REUSE_PORT),
+                  "on") == 0;
+    gServer->steer_cpu =
+        g_strcmp0(j_parser_get_directive_text(cfg,
+                                              DIRECTIVE_REUSE_PORT_STEERING),
+                  "cpu") == 0;
+    gServer->balance =
+        g_strcmp0(j_parser_get_directive_text(cfg, DIRECTIVE_BALANCE),
+                  "on") == 0;
+    gint min_threads = j_parser_get_directive_integer(cfg,
+                                                      DIRECTIVE_MIN_THREADS);
+    gint max_threads = j_parser_get_directive_integer(cfg,
+                                                      DIRECTIVE_MAX_THREADS);
+    if (gServer->steer_cpu && !gServer->reuse_port) {
+        g_warning(_("Server %s:ReusePortSteering is ignored without ReusePort"),
+                  name);
+        gServer->steer_cpu = FALSE;
+    }
+    if (max_threads > 0) {
+        gServer->min_threads = MAX(min_threads, 1);
+        gServer->max_threads = MAX(max_threads, gServer->min_threads);
+        gServer->thread_count = CLAMP(thread_count, gServer->min_threads,
+                                      gServer->max_threads);
+    }
+    j_pool_set_hugepages(g_strcmp0
+                         (j_parser_get_directive_text
+                          (cfg, DIRECTIVE_HUGE_PAGES), "on") == 0);
+    gint max_package = j_parser_get_directive_integer(cfg,
+                                                      DIRECTIVE_MAX_PACKAGE);
+    j_socket_set_max_package(MAX(max_package, 0));
+    ja_server_place(gServer);
+    if (gServer->steer_cpu && gServer->cpus == NULL) {
+        /* the kernel would hash the connections anyway */
+        g_warning(_("Server %s:ReusePortSteering needs CPUAffinity, "
+                    "ignored"), name);
+        gServer->steer_cpu = FALSE;
+    }
 
     /* Loads modules */
     ja_config_load_modules(cfg);
@@ -160,12 +224,185 @@ static inline JaServer *ja_server_alloc(const gchar * name,
     server->listen_port = listen_port;
     server->max_pending = max_pending;
     server->thread_count = thread_count;
+    server->min_threads = thread_count;
+    server->max_threads = 0;
+    server->reuse_port = FALSE;
+    server->steer_cpu = FALSE;
     server->listen_sock = NULL;
     server->cfg = cfg;
     server->workers = NULL;
+    server->group = g_ptr_array_new();
+    server->dead = NULL;
+    server->next_id = 0;
+    server->retiring = NULL;
+    server->shedding = NULL;
+    server->tick_time = 0;
+    server->scale_total = 0;
+    server->scale_ticks = 0;
+    server->balance = FALSE;
+    server->cpus = NULL;
+    server->cpu_count = 0;
     return server;
 }
 
+/*
+ * Keeps the CPUs in both lists, frees the first one
+ */
+static inline gint *ja_server_cpu_intersect(gint * cpus, gint * count,
+                                            const gint * allowed,
+                                            gint allowed_count)
+{
+    gint i, j, n = 0;
+    for (i = 0; i < *count; i++) {
+        for (j = 0; j < allowed_count; j++) {
+            if (cpus[i] == allowed[j]) {
+                cpus[n++] = cpus[i];
+                break;
+            }
+        }
+    }
+    *count = n;
+    if (n == 0) {
+        g_free(cpus);
+        return NULL;
+    }
+    return cpus;
+}
+
+static inline void ja_server_place(JaServer * server)
+{
+    const gchar *affinity = j_parser_get_directive_text(server->cfg,
+                                                        DIRECTIVE_CPU_AFFINITY);
+    const gchar *numa = j_parser_get_directive_text(server->cfg,
+                                                    DIRECTIVE_NUMA_NODE);
+    gint count = 0;
+    gint *cpus = NULL;
+    if (affinity) {
+        cpus = ja_cpu_list_parse(affinity, &count);
+        if (cpus == NULL) {
+            g_warning(_("Server %s:Invalid CPUAffinity %s"), server->name,
+                      affinity);
+        }
+    }
+    if (numa) {
+        gchar *end = NULL;
+        gint node = (gint) g_ascii_strtoll(numa, &end, 10);
+        gint node_count = 0;
+        if (end == numa || *end != '\0') {
+            node = -1;
+        }
+        gint *node_cpus = ja_numa_node_cpus(node, &node_count);
+        if (node_cpus == NULL) {
+            g_warning(_("Server %s:No NUMA node %s"), server->name, numa);
+        } else {
+            /* threads inherit both the CPUs and the memory policy */
+            ja_cpu_set_process(node_cpus, node_count);
+            ja_numa_prefer_node(node);
+            if (cpus) {
+                cpus = ja_server_cpu_intersect(cpus, &count, node_cpus,
+                                               node_count);
+                if (cpus == NULL) {
+                    g_warning(_("Server %s:CPUAffinity is not on node %d"),
+                              server->name, node);
+                }
+            }
+            g_free(node_cpus);
+        }
+    }
+    server->cpus = cpus;
+    server->cpu_count = count;
+}
+
+/*
+ * Creates a worker
+ * In ReusePort mode, the worker gets its own listening socket
+ */
+static inline JaWorker *ja_server_new_worker(JaServer * server, gint id)
+{
+    JSocket *listen_sock = NULL;
+    if (server->reuse_port) {
+        listen_sock = j_server_socket_new_reuseport(server->listen_port,
+                                                    server->max_pending);
+        if (listen_sock == NULL) {
+            g_warning(_("Server %s:Fail to listen on port %d"),
+                      server->name, server->listen_port);
+            return NULL;
+        }
+    }
+    gint cpu = server->cpus ? server->cpus[id % server->cpu_count] : -1;
+    JaWorker *worker = ja_worker_create(server->cfg, id, cpu, listen_sock);
+    if (worker == NULL && listen_sock) {
+        j_socket_close(listen_sock);
+    } else if (worker && listen_sock) {
+        g_ptr_array_add(server->group, worker);
+    }
+    return worker;
+}
+
+/*
+ * Frees the worker, or keeps it in dead until its requests in blocking
+ * hooks are done. Its socket leaves the SO_REUSEPORT group at once:
+ * the last socket of the group takes its place, as the kernel does
+ */
+static inline void ja_server_free_worker(JaServer * server,
+                                         JaWorker * worker)
+{
+    g_ptr_array_remove_fast(server->group, worker);
+    if (ja_worker_reap(worker)) {
+        ja_worker_free(worker);
+    } else {
+        server->dead = g_list_prepend(server->dead, worker);
+    }
+}
+
+/*
+ * Frees the dead workers whose requests are all done
+ */
+static inline void ja_server_reap_dead(JaServer * server)
+{
+    GList *ptr = server->dead;
+    while (ptr) {
+        GList *next = g_list_next(ptr);
+        JaWorker *jw = (JaWorker *) ptr->data;
+        if (ja_worker_reap(jw)) {
+            ja_worker_free(jw);
+            server->dead = g_list_delete_link(server->dead, ptr);
+        }
+        ptr = next;
+    }
+}
+
+/*
+ * Attaches the CPU steering program to the SO_REUSEPORT group,
+ * by the CPUs the workers in it are pinned to. The retiring worker
+ * gets nothing, though its socket is in the group until it has retired.
+ * Called whenever the group changes, or a worker starts retiring
+ */
+static inline void ja_server_steer(JaServer * server)
+{
+    if (!server->steer_cpu) {
+        return;
+    }
+    guint32 i, count = server->group->len;
+    gint cpus[MAX(count, 1)];
+    JSocket *jsock = NULL;
+    for (i = 0; i < count; i++) {
+        JaWorker *worker = (JaWorker *) g_ptr_array_index(server->group, i);
+        if (worker == server->retiring) {
+            /* it's closing its socket */
+            cpus[i] = -1;
+            continue;
+        }
+        cpus[i] = ja_worker_get_cpu(worker);
+        jsock = ja_worker_get_listen_socket(worker);
+    }
+    /* the program applies to the whole group */
+    if (jsock && !j_socket_reuseport_steer_cpu(jsock, cpus, count)) {
+        g_warning(_("Server %s:Fail to attach CPU steering program"),
+                  server->name);
+    }
+}
+
 /*
  * find a worker that can handle more connection
  * if no existing one found, and more worker is allowed to create, then create a new one
@@ -173,8 +410,10 @@ static inline JaServer *ja_server_alloc(const gchar * name,
  */
 static inline JaWorker *ja_server_find_worker(JaServer * server)
 {
+    ja_server_reap_dead(server);
     GList *ptr = server->workers;
     JaWorker *worker = NULL;
+    gboolean restarted = FALSE;
     while (ptr) {
         GList *next = g_list_next(ptr);
         JaWorker *jw = (JaWorker *) ptr->data;
@@ -182,16 +421,15 @@ static inline JaWorker *ja_server_find_worker(JaServer * server)
             /* a worker quits unexpectedly. restart it */
             g_warning(_("Server %s:Restart worker %d"), server->name,
                       ja_worker_get_id(jw));
-            ptr->data =
-                ja_worker_create(server->cfg, ja_worker_get_id(jw));
+            ptr->data = ja_server_new_worker(server, ja_worker_get_id(jw));
             if (ptr->data) {
                 /* successfully */
-                worker = jw;
+                worker = (JaWorker *) ptr->data;
             } else {            /* fail saddly */
                 g_warning(_("Server %s:Fail to restart worker %d"),
                           server->name, ja_worker_get_id(jw));
                 GList *prev = g_list_previous(ptr);
-                if (ptr) {
+                if (prev) {
                     prev->next = next;
                 } else {
                     server->workers = next;
@@ -201,13 +439,17 @@ static inline JaWorker *ja_server_find_worker(JaServer * server)
                 }
                 g_list_free1(ptr);
             }
-            ja_worker_free(jw);
+            ja_server_free_worker(server, jw);
+            restarted = TRUE;
         } else if (worker == NULL
                    || ja_worker_payload(worker) > ja_worker_payload(jw)) {
             worker = jw;
         }
         ptr = next;
     }
+    if (restarted) {
+        ja_server_steer(server);
+    }
     return worker;
 }
 
@@ -216,7 +458,7 @@ static inline void ja_server_initialize_workers(JaServer * server)
     gint count = server->thread_count;
     gint i = 0;
     for (i = 0; i < count; i++) {
-        JaWorker *worker = ja_worker_create(server->cfg, i);
+        JaWorker *worker = ja_server_new_worker(server, server->next_id++);
         if (worker) {
             server->workers = g_list_prepend(server->workers, worker);
         } else {
@@ -225,22 +467,236 @@ static inline void ja_server_initialize_workers(JaServer * server)
     }
 }
 
+/*
+ * Frees the retired worker, returns FALSE if it's still handing off
+ */
+static inline gboolean ja_server_reap_retired(JaServer * server)
+{
+    if (server->retiring == NULL) {
+        return TRUE;
+    }
+    if (!ja_worker_is_retired(server->retiring)) {
+        return FALSE;
+    }
+    ja_server_free_worker(server, server->retiring);
+    server->retiring = NULL;
+    ja_server_steer(server);
+    return TRUE;
+}
+
+/*
+ * Retires the worker with the least connections,
+ * they're handed off to the others
+ */
+static inline void ja_server_retire_worker(JaServer * server)
+{
+    JaWorker *worker = NULL;
+    GList *ptr = server->workers;
+    while (ptr) {
+        JaWorker *jw = (JaWorker *) ptr->data;
+        if (worker == NULL
+            || ja_worker_payload(jw) < ja_worker_payload(worker)) {
+            worker = jw;
+        }
+        ptr = g_list_next(ptr);
+    }
+    server->workers = g_list_remove(server->workers, worker);
+
+    guint count = g_list_length(server->workers);
+    JaWorker *heirs[count];
+    guint i = 0;
+    for (ptr = server->workers; ptr; ptr = g_list_next(ptr)) {
+        heirs[i++] = (JaWorker *) ptr->data;
+    }
+    ja_worker_retire(worker, heirs, count);
+    server->retiring = worker;
+    ja_server_steer(server);
+}
+
+/*
+ * Checks if the last worker asked to hand connections off has done
+ */
+static inline gboolean ja_server_shed_done(JaServer * server)
+{
+    if (server->shedding && ja_worker_is_shedding(server->shedding)) {
+        return FALSE;
+    }
+    server->shedding = NULL;
+    return TRUE;
+}
+
+/*
+ * Grows or shrinks the workers by the average utilization
+ * Only one worker is added or retired at a time
+ */
+static inline void ja_server_scale(JaServer * server, gdouble average,
+                                   gint count)
+{
+    if (average > SCALE_UP_UTILIZATION && count < server->max_threads) {
+        JaWorker *worker = ja_server_new_worker(server, server->next_id++);
+        if (worker == NULL) {
+            g_warning(_("Server %s:Fail to create worker"), server->name);
+            return;
+        }
+        ja_worker_sample_utilization(worker);
+        server->workers = g_list_prepend(server->workers, worker);
+        ja_server_steer(server);
+        g_message("server %s: %.0f%% utilized, worker %d added, %d workers",
+                  server->name, average * 100, ja_worker_get_id(worker),
+                  count + 1);
+    } else if (count > server->min_threads
+               && average * count / (count - 1) < SCALE_DOWN_UTILIZATION
+               && ja_server_shed_done(server)) {
+        ja_server_retire_worker(server);
+        g_message("server %s: %.0f%% utilized, worker %d retiring, %d workers",
+                  server->name, average * 100,
+                  ja_worker_get_id(server->retiring), count - 1);
+    }
+}
+
+/*
+ * Asks the busiest worker to hand half of the gap of utilization
+ * off to the idlest one
+ */
+static inline void ja_server_balance(JaServer * server, JaWorker * busiest,
+                                     gdouble high, JaWorker * idlest,
+                                     gdouble low)
+{
+    if (busiest == idlest || high < BALANCE_UTILIZATION
+        || high - low < BALANCE_GAP || !ja_server_shed_done(server)) {
+        return;
+    }
+    if (ja_worker_shed(busiest, idlest, (high - low) / 2)) {
+        server->shedding = busiest;
+        g_message("server %s: worker %d %.0f%% utilized, worker %d %.0f%%, "
+                  "balancing", server->name, ja_worker_get_id(busiest),
+                  high * 100, ja_worker_get_id(idlest), low * 100);
+    }
+}
+
+/*
+ * Samples the utilization of workers every TICK_INTERVAL,
+ * balances them if Balance is on, and scales them every SCALE_TICKS
+ * if MaxThreads is set.
+ * Nothing is done until the last retired worker has handed off
+ * all its connections
+ */
+static inline void ja_server_tick(JaServer * server)
+{
+    gint64 now = g_get_monotonic_time();
+    if (now < server->tick_time) {
+        return;
+    }
+    server->tick_time = now + TICK_INTERVAL * G_USEC_PER_SEC;
+    if (!ja_server_reap_retired(server) || server->workers == NULL) {
+        return;
+    }
+
+    gint count = 0;
+    gdouble total = 0, high = 0, low = 0;
+    JaWorker *busiest = NULL, *idlest = NULL;
+    GList *ptr = server->workers;
+    while (ptr) {
+        JaWorker *jw = (JaWorker *) ptr->data;
+        gdouble utilization = ja_worker_sample_utilization(jw);
+        if (busiest == NULL || utilization > high) {
+            busiest = jw;
+            high = utilization;
+        }
+        if (idlest == NULL || utilization < low) {
+            idlest = jw;
+            low = utilization;
+        }
+        total += utilization;
+        count++;
+        ptr = g_list_next(ptr);
+    }
+    if (server->balance) {
+        ja_server_balance(server, busiest, high, idlest, low);
+    }
+    if (server->max_threads > 0) {
+        server->scale_total += total / count;
+        if (++server->scale_ticks >= SCALE_TICKS) {
+            gdouble average = server->scale_total / server->scale_ticks;
+            server->scale_total = 0;
+            server->scale_ticks = 0;
+            ja_server_scale(server, average, count);
+        }
+    }
+}
+
+/*
+ * Waits for a connection on the listening socket, at most timeout ms
+ * Returns 1 if a connection is pending, 0 on timeout, -1 on error
+ */
+static inline gint ja_server_wait_listen(JaServer * server, gint timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = j_socket_fd(server->listen_sock);
+    pfd.events = POLLIN;
+    gint ret = poll(&pfd, 1, timeout);
+    if (ret < 0 && errno == EINTR) {
+        return 0;
+    }
+    return ret;
+}
+
+/*
+ * In ReusePort mode, workers accept connections themselves,
+ * the main thread only restarts workers that quit unexpectedly,
+ * and balances them if Balance is on
+ */
+static inline void ja_server_supervise(JaServer * server)
+{
+    while (server->workers) {
+        g_usleep(G_USEC_PER_SEC);
+        ja_server_find_worker(server);
+        ja_server_tick(server);
+    }
+    g_warning(_("Server %s quits unexpectedly: no worker"), server->name);
+    ja_server_quit(server);
+}
+
 
 static void inline ja_server_initialize(JaServer * server);
 
-#include <errno.h>
-#include <string.h>
 static inline void ja_server_main(JaServer * server)
 {
     g_message("server : %s", server->name);
     g_message("\tListenPort:%d", server->listen_port);
     g_message("\tMaxPending:%d", server->max_pending);
     g_message("\tThreadCount:%d", server->thread_count);
+    if (server->max_threads > 0) {
+        g_message("\tMinThreads:%d", server->min_threads);
+        g_message("\tMaxThreads:%d", server->max_threads);
+    }
+    g_message("\tReusePort:%s", server->reuse_port ? "on" : "off");
+    g_message("\tBalance:%s", server->balance ? "on" : "off");
+    if (server->cpus) {
+        g_message("\tCPUAffinity:%d CPUs", server->cpu_count);
+    }
 
     ja_server_initialize(server);
+    if (server->reuse_port) {
+        ja_server_supervise(server);
+    }
 
     JSocket *conn = NULL;
-    while ((conn = j_socket_accept(server->listen_sock))) {
+    while (TRUE) {
+        if (server->max_threads > 0 || server->balance) {
+            gint ready = ja_server_wait_listen(server,
+                                               TICK_INTERVAL * 1000);
+            if (ready < 0) {
+                break;
+            }
+            ja_server_tick(server);
+            if (ready == 0) {
+                continue;
+            }
+        }
+        if ((conn = j_socket_accept(server->listen_sock)) == NULL) {
+            break;
+        }
         JaWorker *worker = ja_server_find_worker(server);
         if (!worker) {
             j_socket_close(conn);
@@ -261,12 +717,16 @@ static void inline ja_server_initialize(JaServer * server)
     }
     signal_initialize();
     ja_server_initialize_workers(server);
-    JSocket *jsock =
-        j_server_socket_new(server->listen_port, server->max_pending);
-    if (jsock == NULL) {
-        _exit(-1);
+    if (server->reuse_port) {
+        ja_server_steer(server);
+    } else {
+        JSocket *jsock =
+            j_server_socket_new(server->listen_port, server->max_pending);
+        if (jsock == NULL) {
+            _exit(-1);
+        }
+        server->listen_sock = jsock;
     }
-    server->listen_sock = jsock;
 
     set_proctitle((gchar **) NULL, "jacques: server %s", server->name);
 }
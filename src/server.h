@@ -35,6 +35,39 @@
 #define DIRECTIVE_THREAD_COUNT "ThreadCount"
 #define DIRECTIVE_LOG_MESSAGE "LogMessage"
 #define DIRECTIVE_LOG_ERROR "LogError"
+/* ReusePort on: every worker listens on its own SO_REUSEPORT socket */
+#define DIRECTIVE_REUSE_PORT "ReusePort"
+/* ReusePortSteering cpu: the worker is selected by the receiving CPU */
+#define DIRECTIVE_REUSE_PORT_STEERING "ReusePortSteering"
+/* HugePages on: the memory pool allocates slabs from hugepages */
+#define DIRECTIVE_HUGE_PAGES "HugePages"
+/* MaxPackage 1048576: a connection sending a longer package is closed */
+#define DIRECTIVE_MAX_PACKAGE "MaxPackage"
+/*
+ * MinThreads/MaxThreads: the workers grow and shrink between them
+ * by the utilization of their loops, ThreadCount is the initial count.
+ * If MaxThreads is not set, the count is fixed.
+ * In ReusePort mode, a worker added listens on its own socket too,
+ * and a worker retired closes its socket
+ */
+#define DIRECTIVE_MIN_THREADS "MinThreads"
+#define DIRECTIVE_MAX_THREADS "MaxThreads"
+/*
+ * Balance on: workers measure the load of every connection,
+ * and the busiest worker hands connections off to the idlest one
+ */
+#define DIRECTIVE_BALANCE "Balance"
+/*
+ * CPUAffinity 0-7,16-23: worker N is pinned to the Nth CPU of the list,
+ * wrapping around. ReusePortSteering cpu needs it, the connections
+ * received on a CPU go to the worker pinned to it
+ */
+#define DIRECTIVE_CPU_AFFINITY "CPUAffinity"
+/*
+ * NumaNode 1: the server process runs on the CPUs of the node,
+ * and allocates its memory there. CPUAffinity is limited to the node
+ */
+#define DIRECTIVE_NUMA_NODE "NumaNode"
 
 #define DEFAULT_MAX_PENDING 256
 #define DEFAULT_THREAD_COUNT  1
@@ -53,9 +86,29 @@ typedef struct {
     gint listen_port;
     gint max_pending;
     gint thread_count;
-
-    JSocket *listen_sock;
+    gint min_threads;
+    gint max_threads;           /* 0 if the count of workers is fixed */
+    gboolean reuse_port;
+    gboolean steer_cpu;
+    gboolean balance;
+    gint *cpus;                 /* the CPUs workers are pinned to, or NULL */
+    gint cpu_count;
+
+    JSocket *listen_sock;       /* NULL if reuse_port */
     GList *workers;             /* the list of worker thread */
+    /*
+     * In ReusePort mode, the workers in the order of their sockets
+     * in the SO_REUSEPORT group, which the steering program selects by
+     */
+    GPtrArray *group;
+    /* the workers quit unexpectedly, with requests still in blocking hooks */
+    GList *dead;
+    gint next_id;               /* the id of next worker created */
+    struct _JaWorker *retiring; /* the worker handing off its connections */
+    struct _JaWorker *shedding; /* the worker asked to hand off some */
+    gint64 tick_time;           /* when the utilization is checked next */
+    gdouble scale_total;        /* the sum of utilization since last scaling */
+    gint scale_ticks;
     JaConfig *cfg;
 } JaServer;
 
@@ -0,0 +1,281 @@
+/*
+ * test-jpoll.c
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The timer wheel of JPoll, the coarse clock is set by hand
+ * so that no test has to sleep. And the JSockets closed lingering
+ * for their MSG_ZEROCOPY sends
+ */
+
+#include "jpoll.h"
+#include <glib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+
+#define TEST_KEEPALIVE  10
+
+/* the data sent with MSG_ZEROCOPY, more than the socket buffers hold */
+#define TEST_SEGMENTS   64
+#define TEST_SEGMENT_SIZE   (64 * 1024)
+
+
+typedef struct {
+    JPoll *jp;
+    guint64 base;               /* the clock when JPoll is created */
+    gint peers[8];              /* the other ends of registered JSockets */
+    guint32 count;
+} TestPoll;
+
+static void test_poll_init(TestPoll * tp)
+{
+    tp->base = (guint64) time(NULL);
+    tp->count = 0;
+    j_socket_set_clock(tp->base);
+    tp->jp = j_poll_new();
+    g_assert_nonnull(tp->jp);
+}
+
+static JSocket *test_poll_add(TestPoll * tp, gboolean persistent)
+{
+    gint fds[2];
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    JSocket *jsock = j_socket_new_fromfd(fds[0], NULL, 0);
+    g_assert_nonnull(jsock);
+    j_socket_set_persistent(jsock, persistent);
+    g_assert_cmpint(j_poll_register_stream(tp->jp, jsock, J_POLL_EVENT_IN),
+                    ==, 1);
+    tp->peers[tp->count++] = fds[1];
+    return jsock;
+}
+
+static void test_poll_clear(TestPoll * tp)
+{
+    guint32 i;
+    j_poll_close_all(tp->jp);
+    for (i = 0; i < tp->count; i++) {
+        close(tp->peers[i]);
+    }
+    j_socket_set_clock(0);
+}
+
+static void test_count(gpointer jsock, gpointer called)
+{
+    (*(guint32 *) called)++;
+}
+
+/* advances the clock to base+sec and expires */
+static guint32 test_poll_expire(TestPoll * tp, guint64 sec, guint32 * called)
+{
+    j_socket_set_clock(tp->base + sec);
+    return j_poll_remove_timeout(tp->jp, TEST_KEEPALIVE, test_count,
+                                 called);
+}
+
+
+/* idle JSockets go away exactly KeepAlive+1 seconds after their last action */
+static void test_expire(void)
+{
+    TestPoll tp;
+    guint32 called = 0;
+    test_poll_init(&tp);
+    test_poll_add(&tp, FALSE);
+    test_poll_add(&tp, FALSE);
+
+    g_assert_cmpuint(test_poll_expire(&tp, TEST_KEEPALIVE, &called),
+                     ==, 0);
+    g_assert_cmpint(j_poll_count(tp.jp), ==, 2);
+    g_assert_cmpuint(test_poll_expire
+                     (&tp, TEST_KEEPALIVE + 1, &called), ==, 2);
+    g_assert_cmpuint(called, ==, 2);
+    g_assert_cmpint(j_poll_count(tp.jp), ==, 0);
+    test_poll_clear(&tp);
+}
+
+/* an action moves the JSocket forward without touching the wheel */
+static void test_refresh(void)
+{
+    TestPoll tp;
+    guint32 called = 0;
+    test_poll_init(&tp);
+    JSocket *active = test_poll_add(&tp, FALSE);
+    test_poll_add(&tp, FALSE);
+
+    j_socket_set_clock(tp.base + 5);
+    j_socket_received(active, "x", 1);
+    g_assert_cmpuint(j_socket_active_time(active), ==, tp.base + 5);
+
+    g_assert_cmpuint(test_poll_expire
+                     (&tp, TEST_KEEPALIVE + 1, &called), ==, 1);
+    g_assert_cmpint(j_poll_count(tp.jp), ==, 1);
+    g_assert_true(j_poll_all(tp.jp)->data == active);
+    g_assert_cmpuint(test_poll_expire
+                     (&tp, TEST_KEEPALIVE + 5, &called), ==, 0);
+    g_assert_cmpuint(test_poll_expire
+                     (&tp, TEST_KEEPALIVE + 6, &called), ==, 1);
+    g_assert_cmpint(j_poll_count(tp.jp), ==, 0);
+    test_poll_clear(&tp);
+}
+
+/* refreshed more than a lap of the wheel later */
+static void test_lap(void)
+{
+    TestPoll tp;
+    guint32 called = 0;
+    test_poll_init(&tp);
+    JSocket *jsock = test_poll_add(&tp, FALSE);
+
+    j_socket_set_clock(tp.base + 70);
+    j_socket_received(jsock, "x", 1);
+
+    g_assert_cmpuint(test_poll_expire
+                     (&tp, TEST_KEEPALIVE + 1, &called), ==, 0);
+    g_assert_cmpuint(test_poll_expire
+                     (&tp, 70 + TEST_KEEPALIVE, &called), ==, 0);
+    g_assert_cmpint(j_poll_count(tp.jp), ==, 1);
+    g_assert_cmpuint(test_poll_expire
+                     (&tp, 70 + TEST_KEEPALIVE + 1, &called), ==, 1);
+    g_assert_cmpuint(called, ==, 1);
+    test_poll_clear(&tp);
+}
+
+/* the clock jumps over many laps at once, every slot is still visited */
+static void test_jump(void)
+{
+    TestPoll tp;
+    guint32 called = 0;
+    guint32 i;
+    test_poll_init(&tp);
+    for (i = 0; i < 4; i++) {
+        JSocket *jsock = test_poll_add(&tp, FALSE);
+        j_socket_set_clock(tp.base + i * 20);
+        j_socket_received(jsock, "x", 1);
+    }
+    g_assert_cmpuint(test_poll_expire(&tp, 1000, &called), ==, 4);
+    g_assert_cmpint(j_poll_count(tp.jp), ==, 0);
+    test_poll_clear(&tp);
+}
+
+static void test_persistent(void)
+{
+    TestPoll tp;
+    guint32 called = 0;
+    test_poll_init(&tp);
+    test_poll_add(&tp, TRUE);
+    test_poll_add(&tp, FALSE);
+
+    g_assert_cmpuint(test_poll_expire(&tp, 1000, &called), ==, 1);
+    g_assert_cmpint(j_poll_count(tp.jp), ==, 1);
+    g_assert_cmpint(j_poll_next_timeout(tp.jp, TEST_KEEPALIVE), ==, -1);
+    test_poll_clear(&tp);
+}
+
+/* the wait timeout reaches the first slot that can expire */
+static void test_next_timeout(void)
+{
+    TestPoll tp;
+    test_poll_init(&tp);
+    g_assert_cmpint(j_poll_next_timeout(tp.jp, TEST_KEEPALIVE), ==, -1);
+
+    test_poll_add(&tp, FALSE);
+    gint ms = j_poll_next_timeout(tp.jp, TEST_KEEPALIVE);
+    g_assert_cmpint(ms, >, (TEST_KEEPALIVE - 1) * 1000);
+    g_assert_cmpint(ms, <=, (TEST_KEEPALIVE + 1) * 1000);
+    test_poll_clear(&tp);
+}
+
+static void test_release(gpointer released)
+{
+    (*(guint32 *) released)++;
+}
+
+/*
+ * A JSocket closed while the peer doesn't read lingers,
+ * the data queued is released only after the peer reads it all
+ */
+static void test_linger(void)
+{
+    JSocket *listen_sock = j_server_socket_new(0, 8);
+    g_assert_nonnull(listen_sock);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    g_assert_cmpint(getsockname(j_socket_fd(listen_sock),
+                                (struct sockaddr *) &addr, &addrlen), ==, 0);
+    JSocket *client = j_client_socket_new("127.0.0.1",
+                                          ntohs(addr.sin_port));
+    g_assert_nonnull(client);
+    JSocket *jsock = j_socket_accept(listen_sock);
+    g_assert_nonnull(jsock);
+    if (!j_socket_set_zerocopy(jsock, 1)) {
+        g_test_skip("MSG_ZEROCOPY is not supported");
+        j_socket_close(jsock);
+        j_socket_close(client);
+        j_socket_close(listen_sock);
+        return;
+    }
+
+    JPoll *jp = j_poll_new();
+    g_assert_cmpint(j_poll_register_stream(jp, jsock, J_POLL_EVENT_IN), ==,
+                    1);
+    gchar *data = (gchar *) g_malloc0(TEST_SEGMENT_SIZE);
+    guint32 released = 0;
+    gint i;
+    for (i = 0; i < TEST_SEGMENTS; i++) {
+        j_socket_queue(jsock, data, TEST_SEGMENT_SIZE, test_release,
+                       &released);
+    }
+    g_assert_cmpint(j_poll_flush(jp, jsock), ==, 0);
+    g_assert_cmpuint(j_socket_zerocopy_pending(jsock), >, 0);
+    j_poll_delete_close(jp, jsock);
+    g_assert_cmpuint(j_poll_lingering(jp), ==, 1);
+    g_assert_cmpuint(released, <, TEST_SEGMENTS);
+
+    /* shut down after the data sent */
+    gchar buf[TEST_SEGMENT_SIZE];
+    while (read(j_socket_fd(client), buf, sizeof(buf)) > 0) {
+    }
+    JPollEvent events[8];
+    for (i = 0; i < 500 && j_poll_lingering(jp) > 0; i++) {
+        j_poll_wait(jp, events, G_N_ELEMENTS(events), 10);
+    }
+    g_assert_cmpuint(j_poll_lingering(jp), ==, 0);
+    g_assert_cmpuint(released, ==, TEST_SEGMENTS);
+
+    j_poll_close(jp);
+    g_free(data);
+    j_socket_close(client);
+    j_socket_close(listen_sock);
+}
+
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/jpoll/timeout/expire", test_expire);
+    g_test_add_func("/jpoll/timeout/refresh", test_refresh);
+    g_test_add_func("/jpoll/timeout/lap", test_lap);
+    g_test_add_func("/jpoll/timeout/jump", test_jump);
+    g_test_add_func("/jpoll/timeout/persistent", test_persistent);
+    g_test_add_func("/jpoll/timeout/next", test_next_timeout);
+    g_test_add_func("/jpoll/linger/zerocopy", test_linger);
+
+    return g_test_run();
+}
@@ -0,0 +1,159 @@
+/*
+ * test-jpool.c
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The slab pool, the count of mappings of current thread tells
+ * whether a block is reused or mapped
+ */
+
+#include "jpool.h"
+#include <glib.h>
+#include <string.h>
+
+
+#define BLOCKS  1000
+
+
+static void test_classes(void)
+{
+    static const gsize sizes[] = { 1, 64, 65, 1000, 4096, 128 * 1024 };
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        gchar *mem = (gchar *) j_pool_alloc(sizes[i]);
+        gsize size = j_pool_block_size(mem);
+        g_assert_cmpuint(size, >=, sizes[i]);
+        g_assert_cmpuint(size, <, MAX(sizes[i] * 2, 128));
+        g_assert_cmpuint((gsize) mem % 64, ==, 0);      /* cache line aligned */
+        memset(mem, 'x', sizes[i]);
+        j_pool_free(mem);
+    }
+    gchar *zero = (gchar *) j_pool_alloc0(300);
+    for (i = 0; i < 300; i++) {
+        g_assert_cmpint(zero[i], ==, 0);
+    }
+    j_pool_free(zero);
+    j_pool_free(NULL);
+}
+
+static void test_realloc(void)
+{
+    gchar *mem = (gchar *) j_pool_realloc(NULL, 100);
+    memset(mem, 'a', 100);
+    g_assert_true(j_pool_realloc(mem, 64) == mem);  /* large enough */
+    mem = (gchar *) j_pool_realloc(mem, 300 * 1024);
+    g_assert_cmpuint(j_pool_block_size(mem), >=, 300 * 1024);
+    guint i;
+    for (i = 0; i < 100; i++) {
+        g_assert_cmpint(mem[i], ==, 'a');
+    }
+    j_pool_free(mem);
+}
+
+/* a freed block is given to the next allocation of its class */
+static void test_reuse(void)
+{
+    gpointer blocks[BLOCKS];
+    guint i;
+    for (i = 0; i < BLOCKS; i++) {
+        blocks[i] = j_pool_alloc(512);
+    }
+    for (i = 0; i < BLOCKS; i++) {
+        j_pool_free(blocks[i]);
+    }
+    guint64 maps = j_pool_get_map_count();
+    for (i = 0; i < BLOCKS; i++) {
+        blocks[i] = j_pool_alloc(512);
+    }
+    g_assert_cmpuint(j_pool_get_map_count(), ==, maps);
+    for (i = 0; i < BLOCKS; i++) {
+        j_pool_free(blocks[i]);
+    }
+}
+
+/* a buffer growing past the biggest class is mapped only once */
+static void test_large(void)
+{
+    gpointer mem = j_pool_alloc(300 * 1024);
+    j_pool_free(mem);
+    guint64 maps = j_pool_get_map_count();
+    guint i;
+    for (i = 0; i < 100; i++) {
+        gpointer again = j_pool_alloc(200 * 1024 + i);
+        g_assert_true(again == mem);
+        gpointer larger = j_pool_alloc(3 * 1024 * 1024);
+        j_pool_free(again);
+        j_pool_free(larger);
+    }
+    /* only the first mapping of 3M */
+    g_assert_cmpuint(j_pool_get_map_count(), ==, maps + 1);
+
+    /* too large to keep */
+    gpointer huge = j_pool_alloc(16 * 1024 * 1024);
+    j_pool_free(huge);
+    huge = j_pool_alloc(16 * 1024 * 1024);
+    j_pool_free(huge);
+    g_assert_cmpuint(j_pool_get_map_count(), ==, maps + 3);
+}
+
+
+/* the class used by the threads, no other test touches it */
+#define THREAD_BLOCK_SIZE   (16 * 1024)
+
+static gpointer test_thread(gpointer data)
+{
+    gpointer *blocks = (gpointer *) data;
+    guint i;
+    for (i = 0; i < BLOCKS; i++) {
+        blocks[i] = j_pool_alloc(THREAD_BLOCK_SIZE);
+    }
+    for (i = 0; i < BLOCKS; i++) {
+        j_pool_free(blocks[i]);
+    }
+    return NULL;
+}
+
+/* what an exited thread cached, and the rest of its slab, go to the others */
+static void test_thread_exit(void)
+{
+    gpointer blocks[BLOCKS];
+    g_thread_join(g_thread_new("pool", test_thread, blocks));
+
+    guint64 maps = j_pool_get_map_count();
+    guint i;
+    for (i = 0; i < BLOCKS; i++) {
+        blocks[i] = j_pool_alloc(THREAD_BLOCK_SIZE);
+    }
+    g_assert_cmpuint(j_pool_get_map_count(), ==, maps);
+    for (i = 0; i < BLOCKS; i++) {
+        j_pool_free(blocks[i]);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/jpool/classes", test_classes);
+    g_test_add_func("/jpool/realloc", test_realloc);
+    g_test_add_func("/jpool/reuse", test_reuse);
+    g_test_add_func("/jpool/large", test_large);
+    g_test_add_func("/jpool/thread-exit", test_thread_exit);
+
+    return g_test_run();
+}
@@ -0,0 +1,280 @@
+/*
+ * test-jsocket.c
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Parsing pipelined packages out of the read buffer,
+ * when they arrive split at every possible place,
+ * and steering connections in a SO_REUSEPORT group by CPU
+ */
+
+#include "jsocket.h"
+#include "pack.h"
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+
+#define PACKAGES    200
+
+/* every 7th package is larger than the initial read buffer */
+#define test_package_length(i)  ((i)%7==0?100000:((i)*37)%500+1)
+#define test_package_byte(i,j)  ((gchar)((i)+(j)))
+
+/* the chunks the stream is split into, in turn */
+static const guint32 chunks[] = { 1, 2, 3, 5, 4093, 17, 65536, 8191, 70001 };
+
+/* the length header of a package */
+static void test_head(guint32 len, gchar * head)
+{
+    gchar *packed = pack_length4(len);
+    memcpy(head, packed, 4);
+    g_free(packed);
+}
+
+/* all the packages in one stream, like a client pipelining them */
+static GString *test_stream(void)
+{
+    GString *stream = g_string_new(NULL);
+    guint32 i, j;
+    for (i = 0; i < PACKAGES; i++) {
+        guint32 len = test_package_length(i);
+        gchar head[4];
+        test_head(len, head);
+        g_string_append_len(stream, head, 4);
+        for (j = 0; j < len; j++) {
+            g_string_append_c(stream, test_package_byte(i, j));
+        }
+    }
+    return stream;
+}
+
+/*
+ * Parses all the whole packages in the read buffer,
+ * checking them against the stream
+ */
+static void test_parse(JSocket * jsock, guint32 * parsed)
+{
+    gint ret;
+    while ((ret = j_socket_next_package(jsock)) == 1) {
+        guint32 i = *parsed, j;
+        const gchar *data = (const gchar *) j_socket_data(jsock);
+        g_assert_cmpuint(i, <, PACKAGES);
+        g_assert_cmpuint(j_socket_data_length(jsock), ==,
+                         test_package_length(i));
+        /* not copied, the package is in the read buffer */
+        g_assert_true(data >= jsock->rbuf
+                      && data + j_socket_data_length(jsock) <=
+                      jsock->rbuf + jsock->rsize);
+        for (j = 0; j < j_socket_data_length(jsock); j++) {
+            if (data[j] != test_package_byte(i, j)) {
+                g_assert_cmpint(data[j], ==, test_package_byte(i, j));
+            }
+        }
+        (*parsed)++;
+    }
+    g_assert_cmpint(ret, ==, 0);
+}
+
+/* the data is handed over by somebody else, as the io_uring backend does */
+static void test_received(void)
+{
+    GString *stream = test_stream();
+    JSocket *jsock = j_socket_new_fromfd(-1, NULL, 0);
+    guint32 parsed = 0, offset = 0, c = 0;
+    while (offset < stream->len) {
+        guint32 len = chunks[c++ % G_N_ELEMENTS(chunks)];
+        len = MIN(len, stream->len - offset);
+        j_socket_received(jsock, stream->str + offset, len);
+        offset += len;
+        test_parse(jsock, &parsed);
+    }
+    g_assert_cmpuint(parsed, ==, PACKAGES);
+    /* all parsed, the read buffer is released */
+    g_assert_cmpuint(j_socket_unparsed_length(jsock), ==, 0);
+    g_assert_null(jsock->rbuf);
+    j_socket_close(jsock);
+    g_string_free(stream, TRUE);
+}
+
+/* the data is read from a socket, the writer stops at every chunk */
+static void test_recv(void)
+{
+    GString *stream = test_stream();
+    gint fds[2];
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    JSocket *jsock = j_socket_new_fromfd(fds[0], NULL, 0);
+    guint32 parsed = 0, offset = 0, c = 0;
+    while (offset < stream->len) {
+        guint32 len = chunks[c++ % G_N_ELEMENTS(chunks)];
+        len = MIN(len, stream->len - offset);
+        g_assert_cmpint(write(fds[1], stream->str + offset, len), ==, len);
+        offset += len;
+        gint n;
+        while ((n = j_socket_recv(jsock)) > 0) {
+            test_parse(jsock, &parsed);
+        }
+        g_assert_cmpint(n, ==, 0);
+    }
+    g_assert_cmpuint(parsed, ==, PACKAGES);
+
+    close(fds[1]);
+    g_assert_cmpint(j_socket_recv(jsock), <, 0);
+    j_socket_close(jsock);
+    g_string_free(stream, TRUE);
+}
+
+/* a package of length 0 is invalid, the packages before it are fine */
+static void test_invalid(void)
+{
+    JSocket *jsock = j_socket_new_fromfd(-1, NULL, 0);
+    gchar data[4 + 3 + 4];
+    test_head(3, data);
+    memcpy(data + 4, "abc", 3);
+    test_head(0, data + 7);
+    j_socket_received(jsock, data, sizeof(data));
+    g_assert_cmpint(j_socket_next_package(jsock), ==, 1);
+    g_assert_cmpmem(j_socket_data(jsock), j_socket_data_length(jsock),
+                    "abc", 3);
+    g_assert_cmpint(j_socket_next_package(jsock), ==, -1);
+    j_socket_close(jsock);
+}
+/* a package longer than the max package is invalid, even if not received */
+static void test_max_package(void)
+{
+    JSocket *jsock = j_socket_new_fromfd(-1, NULL, 0);
+    gchar data[4 + 100 + 4];
+    test_head(100, data);
+    memset(data + 4, 'x', 100);
+    test_head(101, data + 104);
+    j_socket_set_max_package(100);
+    g_assert_true(j_socket_received(jsock, data, sizeof(data)));
+    g_assert_cmpint(j_socket_next_package(jsock), ==, 1);
+    g_assert_cmpuint(j_socket_data_length(jsock), ==, 100);
+    g_assert_cmpint(j_socket_next_package(jsock), ==, -1);
+    j_socket_set_max_package(0);
+    j_socket_close(jsock);
+}
+
+/* counts the connections pending on a non-blocking passive socket */
+static guint test_accept_all(JSocket * jsock)
+{
+    guint count = 0;
+    JSocket *conn;
+    while ((conn = j_socket_accept_nonblock(jsock)) != NULL) {
+        j_socket_close(conn);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Connections received on the CPU of the second socket go to it,
+ * though it's the second one. The loopback receives on the CPU connecting
+ */
+static void test_steer(void)
+{
+    gint cpu = sched_getcpu();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    g_assert_cmpint(sched_setaffinity(0, sizeof(set), &set), ==, 0);
+
+    JSocket *first = j_server_socket_new_reuseport(0, 64);
+    g_assert_nonnull(first);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    g_assert_cmpint(getsockname(j_socket_fd(first),
+                                (struct sockaddr *) &addr, &addrlen), ==, 0);
+    gushort port = ntohs(addr.sin_port);
+    JSocket *second = j_server_socket_new_reuseport(port, 64);
+    g_assert_nonnull(second);
+    gint cpus[] = { -1, cpu };
+    g_assert_cmpint(j_socket_reuseport_steer_cpu(first, cpus, 2), ==, 1);
+
+    gint i;
+    for (i = 0; i < 16; i++) {
+        JSocket *client = j_client_socket_new("127.0.0.1", port);
+        g_assert_nonnull(client);
+        j_socket_close(client);
+    }
+    g_assert_cmpuint(test_accept_all(first), ==, 0);
+    g_assert_cmpuint(test_accept_all(second), ==, 16);
+    j_socket_close(first);
+    j_socket_close(second);
+}
+
+/*
+ * Closing a socket of the group moves the last one into its place,
+ * so the program attached again indexes the group as it is now
+ */
+static void test_steer_closed(void)
+{
+    gint cpu = sched_getcpu();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    g_assert_cmpint(sched_setaffinity(0, sizeof(set), &set), ==, 0);
+
+    JSocket *group[4];
+    group[0] = j_server_socket_new_reuseport(0, 64);
+    g_assert_nonnull(group[0]);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    g_assert_cmpint(getsockname(j_socket_fd(group[0]),
+                                (struct sockaddr *) &addr, &addrlen), ==, 0);
+    gushort port = ntohs(addr.sin_port);
+    gint i;
+    for (i = 1; i < 4; i++) {
+        group[i] = j_server_socket_new_reuseport(port, 64);
+        g_assert_nonnull(group[i]);
+    }
+    /* the group is { 0, 3, 2 } now */
+    j_socket_close(group[1]);
+    gint cpus[] = { -1, cpu, -1 };
+    g_assert_cmpint(j_socket_reuseport_steer_cpu(group[0], cpus, 3), ==, 1);
+
+    for (i = 0; i < 16; i++) {
+        JSocket *client = j_client_socket_new("127.0.0.1", port);
+        g_assert_nonnull(client);
+        j_socket_close(client);
+    }
+    g_assert_cmpuint(test_accept_all(group[0]), ==, 0);
+    g_assert_cmpuint(test_accept_all(group[2]), ==, 0);
+    g_assert_cmpuint(test_accept_all(group[3]), ==, 16);
+    j_socket_close(group[0]);
+    j_socket_close(group[2]);
+    j_socket_close(group[3]);
+}
+
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/jsocket/pipelined/received", test_received);
+    g_test_add_func("/jsocket/pipelined/recv", test_recv);
+    g_test_add_func("/jsocket/pipelined/invalid", test_invalid);
+    g_test_add_func("/jsocket/pipelined/max-package", test_max_package);
+    g_test_add_func("/jsocket/reuseport/steer", test_steer);
+    g_test_add_func("/jsocket/reuseport/steer-closed", test_steer_closed);
+
+    return g_test_run();
+}
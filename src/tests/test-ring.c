@@ -0,0 +1,128 @@
+/*
+ * test-ring.c
+ *
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ring.h"
+
+
+#define PRODUCERS   4
+#define PUSHES      200000
+
+/* the data pushed by a producer, never NULL */
+#define test_data(producer,i)   GUINT_TO_POINTER(((producer) << 24) | ((i) + 1))
+#define test_data_producer(data)    (GPOINTER_TO_UINT(data) >> 24)
+#define test_data_index(data)   ((GPOINTER_TO_UINT(data) & 0xFFFFFF) - 1)
+
+
+static void test_fifo(void)
+{
+    JaRing *ring = ja_ring_new(5);      /* rounded up to 8 */
+    guint i, lap;
+    g_assert_true(ja_ring_is_empty(ring));
+    g_assert_null(ja_ring_pop(ring));
+
+    /* a few laps, so that the positions wrap around the cells */
+    for (lap = 0; lap < 4; lap++) {
+        for (i = 0; i < 8; i++) {
+            g_assert_true(ja_ring_push(ring, test_data(lap, i)));
+        }
+        g_assert_false(ja_ring_push(ring, test_data(lap, 8)));
+        g_assert_false(ja_ring_is_empty(ring));
+        for (i = 0; i < 8; i++) {
+            g_assert_true(ja_ring_pop(ring) == test_data(lap, i));
+        }
+        g_assert_true(ja_ring_is_empty(ring));
+        g_assert_null(ja_ring_pop(ring));
+    }
+
+    /* interleaved, the ring is never full */
+    for (i = 0; i < 100; i++) {
+        g_assert_true(ja_ring_push(ring, test_data(0, i)));
+        g_assert_true(ja_ring_push(ring, test_data(1, i)));
+        g_assert_true(ja_ring_pop(ring) == test_data(0, i));
+        g_assert_true(ja_ring_pop(ring) == test_data(1, i));
+    }
+    ja_ring_free(ring);
+}
+
+
+typedef struct {
+    JaRing *ring;
+    guint producer;
+} TestProducer;
+
+static gpointer test_produce(gpointer data)
+{
+    TestProducer *p = (TestProducer *) data;
+    guint i;
+    for (i = 0; i < PUSHES; i++) {
+        while (!ja_ring_push(p->ring, test_data(p->producer, i))) {
+            g_thread_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Several producers against one consumer,
+ * nothing is lost or duplicated and every producer's order is kept
+ */
+static void test_mpsc(void)
+{
+    JaRing *ring = ja_ring_new(64);
+    TestProducer producers[PRODUCERS];
+    GThread *threads[PRODUCERS];
+    guint next[PRODUCERS];
+    guint i;
+    for (i = 0; i < PRODUCERS; i++) {
+        producers[i].ring = ring;
+        producers[i].producer = i;
+        next[i] = 0;
+        threads[i] = g_thread_new("producer", test_produce, &producers[i]);
+    }
+
+    guint total = 0;
+    while (total < PRODUCERS * PUSHES) {
+        gpointer data = ja_ring_pop(ring);
+        if (data == NULL) {
+            g_thread_yield();
+            continue;
+        }
+        guint producer = test_data_producer(data);
+        g_assert_cmpuint(producer, <, PRODUCERS);
+        g_assert_cmpuint(test_data_index(data), ==, next[producer]);
+        next[producer]++;
+        total++;
+    }
+    for (i = 0; i < PRODUCERS; i++) {
+        g_thread_join(threads[i]);
+        g_assert_cmpuint(next[i], ==, PUSHES);
+    }
+    g_assert_true(ja_ring_is_empty(ring));
+    ja_ring_free(ring);
+}
+
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/ring/fifo", test_fifo);
+    g_test_add_func("/ring/mpsc", test_mpsc);
+
+    return g_test_run();
+}
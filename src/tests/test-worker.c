@@ -0,0 +1,567 @@
+/*
+ * test-worker.c
+ * Copyright (C) 2015 Wiky L <wiiiky@outlook.com>
+ *
+ * Jacques is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jacques is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The worker over a real socket, every test runs once with each IoBackend
+ */
+
+#include "worker.h"
+#include "jac.h"
+#include "jconf.h"
+#include "pack.h"
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+
+/* the extra bytes of a response to a 'b' request */
+#define BIG_LENGTH  (100 * 1024)
+
+/*
+ * The first byte of request says what to do,
+ * 'e' echoes, 'b' echoes followed by BIG_LENGTH bytes of the last byte,
+ * 'd' echoes and closes the connection,
+ * 's' echoes without copying, from the data of request,
+ * 'i' echoes and keeps the id of connection in test_conn_id
+ */
+static guint64 test_conn_id = 0;
+
+static JaAction test_hook(JaRequest * req)
+{
+    const gchar *data = ja_request_data(req);
+    guint len = ja_request_data_length(req);
+    if (data[0] == 'i') {
+        __atomic_store_n(&test_conn_id, ja_request_connection_id(req),
+                         __ATOMIC_RELEASE);
+    }
+    if (data[0] == 's') {
+        ja_response_append_static(req, data, len);
+        return JA_ACTION_RESPONSE | JA_ACTION_KEEP;
+    }
+    ja_response_append(req, data, len);
+    if (data[0] == 'b') {
+        gchar *big = (gchar *) g_malloc(BIG_LENGTH);
+        memset(big, data[len - 1], BIG_LENGTH);
+        ja_response_append_take(req, big, BIG_LENGTH, g_free);
+    } else if (data[0] == 'd') {
+        return JA_ACTION_RESPONSE | JA_ACTION_DROP;
+    }
+    return JA_ACTION_RESPONSE | JA_ACTION_KEEP;
+}
+
+static JaConfig *test_config(const gchar * backend)
+{
+    gchar path[] = "/tmp/jacques-test-XXXXXX";
+    gint fd = mkstemp(path);
+    g_assert_cmpint(fd, >=, 0);
+    gchar *text = g_strdup_printf("IoBackend %s\nKeepAlive 60\n", backend);
+    g_assert_cmpint(write(fd, text, strlen(text)), ==, strlen(text));
+    close(fd);
+    g_free(text);
+    JaConfig *cfg = j_parse(path, NULL);
+    unlink(path);
+    g_assert_nonnull(cfg);
+    return cfg;
+}
+
+static void test_write(gint fd, const gchar * data, gsize len)
+{
+    while (len > 0) {
+        gssize n = write(fd, data, len);
+        g_assert_cmpint(n, >, 0);
+        data += n;
+        len -= n;
+    }
+}
+
+static gboolean test_read(gint fd, gchar * data, gsize len)
+{
+    while (len > 0) {
+        gssize n = read(fd, data, len);
+        if (n <= 0) {
+            return FALSE;
+        }
+        data += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static void test_request(gint fd, const gchar * data)
+{
+    gchar *head = pack_length4(strlen(data));
+    test_write(fd, head, 4);
+    test_write(fd, data, strlen(data));
+    g_free(head);
+}
+
+/*
+ * Reads a response, returns NULL if the connection is closed
+ */
+static gchar *test_response(gint fd, guint32 * len)
+{
+    gchar head[4];
+    if (!test_read(fd, head, sizeof(head))) {
+        return NULL;
+    }
+    *len = unpack_length4(head);
+    gchar *data = (gchar *) g_malloc(*len + 1);
+    g_assert_true(test_read(fd, data, *len));
+    data[*len] = '\0';
+    return data;
+}
+
+static void test_expect(gint fd, const gchar * expected)
+{
+    guint32 len;
+    gchar *data = test_response(fd, &len);
+    g_assert_nonnull(data);
+    g_assert_cmpstr(data, ==, expected);
+    g_free(data);
+}
+
+/* checks if a response arrives in 10 milliseconds */
+static gboolean test_readable(gint fd)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, 10) > 0;
+}
+
+static gint test_connect(JaWorker * jw)
+{
+    gint sv[2];
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    ja_worker_add(jw, j_socket_new_fromfd(sv[0], NULL, 0));
+    return sv[1];
+}
+
+/* creates a listening socket for a worker, on a free port */
+static JSocket *test_listen(gushort * port)
+{
+    JSocket *listen_sock = j_server_socket_new_reuseport(0, 64);
+    g_assert_nonnull(listen_sock);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    g_assert_cmpint(getsockname(j_socket_fd(listen_sock),
+                                (struct sockaddr *) &addr, &addrlen), ==, 0);
+    *port = ntohs(addr.sin_port);
+    return listen_sock;
+}
+
+/* connects to the port, returns the descriptor */
+static gint test_dial(gushort port)
+{
+    JSocket *client = j_client_socket_new("127.0.0.1", port);
+    g_assert_nonnull(client);
+    gint fd = dup(j_socket_fd(client));
+    j_socket_close(client);
+    return fd;
+}
+
+/* waits until the payload of worker drops to count */
+static void test_wait_payload(JaWorker * jw, guint32 count)
+{
+    gint i;
+    for (i = 0; i < 5000 && ja_worker_payload(jw) > count; i++) {
+        g_usleep(1000);
+    }
+    g_assert_cmpuint(ja_worker_payload(jw), ==, count);
+}
+
+/*
+ * Retires and frees the worker, its connections must be closed by peers
+ * before, idle is the payload of the worker without connections
+ */
+static void test_worker_free(JaWorker * jw, guint32 idle)
+{
+    test_wait_payload(jw, idle);
+    ja_worker_retire(jw, NULL, 0);
+    while (!ja_worker_is_retired(jw)) {
+        g_usleep(1000);
+    }
+    ja_worker_free(jw);
+}
+
+
+/*
+ * Pipelined requests arrive in one read, a request is split in many reads,
+ * the responses are in order
+ */
+static void test_echo(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, NULL);
+    g_assert_nonnull(jw);
+    guint32 idle = ja_worker_payload(jw);
+    gint fd = test_connect(jw);
+
+    GString *batch = g_string_new(NULL);
+    gint i;
+    for (i = 0; i < 100; i++) {
+        gchar data[8];
+        g_snprintf(data, sizeof(data), "e%03d", i);
+        gchar *head = pack_length4(strlen(data));
+        g_string_append_len(batch, head, 4);
+        g_string_append(batch, data);
+        g_free(head);
+    }
+    test_write(fd, batch->str, batch->len);
+    g_string_free(batch, TRUE);
+    for (i = 0; i < 100; i++) {
+        gchar data[8];
+        g_snprintf(data, sizeof(data), "e%03d", i);
+        test_expect(fd, data);
+    }
+
+    const gchar split[] = "\x0b\0\0\0e-partially";
+    for (i = 0; i < sizeof(split) - 1; i++) {
+        test_write(fd, split + i, 1);
+        g_usleep(1000);
+    }
+    test_expect(fd, "e-partially");
+
+    close(fd);
+    test_worker_free(jw, idle);
+    j_parser_free(cfg);
+}
+
+/*
+ * The responses pointing into the read buffer are sent after it's reused
+ */
+static void test_echo_static(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, NULL);
+    g_assert_nonnull(jw);
+    guint32 idle = ja_worker_payload(jw);
+    gint fd = test_connect(jw);
+
+    gint round, i;
+    for (round = 0; round < 10; round++) {
+        GString *batch = g_string_new(NULL);
+        for (i = 0; i < 100; i++) {
+            gchar data[16];
+            gchar head[4];
+            g_snprintf(data, sizeof(data), "s%03d-%03d", round, i);
+            pack_length4_into(strlen(data), head);
+            g_string_append_len(batch, head, sizeof(head));
+            g_string_append(batch, data);
+        }
+        test_write(fd, batch->str, batch->len);
+        g_string_free(batch, TRUE);
+    }
+    for (round = 0; round < 10; round++) {
+        for (i = 0; i < 100; i++) {
+            gchar data[16];
+            g_snprintf(data, sizeof(data), "s%03d-%03d", round, i);
+            test_expect(fd, data);
+        }
+    }
+
+    close(fd);
+    test_worker_free(jw, idle);
+    j_parser_free(cfg);
+}
+
+/*
+ * Responses queued beyond the high water mark pause reading, all of them
+ * arrive in order when the client reads at last
+ */
+static void test_backpressure(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, NULL);
+    guint32 idle = ja_worker_payload(jw);
+    gint fd = test_connect(jw);
+
+    gint i;
+    for (i = 0; i < 40; i++) {
+        gchar data[8];
+        g_snprintf(data, sizeof(data), "b%c", 'a' + i % 26);
+        test_request(fd, data);
+    }
+    g_usleep(100000);
+    for (i = 0; i < 40; i++) {
+        guint32 len;
+        gchar *data = test_response(fd, &len);
+        g_assert_nonnull(data);
+        g_assert_cmpuint(len, ==, 2 + BIG_LENGTH);
+        g_assert_cmpint(data[1], ==, 'a' + i % 26);
+        g_assert_cmpint(data[len - 1], ==, 'a' + i % 26);
+        g_free(data);
+    }
+
+    close(fd);
+    test_worker_free(jw, idle);
+    j_parser_free(cfg);
+}
+
+/*
+ * Pushes to a client that doesn't read are refused at the high water mark,
+ * and accepted again after it reads
+ */
+static void test_push_overload(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, NULL);
+    guint32 idle = ja_worker_payload(jw);
+    gint fd = test_connect(jw);
+    test_request(fd, "i");
+    test_expect(fd, "i");
+    guint64 id = __atomic_load_n(&test_conn_id, __ATOMIC_ACQUIRE);
+
+    gchar *frame = (gchar *) g_malloc(BIG_LENGTH);
+    memset(frame, 'p', BIG_LENGTH);
+    gint i;
+    for (i = 0; i < 1000 && ja_push(id, frame, BIG_LENGTH); i++) {
+        g_usleep(1000);
+    }
+    g_assert_cmpint(i, <, 1000);
+    g_free(frame);
+
+    guint32 len;
+    gchar *data;
+    for (i = 0; !ja_push(id, "x", 1); i++) {
+        g_assert_cmpint(i, <, 5000);
+        if (!test_readable(fd)) {
+            continue;
+        }
+        data = test_response(fd, &len);
+        g_assert_nonnull(data);
+        g_assert_cmpuint(len, ==, BIG_LENGTH);
+        g_free(data);
+    }
+    /* the frames taken before it's refused, then the last one */
+    while ((data = test_response(fd, &len)) != NULL && len == BIG_LENGTH) {
+        g_free(data);
+    }
+    g_assert_nonnull(data);
+    g_assert_cmpstr(data, ==, "x");
+    g_free(data);
+
+    close(fd);
+    test_worker_free(jw, idle);
+    j_parser_free(cfg);
+}
+
+/*
+ * A new connection takes pushes, though the last one closed was paused.
+ * The worker accepts both, so the second gets the memory of the first
+ */
+static void test_push_reused(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    gushort port;
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, test_listen(&port));
+    guint32 idle = ja_worker_payload(jw);
+    gint fd = test_dial(port);
+    test_request(fd, "i");
+    test_expect(fd, "i");
+    guint64 id = __atomic_load_n(&test_conn_id, __ATOMIC_ACQUIRE);
+
+    gchar *frame = (gchar *) g_malloc(BIG_LENGTH);
+    memset(frame, 'p', BIG_LENGTH);
+    gint i;
+    for (i = 0; i < 1000 && ja_push(id, frame, BIG_LENGTH); i++) {
+        g_usleep(1000);
+    }
+    g_assert_cmpint(i, <, 1000);
+    g_free(frame);
+    close(fd);
+    test_wait_payload(jw, idle);
+
+    fd = test_dial(port);
+    test_request(fd, "i");
+    test_expect(fd, "i");
+    id = __atomic_load_n(&test_conn_id, __ATOMIC_ACQUIRE);
+    g_assert_true(ja_push(id, "x", 1));
+    test_expect(fd, "x");
+
+    close(fd);
+    test_worker_free(jw, idle);
+    j_parser_free(cfg);
+}
+
+/*
+ * The connection is closed after the response of a dropping request
+ */
+static void test_drop(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, NULL);
+    guint32 idle = ja_worker_payload(jw);
+    gint fd = test_connect(jw);
+
+    test_request(fd, "e1");
+    test_request(fd, "d2");
+    test_expect(fd, "e1");
+    test_expect(fd, "d2");
+    guint32 len;
+    g_assert_null(test_response(fd, &len));
+    close(fd);
+    test_worker_free(jw, idle);
+    j_parser_free(cfg);
+}
+
+/*
+ * The worker accepts on its own listening socket
+ */
+static void test_accept(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    gushort port;
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, test_listen(&port));
+    guint32 idle = ja_worker_payload(jw);
+
+    gint fds[32];
+    gint i;
+    for (i = 0; i < G_N_ELEMENTS(fds); i++) {
+        fds[i] = test_dial(port);
+        test_request(fds[i], "e-accepted");
+    }
+    for (i = 0; i < G_N_ELEMENTS(fds); i++) {
+        test_expect(fds[i], "e-accepted");
+        close(fds[i]);
+    }
+    test_worker_free(jw, idle);     /* closes listen_sock too */
+    j_parser_free(cfg);
+}
+
+/*
+ * The connections of a retiring worker go on in its heir,
+ * with the requests in flight
+ */
+static void test_handoff(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, NULL);
+    JaWorker *heir = ja_worker_create(cfg, 1, -1, NULL);
+    guint32 idle = ja_worker_payload(heir);
+    gint fd = test_connect(jw);
+
+    test_request(fd, "e-before");
+    test_expect(fd, "e-before");
+    test_request(fd, "e-retiring");
+    ja_worker_retire(jw, &heir, 1);
+    while (!ja_worker_is_retired(jw)) {
+        g_usleep(1000);
+    }
+    ja_worker_free(jw);
+    test_expect(fd, "e-retiring");
+    test_request(fd, "e-after");
+    test_expect(fd, "e-after");
+
+    close(fd);
+    test_worker_free(heir, idle);
+    j_parser_free(cfg);
+}
+
+/*
+ * A retiring worker closes its listening socket, the connections coming
+ * before it's freed go to the other socket of the SO_REUSEPORT group,
+ * and those it accepted before go on in its heir
+ */
+static void test_retire_listen(gconstpointer backend)
+{
+    JaConfig *cfg = test_config((const gchar *) backend);
+    gushort port;
+    JaWorker *jw = ja_worker_create(cfg, 0, -1, test_listen(&port));
+    JSocket *listen_sock = j_server_socket_new_reuseport(port, 64);
+    g_assert_nonnull(listen_sock);
+    JaWorker *heir = ja_worker_create(cfg, 1, -1, listen_sock);
+    guint32 idle = ja_worker_payload(heir);
+
+    gint before[8];
+    gint i, j;
+    for (i = 0; i < G_N_ELEMENTS(before); i++) {
+        before[i] = test_dial(port);
+        test_request(before[i], "e-before");
+        test_expect(before[i], "e-before");
+    }
+    ja_worker_retire(jw, &heir, 1);
+    while (!ja_worker_is_retired(jw)) {
+        g_usleep(1000);
+    }
+
+    gint after[32];
+    for (i = 0; i < G_N_ELEMENTS(after); i++) {
+        after[i] = test_dial(port);
+        test_request(after[i], "e-after");
+    }
+    for (i = 0; i < G_N_ELEMENTS(after); i++) {
+        for (j = 0; j < 500 && !test_readable(after[i]); j++) {
+        }
+        g_assert_cmpint(j, <, 500);
+        test_expect(after[i], "e-after");
+        close(after[i]);
+    }
+    ja_worker_free(jw);
+    for (i = 0; i < G_N_ELEMENTS(before); i++) {
+        test_request(before[i], "e-handed");
+        test_expect(before[i], "e-handed");
+        close(before[i]);
+    }
+
+    test_worker_free(heir, idle);
+    j_parser_free(cfg);
+}
+
+
+static const gchar *backends[] = { "epoll", "uring" };
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    /* uring falls back to epoll with a warning on old kernels */
+    g_log_set_always_fatal(G_LOG_LEVEL_CRITICAL | G_LOG_FATAL_MASK);
+    ja_hook_register(test_hook, JA_HOOK_TYPE_REQUEST);
+
+    gint i;
+    for (i = 0; i < G_N_ELEMENTS(backends); i++) {
+        const gchar *backend = backends[i];
+        g_test_add_data_func(g_strdup_printf("/worker/%s/echo", backend),
+                             backend, test_echo);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/echo-static",
+                                             backend), backend,
+                             test_echo_static);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/backpressure",
+                                             backend), backend,
+                             test_backpressure);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/push-overload",
+                                             backend), backend,
+                             test_push_overload);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/push-reused",
+                                             backend), backend,
+                             test_push_reused);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/drop", backend),
+                             backend, test_drop);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/accept", backend),
+                             backend, test_accept);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/handoff",
+                                             backend), backend,
+                             test_handoff);
+        g_test_add_data_func(g_strdup_printf("/worker/%s/retire-listen",
+                                             backend), backend,
+                             test_retire_listen);
+    }
+    return g_test_run();
+}
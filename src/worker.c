@@ -20,153 +20,1433 @@
 
 #include "worker.h"
 #include "config.h"
+#include "ring.h"
+#include "affinity.h"
+#include "blocking.h"
+#include "coroutine.h"
+#include "push.h"
 #include <jio.h>
 #include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 
 #define DIRECTIVE_KEEPALIVE "KeepAlive"
 #define DEFAULT_KEEPALIVE   5
 
+/* IoBackend epoll|uring, epoll is used if not set or not supported */
+#define DIRECTIVE_IO_BACKEND    "IoBackend"
+#define IO_BACKEND_URING    "uring"
+
+/*
+ * EdgeTriggered on: connections are registered in edge-triggered mode
+ * (epoll backend only), the listening socket and eventfd are not
+ */
+#define DIRECTIVE_EDGE_TRIGGERED    "EdgeTriggered"
+
+/*
+ * Responses (the data of segments actually) of at least ZeroCopyThreshold
+ * bytes are sent with MSG_ZEROCOPY, 0 disables it
+ */
+#define DIRECTIVE_ZEROCOPY_THRESHOLD    "ZeroCopyThreshold"
+
+/*
+ * Coroutines on: the request hooks are called in coroutines,
+ * of CoroutineStackSize bytes stack
+ */
+#define DIRECTIVE_COROUTINES    "Coroutines"
+#define DIRECTIVE_COROUTINE_STACK_SIZE  "CoroutineStackSize"
+#define DEFAULT_COROUTINE_STACK_SIZE    (64 * 1024)
+
+/* the max connections accepted in one wakeup, don't starve the others */
+#define MAX_ACCEPT_BATCH    64
+
+/* StatsInterval in seconds, zero or not set means no statistics logged */
+#define DIRECTIVE_STATS_INTERVAL    "StatsInterval"
+
+/*
+ * The bytes of responses not writen to a connection,
+ * reading from it is paused at the high water mark,
+ * and resumed when it drops to the low water mark
+ */
+#define DIRECTIVE_OUTPUT_HIGH_WATER "OutputHighWater"
+#define DIRECTIVE_OUTPUT_LOW_WATER  "OutputLowWater"
+#define DEFAULT_OUTPUT_HIGH_WATER   (1024 * 1024)
+#define DEFAULT_OUTPUT_LOW_WATER    (256 * 1024)
+
+/* the capacity of the handoff ring, the server waits if it's full */
+#define HANDOFF_RING_SIZE   4096
+
+/* the capacity of the completion ring, ja_request_complete() waits if full */
+#define COMPLETION_RING_SIZE    4096
+
+/* the capacity of ring of pushes, ja_push() fails when it's full */
+#define PUSH_RING_SIZE  65536
+
+/*
+ * the requests of a connection waiting to be answered in order,
+ * reading stops when there are so many
+ */
+#define CONN_BACKLOG_LIMIT  64
+
+/* the window of connection load accounting, in nanoseconds */
+#define LOAD_WINDOW     1000000000ULL
+
+
+/*
+ * Statistics of a worker
+ * handoff_* are updated by the server thread, so atomically
+ */
+typedef struct {
+    guint64 loops;              /* iterations of the event loop */
+    guint64 events;
+    guint64 handoffs;           /* connections received from the server */
+    guint64 handoff_stalls;     /* times the server found the ring full */
+    guint64 handoff_stall_us;   /* time the server waited for the ring */
+    guint64 idle_us;            /* time waiting for events, in j_poll_wait() */
+} JaWorkerStats;
 
 struct _JaWorker {
     gint id;
+    gint cpu;                   /* the CPU pinned to, -1 if not */
     GThread *thread;
     JPoll *poller;
     gboolean running;
 
+    JSocket *listen_sock;       /* SO_REUSEPORT socket, NULL if connections come from server */
+
     gint keepalive;             /* negative means keepalive as long as possible, zero means no keepalive */
 
-    GMutex lock;
+    gsize high_water;
+    gsize low_water;
+
+    guint32 edge;               /* J_POLL_EVENT_ET or 0 */
+    gsize zerocopy;             /* MSG_ZEROCOPY threshold, 0 if disabled */
+
+    /*
+     * New connections from the server are pushed into inbox,
+     * and the worker is woken up through wakeup (an eventfd) if it's sleeping.
+     * Only the worker thread touches poller, so no lock is needed
+     */
+    JaRing *inbox;
+    JSocket *wakeup;
+    gint sleeping;
+    gint64 sleep_time;          /* when the worker started waiting */
+    guint32 pending;            /* connections in inbox */
+
+    /*
+     * Requests completed by ja_request_complete() are pushed into
+     * completions the same way. outstanding counts the pending requests,
+     * including those of closed connections
+     */
+    JaRing *completions;
+    guint32 outstanding;
+
+    /*
+     * Frames pushed by ja_push() are pushed into pushes the same way.
+     * conns finds the JSocket of a connection by its id, the connections
+     * pushed to are flushed together, they're kept in pushed
+     */
+    JaRing *pushes;
+    GHashTable *conns;
+    GPtrArray *pushed;
+
+    /*
+     * If coroutines are on, the coroutines sleeping are kept in sleepers
+     * by the time to wake up, the ones woken up are resumed from ready
+     * after the events are handled
+     */
+    gboolean coroutines;
+    gsize stack_size;
+    GQueue sleepers;
+    GQueue ready;
+
+    /*
+     * If there are batch hooks, the requests read in one iteration are
+     * collected in batch, and passed to the batch hooks together after
+     * the events are handled. acts is where the hooks put the actions
+     */
+    gboolean batching;
+    GPtrArray *batch;
+    GPtrArray *batch_spare;     /* swapped with batch while it's handled */
+    JaAction *acts;
+    guint acts_size;
+
+    /* the contexts of modules for this worker, by the index of module */
+    gpointer *contexts;
+    guint context_count;
+
+    /*
+     * The server sets retiring and wakes the worker up, the worker hands
+     * its connections off to heirs, and sets retired before quitting
+     */
+    gint retiring;
+    gint retired;
+    gboolean reaped;            /* the connections left are closed */
+    JaWorker **heirs;
+    guint heir_count;
+
+    /* the last sample of utilization, taken by the server */
+    gint64 sample_time;
+    guint64 sample_idle;
+
+    /*
+     * If balance is on, the time spent on every connection is measured,
+     * in windows of LOAD_WINDOW. The server sets shed_to to ask the worker
+     * to hand shed_fraction of its load off, it's reset when done
+     */
+    gboolean balance;
+    guint64 window_start;
+    guint64 window_length;      /* the length of last window */
+    JaWorker *shed_to;
+    gdouble shed_fraction;
+
+    gint stats_interval;
+    guint64 stats_time;         /* when the statistics are logged next */
+    gint64 stats_wall;          /* the monotonic time of last log */
+    guint64 stats_idle;         /* idle_us of last log */
+    JaWorkerStats stats;
 };
 
 gint ja_worker_get_id(JaWorker * jw)
 {
-    return jw->id;
+    return jw->id;
+}
+
+gint ja_worker_get_cpu(JaWorker * jw)
+{
+    return jw->cpu;
+}
+
+JSocket *ja_worker_get_listen_socket(JaWorker * jw)
+{
+    return jw->listen_sock;
+}
+
+
+static inline JaWorker *ja_worker_alloc(JaConfig * cfg, gint id,
+                                        gint cpu, JSocket * listen_sock);
+
+/*
+ * pthread routine
+ */
+static void *ja_worker_main(void *arg);
+
+
+/*
+ * Creates an JaWorker
+ * JaWorker is thread safe
+ */
+JaWorker *ja_worker_create(JaConfig * cfg, gint id, gint cpu,
+                           JSocket * listen_sock)
+{
+    JaWorker *jw = ja_worker_alloc(cfg, id, cpu, listen_sock);
+    if (jw == NULL) {
+        return NULL;
+    }
+    jw->thread =
+        g_thread_try_new("worker", (GThreadFunc) ja_worker_main,
+                         (void *) jw, NULL);
+    if (jw->thread == NULL) {   /* error */
+        ja_worker_free(jw);
+        return NULL;
+    }
+    return jw;
+}
+
+/*
+ * The state of a connection, kept in the flag of JSocket
+ */
+#define CONN_CLOSING    0x1     /* close after all responses writen */
+#define CONN_PAUSED     0x2     /* too many data to write, stop reading */
+#define CONN_WAITING    0x4     /* too many requests not answered, stop reading */
+#define CONN_COROUTINE  0x8     /* not a connection, the descriptor a coroutine waits for */
+#define CONN_PUSHED     0x10    /* frames are pushed, to be flushed */
+
+#define ja_worker_conn_is(jsock,s)  (j_socket_get_flag(jsock)&(s))
+#define ja_worker_conn_set(jsock,s)  j_socket_set_flag(jsock,j_socket_get_flag(jsock)|(s))
+#define ja_worker_conn_unset(jsock,s)  j_socket_set_flag(jsock,j_socket_get_flag(jsock)&~(s))
+
+/*
+ * Gets the events to watch by the state of connection
+ */
+static inline guint32 ja_worker_conn_events(JaWorker * jw, JSocket * jsock)
+{
+    guint32 events = jw->edge;
+    if (!ja_worker_conn_is(jsock, CONN_PAUSED | CONN_WAITING)) {
+        events |= J_POLL_EVENT_IN;
+    }
+    if (j_socket_write_pending(jsock)) {
+        events |= J_POLL_EVENT_OUT;
+    }
+    return events;
+}
+
+/*
+ * A request not answered yet, because it's pending or an earlier one is.
+ * The requests of a connection are kept in order in its backlog,
+ * in the JaConnection of JSocket
+ */
+typedef struct {
+    JaRequest *req;
+    JSocket *jsock;             /* NULL if the connection is closed */
+    JaHook **hook;              /* the hook left it pending, NULL if done */
+    JaAction act;
+    GList link;                 /* the link in backlog */
+} JaWorkerPending;
+
+/* the JaConnection of a client, the pointer of JSocket */
+#define ja_worker_connection(jsock) ((JaConnection*)j_socket_get_pointer(jsock))
+#define ja_worker_backlog(jsock)    (&ja_worker_connection(jsock)->backlog)
+
+static inline guint ja_worker_backlog_length(JSocket * jsock)
+{
+    JaConnection *conn = ja_worker_connection(jsock);
+    return conn ? g_queue_get_length(&conn->backlog) : 0;
+}
+
+static inline void ja_worker_pending_free(JaWorkerPending * p)
+{
+    ja_request_free(p->req);
+    j_pool_free(p);
+}
+
+static inline gpointer ja_worker_context(JaWorker * jw, JaHook * hook);
+
+/*
+ * Calls the connection hooks in order, until one drops the connection
+ */
+static inline JaAction ja_worker_call_connection_hooks(JaWorker * jw,
+                                                       JaConnection * conn,
+                                                       GList * hooks)
+{
+    JaAction act = JA_ACTION_IGNORE;
+    while (hooks) {
+        JaHook *hook = (JaHook *) hooks->data;
+        conn->context = jw ? ja_worker_context(jw, hook) : NULL;
+        act = hook->connection(conn);
+        if (act & JA_ACTION_DROP) {
+            break;
+        }
+        hooks = g_list_next(hooks);
+    }
+    conn->context = NULL;
+    return act;
+}
+
+/*
+ * Called when the connection is closed, calls the disconnect hooks and
+ * frees the backlog, the pending requests are freed when they're completed
+ */
+static void ja_worker_connection_close(gpointer data)
+{
+    JaConnection *conn = (JaConnection *) data;
+    JaWorker *jw = (JaWorker *) conn->worker;
+    ja_push_unregister(conn);
+    if (jw) {
+        g_hash_table_remove(jw->conns, &conn->id);
+    }
+    ja_worker_call_connection_hooks(jw, conn, ja_get_disconnect_hooks());
+    GList *link;
+    while ((link = g_queue_pop_head_link(&conn->backlog)) != NULL) {
+        JaWorkerPending *p = (JaWorkerPending *) link->data;
+        if (p->hook) {
+            p->jsock = NULL;
+        } else {
+            ja_worker_pending_free(p);
+        }
+    }
+    ja_connection_unref(conn);
+}
+
+/*
+ * Called for a connection timeout, before it's closed
+ */
+static void ja_worker_connection_timeout(gpointer data, gpointer user_data)
+{
+    JaConnection *conn = ja_worker_connection((JSocket *) data);
+    if (conn) {
+        ja_worker_call_connection_hooks((JaWorker *) user_data, conn,
+                                        ja_get_timeout_hooks());
+    }
+}
+
+/* the id of last connection accepted */
+static guint64 connection_id = 0;
+
+/*
+ * Registers a client, only called in the worker thread
+ * The client may be a new one, or migrated from a retired worker
+ * with its state
+ */
+static inline void ja_worker_register(JaWorker * jw, JSocket * jsock)
+{
+    JaConnection *conn = ja_worker_connection(jsock);
+    if (conn == NULL) {         /* a new one */
+        conn = ja_connection_new();
+        conn->id = __atomic_add_fetch(&connection_id, 1, __ATOMIC_RELAXED);
+        conn->addrlen = MIN(j_socket_sockaddr_length(jsock),
+                            sizeof(conn->addr));
+        memcpy(&conn->addr, j_socket_sockaddr(jsock), conn->addrlen);
+        const gchar *address = j_socket_address(jsock);
+        if (address) {
+            g_strlcpy(conn->address, address, sizeof(conn->address));
+        }
+        conn->worker = jw;
+        conn->worker_id = jw->id;
+        j_socket_set_pointer_full(jsock, conn, ja_worker_connection_close);
+        if (ja_worker_call_connection_hooks(jw, conn,
+                                            ja_get_connect_hooks()) &
+            JA_ACTION_DROP) {
+            j_socket_close(jsock);
+            return;
+        }
+        g_hash_table_insert(jw->conns, &conn->id, jsock);
+        ja_push_register(conn, jw);
+    } else {                    /* the registry is updated by ja_worker_add() */
+        g_hash_table_insert(jw->conns, &conn->id, jsock);
+    }
+    conn->worker = jw;
+    conn->worker_id = jw->id;
+    if (jw->zerocopy && !j_socket_set_zerocopy(jsock, jw->zerocopy)) {
+        g_warning("worker %d: MSG_ZEROCOPY is not supported", jw->id);
+        jw->zerocopy = 0;
+    }
+    j_poll_register_stream(jw->poller, jsock,
+                           ja_worker_conn_events(jw, jsock));
+    g_message("worker %d: new socket", jw->id);
+}
+
+/*
+ * Wakes the worker up, whether it's sleeping or not
+ */
+static inline void ja_worker_wake(JaWorker * jw)
+{
+    guint64 one = 1;
+    if (write(j_socket_fd(jw->wakeup), &one, sizeof(one)) < 0) {
+        /* EAGAIN, the counter is already nonzero */
+    }
+}
+
+/*
+ * Adds a client to the worker
+ * The client is handed off through the inbox and registered by the worker,
+ * if the inbox is full, waits until the worker drains it
+ */
+void ja_worker_add(JaWorker * jw, JSocket * jsock)
+{
+    JaConnection *conn = ja_worker_connection(jsock);
+    if (conn) {
+        /* belongs to no worker until it's registered, pushes wait in jw */
+        conn->worker = NULL;
+        ja_push_register(conn, jw);
+    }
+    __atomic_add_fetch(&jw->pending, 1, __ATOMIC_RELAXED);
+    if (G_UNLIKELY(!ja_ring_push(jw->inbox, jsock))) {
+        gint64 start = g_get_monotonic_time();
+        do {
+            g_thread_yield();
+        } while (!ja_ring_push(jw->inbox, jsock));
+        __atomic_add_fetch(&jw->stats.handoff_stalls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&jw->stats.handoff_stall_us,
+                           g_get_monotonic_time() - start,
+                           __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&jw->stats.handoffs, 1, __ATOMIC_RELAXED);
+
+    /* pairs with the fence in ja_worker_sleep() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&jw->sleeping, __ATOMIC_RELAXED)) {
+        ja_worker_wake(jw);
+    }
+}
+
+/*
+ * Registers all clients in the inbox
+ */
+static inline void ja_worker_drain(JaWorker * jw)
+{
+    JSocket *jsock;
+    while ((jsock = (JSocket *) ja_ring_pop(jw->inbox)) != NULL) {
+        ja_worker_register(jw, jsock);
+        __atomic_sub_fetch(&jw->pending, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Resets the eventfd after it woke the worker up
+ */
+static inline void ja_worker_clear_wakeup(JaWorker * jw)
+{
+    guint64 count;
+    if (read(j_socket_fd(jw->wakeup), &count, sizeof(count)) < 0) {
+        /* EAGAIN, nothing to clear */
+    }
+}
+
+/*
+ * Tells the server that the worker is going to block in j_poll_wait()
+ * Returns the timeout to wait, 0 if there are clients in the inbox,
+ * completed requests or pushes already
+ */
+static inline gint ja_worker_sleep(JaWorker * jw, gint timeout)
+{
+    __atomic_store_n(&jw->sleep_time, g_get_monotonic_time(),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&jw->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!ja_ring_is_empty(jw->inbox) || !ja_ring_is_empty(jw->completions)
+        || !ja_ring_is_empty(jw->pushes)) {
+        return 0;
+    }
+    return timeout;
+}
+
+static inline void ja_worker_awake(JaWorker * jw)
+{
+    __atomic_add_fetch(&jw->stats.idle_us,
+                       g_get_monotonic_time() - jw->sleep_time,
+                       __ATOMIC_RELAXED);
+    __atomic_store_n(&jw->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Gets the time the worker has spent waiting, including the current wait
+ */
+static inline guint64 ja_worker_idle_time(JaWorker * jw, gint64 now)
+{
+    guint64 idle = __atomic_load_n(&jw->stats.idle_us, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&jw->sleeping, __ATOMIC_RELAXED)) {
+        gint64 since = __atomic_load_n(&jw->sleep_time, __ATOMIC_RELAXED);
+        if (now > since) {
+            idle += now - since;
+        }
+    }
+    return idle;
+}
+
+/*
+ * Gets the fraction of busy time in an interval
+ */
+static inline gdouble ja_worker_busy_ratio(guint64 idle, gint64 wall)
+{
+    if (wall <= 0) {
+        return 0;
+    }
+    gdouble busy = 1 - (gdouble) idle / wall;
+    return CLAMP(busy, 0, 1);
+}
+
+/*
+ * Accepts pending connections on worker's own listening socket
+ */
+static inline void ja_worker_accept(JaWorker * jw)
+{
+    gint i;
+    for (i = 0; i < MAX_ACCEPT_BATCH; i++) {
+        JSocket *conn = j_poll_accept(jw->poller, jw->listen_sock);
+        if (conn == NULL) {
+            break;
+        }
+        ja_worker_register(jw, conn);
+    }
+}
+
+/* the monotonic clock in nanoseconds, cheap enough to read for every event */
+static inline guint64 ja_worker_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Ends the load window of all connections if it's time
+ */
+static inline void ja_worker_roll_load(JaWorker * jw)
+{
+    guint64 now = ja_worker_clock();
+    if (now < jw->window_start + LOAD_WINDOW) {
+        return;
+    }
+    jw->window_length = now - jw->window_start;
+    jw->window_start = now;
+    GList *ptr = j_poll_all(jw->poller);
+    while (ptr) {
+        j_socket_load_roll((JSocket *) ptr->data);
+        ptr = g_list_next(ptr);
+    }
+}
+
+static gint ja_worker_compare_load(gconstpointer a, gconstpointer b)
+{
+    guint64 la = j_socket_load_time(*(JSocket **) a);
+    guint64 lb = j_socket_load_time(*(JSocket **) b);
+    return la < lb ? 1 : (la > lb ? -1 : 0);
+}
+
+/*
+ * Stops watching a connection being handed off
+ */
+static inline void ja_worker_release(JaWorker * jw, JSocket * jsock)
+{
+    JaConnection *conn = ja_worker_connection(jsock);
+    j_poll_delete(jw->poller, jsock);
+    if (conn) {
+        g_hash_table_remove(jw->conns, &conn->id);
+    }
+}
+
+/*
+ * Hands connections off if the server asks,
+ * the heaviest first, until the load asked is handed off.
+ * A connection heavier than the rest of load asked is kept,
+ * moving it would only make the other worker the busiest.
+ * It's called between loop iterations, so no request is handled halfway,
+ * the data received but not handled and the responses not writen
+ * go with the connection
+ */
+static inline void ja_worker_hand_off(JaWorker * jw)
+{
+    JaWorker *to = __atomic_load_n(&jw->shed_to, __ATOMIC_ACQUIRE);
+    if (to == NULL) {
+        return;
+    }
+    guint64 budget = jw->shed_fraction * jw->window_length;
+    guint64 moved = 0;
+    guint32 count = 0;
+
+    GPtrArray *conns = g_ptr_array_new();
+    GList *ptr = j_poll_all(jw->poller);
+    while (ptr) {
+        JSocket *jsock = (JSocket *) ptr->data;
+        ptr = g_list_next(ptr);
+        if (!j_socket_is_persistent(jsock)
+            && !ja_worker_conn_is(jsock, CONN_CLOSING)
+            && ja_worker_backlog_length(jsock) == 0
+            && j_socket_load_time(jsock) > 0
+            && j_socket_load_time(jsock) <= budget) {
+            g_ptr_array_add(conns, jsock);
+        }
+    }
+    g_ptr_array_sort(conns, ja_worker_compare_load);
+    guint i;
+    for (i = 0; i < conns->len; i++) {
+        JSocket *jsock = (JSocket *) g_ptr_array_index(conns, i);
+        guint64 load = j_socket_load_time(jsock);
+        if (moved + load > budget) {
+            continue;
+        }
+        ja_worker_release(jw, jsock);
+        ja_worker_add(to, jsock);
+        moved += load;
+        count++;
+    }
+    g_ptr_array_free(conns, TRUE);
+
+    if (count > 0) {
+        g_message("worker %d: %u connections (%.0f%% busy) handed off to "
+                  "worker %d", jw->id, count,
+                  jw->window_length ? moved * 100.0 / jw->window_length : 0,
+                  to->id);
+    }
+    __atomic_store_n(&jw->shed_to, NULL, __ATOMIC_RELEASE);
+}
+
+/*
+ * Stops listening before retiring, the socket leaves the SO_REUSEPORT group.
+ * The connections accepted by the ring and those pending in the socket
+ * are registered, to be handed off with the others. Those coming just
+ * before it's closed are reset, unless net.ipv4.tcp_migrate_req is on
+ */
+static inline void ja_worker_unlisten(JaWorker * jw)
+{
+    if (jw->listen_sock == NULL) {
+        return;
+    }
+    JSocket *conn;
+    while ((conn = j_poll_accept(jw->poller, jw->listen_sock)) != NULL) {
+        ja_worker_register(jw, conn);
+    }
+    j_poll_delete(jw->poller, jw->listen_sock);
+    while ((conn = j_socket_accept_nonblock(jw->listen_sock)) != NULL) {
+        ja_worker_register(jw, conn);
+    }
+    j_socket_close(jw->listen_sock);
+    jw->listen_sock = NULL;
+}
+
+/*
+ * Hands all connections off to the heirs, each goes to the one with
+ * the least payload. Called in the worker thread when it retires
+ * Returns the count of connections handed off
+ */
+static inline guint32 ja_worker_migrate(JaWorker * jw)
+{
+    guint32 count = 0;
+    JSocket *jsock;
+    GList *ptr = j_poll_all(jw->poller);
+    while (ptr || (jsock = (JSocket *) ja_ring_pop(jw->inbox)) != NULL) {
+        if (ptr) {
+            jsock = (JSocket *) ptr->data;
+            ptr = g_list_next(ptr);
+            if (j_socket_is_persistent(jsock)) {
+                continue;       /* the eventfd */
+            }
+            ja_worker_release(jw, jsock);
+        } else {
+            __atomic_sub_fetch(&jw->pending, 1, __ATOMIC_RELAXED);
+        }
+        JaWorker *heir = jw->heirs[0];
+        guint i;
+        for (i = 1; i < jw->heir_count; i++) {
+            if (ja_worker_payload(jw->heirs[i]) < ja_worker_payload(heir)) {
+                heir = jw->heirs[i];
+            }
+        }
+        ja_worker_add(heir, jsock);
+        count++;
+    }
+    return count;
+}
+
+static inline void ja_worker_modify(JaWorker * jw, JSocket * jsock,
+                                    guint32 events)
+{
+    j_poll_modify(jw->poller, jsock, events);
+}
+
+/*
+ * Deletes a JSocket
+ * and closes it
+ */
+static inline void ja_worker_remove(JaWorker * jw, JSocket * jsock)
+{
+    j_poll_delete_close(jw->poller, jsock);
+    g_message("worker %d: close socket", jw->id);
+}
+
+/*
+ * Checks if the action says the connection should not be kept
+ */
+static inline gboolean ja_worker_should_close(JaWorker * jw, JaAction act)
+{
+    return (!(act & JA_ACTION_KEEP) && jw->keepalive == 0)
+        || (act & JA_ACTION_DROP);
+}
+
+/*
+ * Queues a segment of response to the JSocket, without copying
+ */
+static void ja_worker_queue_segment(const JaResponseSegment * seg,
+                                    gpointer user_data)
+{
+    if (ja_response_segment_is_file(seg)) {
+        j_socket_queue_file((JSocket *) user_data, seg->fd, seg->offset,
+                            seg->len, seg->destroy, seg->destroy_data);
+        return;
+    }
+    j_socket_queue((JSocket *) user_data, seg->data, seg->len,
+                   seg->destroy, seg->destroy_data);
+}
+
+/*
+ * Creates the contexts of modules, in the worker thread
+ */
+static inline void ja_worker_init_contexts(JaWorker * jw)
+{
+    GList *ptr = ja_get_modules();
+    guint i;
+    jw->context_count = g_list_length(ptr);
+    jw->contexts = g_new0(gpointer, jw->context_count);
+    for (i = 0; ptr; i++, ptr = g_list_next(ptr)) {
+        JaModule *mod = (JaModule *) ptr->data;
+        if (mod->worker_init_func) {
+            jw->contexts[i] = mod->worker_init_func(jw->id);
+        }
+    }
+}
+
+static inline void ja_worker_free_contexts(JaWorker * jw)
+{
+    GList *ptr = ja_get_modules();
+    guint i;
+    for (i = 0; ptr && i < jw->context_count; i++, ptr = g_list_next(ptr)) {
+        JaModule *mod = (JaModule *) ptr->data;
+        if (mod->worker_free_func && jw->contexts[i]) {
+            mod->worker_free_func(jw->contexts[i]);
+        }
+    }
+    g_free(jw->contexts);
+    jw->contexts = NULL;
+    jw->context_count = 0;
+}
+
+/*
+ * Gets the context of the module of hook
+ */
+static inline gpointer ja_worker_context(JaWorker * jw, JaHook * hook)
+{
+    if (hook->module < 0 || (guint) hook->module >= jw->context_count) {
+        return NULL;
+    }
+    return jw->contexts[hook->module];
+}
+
+/*
+ * The hook a request waits at, until it's passed to the batch hooks
+ */
+static JaHook *ja_worker_batch_mark = NULL;
+
+/*
+ * Gets the hooks after hook, NULL if it's the last,
+ * the request hooks of request follow the last batch hook
+ */
+static inline JaHook **ja_worker_next_hook(JaRequest * req, JaHook ** hook)
+{
+    JaHook **next;
+    if (hook == &ja_worker_batch_mark) {
+        next = ja_get_batch_route();
+    } else if ((*hook)->batch) {
+        next = hook + 1;
+    } else {
+        return hook[1] ? hook + 1 : NULL;
+    }
+    return next && *next ? next : ja_get_request_route(req->request,
+                                                       req->request_len);
+}
+
+/*
+ * Calls the request hooks from *hooks on, until one drops the connection
+ * or leaves the request pending. A blocking hook always leaves it pending,
+ * it's called in the thread pool of its module
+ * A batch hook is called with the request alone, when the request goes on
+ * after the batch hook left it pending
+ * *hooks is set to the pending hook, or NULL if the request is done
+ */
+static inline JaAction ja_worker_call_hooks(JaWorker * jw, JaRequest * req,
+                                            JaHook *** hooks)
+{
+    JaAction act = JA_ACTION_IGNORE;
+    JaHook **ptr = *hooks;
+
+    while (ptr && *ptr) {
+        JaHook *hook = *ptr;
+        req->context = hook->pool ? NULL : ja_worker_context(jw, hook);
+        if (hook->pool) {
+            ja_request_detach(req);
+            ja_hook_pool_push(hook, req);
+            act = JA_ACTION_PENDING;
+        } else if (hook->batch) {
+            act = JA_ACTION_IGNORE;
+            hook->batch(&req, &act, 1);
+        } else {
+            act = hook->func(req);
+        }
+        if (act & JA_ACTION_PENDING) {
+            *hooks = ptr;
+            return act;
+        }
+        if (act & JA_ACTION_DROP || act & JA_ACTION_IGNORE) {
+            break;
+        }
+        ptr = ja_worker_next_hook(req, ptr);
+    }
+    *hooks = NULL;
+    return act;
+}
+
+/*
+ * A coroutine calling the request hooks
+ */
+typedef struct {
+    JaCoroutine *co;
+    JaWorker *jw;
+    JaRequest *req;
+    JaHook **hook;              /* the result of ja_worker_call_hooks() */
+    JaAction act;
+    JSocket *waiter;            /* the descriptor waited for, or NULL */
+    gint64 deadline;            /* when to wake up, 0 if not sleeping */
+    GList link;                 /* the link in sleepers or ready */
+} JaWorkerCo;
+
+static void ja_worker_co_main(gpointer data)
+{
+    JaWorkerCo *wc = (JaWorkerCo *) data;
+    wc->act = ja_worker_call_hooks(wc->jw, wc->req, &wc->hook);
+}
+
+/*
+ * Puts a coroutine in sleepers, ordered by the time to wake up
+ */
+static inline void ja_worker_co_sleep(JaWorker * jw, JaWorkerCo * wc)
+{
+    GList *ptr = g_queue_peek_tail_link(&jw->sleepers);
+    while (ptr && ((JaWorkerCo *) ptr->data)->deadline > wc->deadline) {
+        ptr = ptr->prev;
+    }
+    if (ptr == NULL) {
+        g_queue_push_head_link(&jw->sleepers, &wc->link);
+    } else {
+        wc->link.prev = ptr;
+        wc->link.next = ptr->next;
+        if (ptr->next) {
+            ptr->next->prev = &wc->link;
+        } else {
+            jw->sleepers.tail = &wc->link;
+        }
+        ptr->next = &wc->link;
+        jw->sleepers.length++;
+    }
+}
+
+/*
+ * Wakes a coroutine up, it's resumed after the events are handled
+ */
+static inline void ja_worker_co_wake(JaWorker * jw, JaWorkerCo * wc,
+                                     gboolean ready)
+{
+    if (wc->waiter) {
+        j_poll_delete_close(jw->poller, wc->waiter);
+        wc->waiter = NULL;
+    }
+    if (wc->deadline) {
+        g_queue_unlink(&jw->sleepers, &wc->link);
+        wc->deadline = 0;
+    }
+    ja_coroutine_set_ready(wc->co, ready);
+    g_queue_push_tail_link(&jw->ready, &wc->link);
+}
+
+/*
+ * Runs a coroutine until it yields or returns
+ * If it yields, watches what it waits for
+ * Returns TRUE if it returned, the coroutine is freed then
+ */
+static inline gboolean ja_worker_co_resume(JaWorker * jw, JaWorkerCo * wc)
+{
+    if (ja_coroutine_resume(wc->co)) {
+        ja_coroutine_free(wc->co);
+        return TRUE;
+    }
+    gint fd, timeout;
+    guint32 events;
+    ja_coroutine_get_wait(wc->co, &fd, &events, &timeout);
+    if (fd >= 0) {
+        guint32 types = jw->edge;
+        if (events & JA_WAIT_READ) {
+            types |= J_POLL_EVENT_IN;
+        }
+        if (events & JA_WAIT_WRITE) {
+            types |= J_POLL_EVENT_OUT;
+        }
+        /*
+         * a duplicate is watched, so that several coroutines can wait for
+         * the same descriptor, and it can be closed while waited for
+         */
+        gint dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (dupfd < 0) {
+            ja_worker_co_wake(jw, wc, FALSE);
+            return FALSE;
+        }
+        wc->waiter = j_socket_new_fromfd(dupfd, NULL, 0);
+        j_socket_set_persistent(wc->waiter, TRUE);
+        j_socket_set_flag(wc->waiter, CONN_COROUTINE);
+        j_socket_set_pointer_full(wc->waiter, wc, NULL);
+        if (!j_poll_register(jw->poller, wc->waiter, types)) {
+            ja_worker_co_wake(jw, wc, FALSE);
+            return FALSE;
+        }
+    }
+    if (timeout >= 0) {
+        wc->deadline = g_get_monotonic_time() + (gint64) timeout * 1000;
+        ja_worker_co_sleep(jw, wc);
+    } else if (fd < 0) {        /* waits for nothing */
+        ja_worker_co_wake(jw, wc, FALSE);
+    }
+    return FALSE;
+}
+
+/*
+ * Calls the request hooks, in a coroutine if coroutines are on
+ * If the coroutine yields, returns JA_ACTION_PENDING, with *hooks unchanged,
+ * the request is settled after the coroutine returns
+ */
+static inline JaAction ja_worker_run_hooks(JaWorker * jw, JaRequest * req,
+                                           JaHook *** hooks)
+{
+    if (!jw->coroutines || *hooks == NULL) {
+        return ja_worker_call_hooks(jw, req, hooks);
+    }
+    /* the read buffer may be gone before the coroutine returns */
+    ja_request_detach(req);
+    JaWorkerCo *wc = (JaWorkerCo *) j_pool_alloc(sizeof(JaWorkerCo));
+    wc->jw = jw;
+    wc->req = req;
+    wc->hook = *hooks;
+    wc->act = JA_ACTION_IGNORE;
+    wc->waiter = NULL;
+    wc->deadline = 0;
+    wc->link.data = wc;
+    wc->link.prev = wc->link.next = NULL;
+    wc->co = ja_coroutine_new(ja_worker_co_main, wc, jw->stack_size);
+    if (!ja_worker_co_resume(jw, wc)) {
+        return JA_ACTION_PENDING;
+    }
+    JaAction act = wc->act;
+    *hooks = wc->hook;
+    j_pool_free(wc);
+    return act;
+}
+
+/*
+ * Queues the response of a request done, and frees the request
+ * The responses after the one closing the connection are dropped
+ */
+static inline void ja_worker_respond(JaWorker * jw, JSocket * jsock,
+                                     JaRequest * req, JaAction act)
+{
+    if (!ja_worker_conn_is(jsock, CONN_CLOSING)) {
+        if (act & JA_ACTION_RESPONSE && ja_response_data_length(req) > 0) {
+            j_socket_queue_header(jsock, ja_response_data_length(req));
+            ja_response_take(req, ja_worker_queue_segment, jsock);
+        }
+        if (ja_worker_should_close(jw, act)) {
+            ja_worker_conn_set(jsock, CONN_CLOSING);
+        }
+    }
+    ja_request_free(req);
 }
 
-#define ja_worker_lock(jw)  g_mutex_lock (&(jw)->lock)
-#define ja_worker_unlock(jw) g_mutex_unlock (&(jw)->lock)
+/*
+ * Called by ja_request_complete(), in any thread
+ * The request is pushed into the completion ring of its worker
+ */
+static void ja_worker_complete(JaRequest * req)
+{
+    JaWorker *jw = (JaWorker *) req->complete_data;
+    while (G_UNLIKELY(!ja_ring_push(jw->completions, req))) {
+        g_thread_yield();
+    }
+    /* pairs with the fence in ja_worker_sleep() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&jw->sleeping, __ATOMIC_RELAXED)) {
+        ja_worker_wake(jw);
+    }
+}
 
+/*
+ * Called by ja_push(), in any thread
+ * The push is pushed into the ring of worker, like a completion
+ */
+static gboolean ja_worker_deliver_push(gpointer owner, JaPush * push)
+{
+    JaWorker *jw = (JaWorker *) owner;
+    if (!ja_ring_push(jw->pushes, push)) {
+        return FALSE;
+    }
+    /* pairs with the fence in ja_worker_sleep() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&jw->sleeping, __ATOMIC_RELAXED)) {
+        ja_worker_wake(jw);
+    }
+    return TRUE;
+}
 
-static inline JaWorker *ja_worker_alloc(JaConfig * cfg, gint id);
+/*
+ * Puts a request at the end of the backlog of connection,
+ * it's answered after all requests before it
+ */
+static inline void ja_worker_defer(JaWorker * jw, JSocket * jsock,
+                                   JaRequest * req, JaHook ** hook,
+                                   JaAction act)
+{
+    GQueue *backlog = ja_worker_backlog(jsock);
+    if (hook == NULL) {
+        /* done, but answered after the read buffer moves on */
+        ja_request_detach(req);
+    }
+    JaWorkerPending *p =
+        (JaWorkerPending *) j_pool_alloc(sizeof(JaWorkerPending));
+    p->req = req;
+    p->jsock = jsock;
+    p->hook = hook;
+    p->act = act;
+    p->link.data = p;
+    p->link.prev = p->link.next = NULL;
+    g_queue_push_tail_link(backlog, &p->link);
+    req->pending = p;
+    if (hook) {
+        jw->outstanding++;
+    }
+    if (g_queue_get_length(backlog) >= CONN_BACKLOG_LIMIT) {
+        ja_worker_conn_set(jsock, CONN_WAITING);
+    }
+}
 
 /*
- * pthread routine
+ * Handles a request, the response is queued but not writen
+ * If the connection should be closed, no more requests are handled.
+ * If a hook leaves the request pending, or an earlier request is pending,
+ * it's answered later in order
  */
-static void *ja_worker_main(void *arg);
+static inline void ja_worker_handle_request(JaWorker * jw, JSocket * jsock)
+{
+    const void *data = j_socket_data(jsock);
+    guint length = j_socket_data_length(jsock);
+    JaRequest *req = ja_request_borrow(data, length, NULL, 0);
+    req->complete = ja_worker_complete;
+    req->complete_data = jw;
+    req->connection = ja_connection_ref(ja_worker_connection(jsock));
+
+    if (jw->batching) {
+        ja_request_detach(req);
+        ja_worker_defer(jw, jsock, req, &ja_worker_batch_mark,
+                        JA_ACTION_IGNORE);
+        g_ptr_array_add(jw->batch, req);
+        return;
+    }
+
+    JaHook **hook = ja_get_request_route(data, length);
+    JaAction act = ja_worker_run_hooks(jw, req, &hook);
 
+    if (hook == NULL && ja_worker_backlog_length(jsock) == 0) {
+        ja_worker_respond(jw, jsock, req, act);
+    } else {
+        ja_worker_defer(jw, jsock, req, hook, act);
+    }
+}
 
 /*
- * Creates an JaWorker
- * JaWorker is thread safe
+ * Pauses reading from the connection or resumes it,
+ * ja_push() fails while it's paused
  */
-JaWorker *ja_worker_create(JaConfig * cfg, gint id)
+static inline void ja_worker_pause(JSocket * jsock, gboolean paused)
 {
-    JaWorker *jw = ja_worker_alloc(cfg, id);
-    if (jw == NULL) {
-        return NULL;
+    JaConnection *conn = ja_worker_connection(jsock);
+    if (paused) {
+        ja_worker_conn_set(jsock, CONN_PAUSED);
+    } else {
+        ja_worker_conn_unset(jsock, CONN_PAUSED);
     }
-    jw->thread =
-        g_thread_try_new("worker", (GThreadFunc) ja_worker_main,
-                         (void *) jw, NULL);
-    if (jw->thread == NULL) {   /* error */
-        ja_worker_free(jw);
-        return NULL;
+    if (conn) {
+        __atomic_store_n(&conn->overloaded, paused, __ATOMIC_RELAXED);
     }
-    return jw;
 }
 
 /*
- * Adds a client to the worker
+ * Writes the queued responses,
+ * and updates the events watched by the state of write queue:
+ * reading is paused when it reaches the high water mark,
+ * and resumed when it drops to the low water mark;
+ * J_POLL_EVENT_OUT is watched only if there is data not writen
+ * A closing connection is closed after all data is writen and acknowledged
+ * Returns FALSE if the connection is closed
  */
-void ja_worker_add(JaWorker * jw, JSocket * jsock)
+static inline gboolean ja_worker_flush(JaWorker * jw, JSocket * jsock)
 {
-    ja_worker_lock(jw);
-    JPoll *poller = jw->poller;
-    j_poll_register(poller, jsock, J_POLL_EVENT_IN);
-    ja_worker_unlock(jw);
-    g_message("worker %d: new socket", jw->id);
+    if (j_poll_flush(jw->poller, jsock) < 0) {
+        ja_worker_remove(jw, jsock);
+        return FALSE;
+    }
+    if (!j_socket_write_pending(jsock)
+        && j_socket_zerocopy_pending(jsock) == 0
+        && ja_worker_conn_is(jsock, CONN_CLOSING)) {
+        ja_worker_remove(jw, jsock);
+        return FALSE;
+    }
+
+    gsize length = j_socket_write_pending_length(jsock);
+    if (length >= jw->high_water) {
+        ja_worker_pause(jsock, TRUE);
+    } else if (length <= jw->low_water) {
+        ja_worker_pause(jsock, FALSE);
+    }
+
+    /* JPoll knows the events registered, does nothing if not changed */
+    ja_worker_modify(jw, jsock, ja_worker_conn_events(jw, jsock));
+    return TRUE;
 }
 
-static inline void ja_worker_modify(JaWorker * jw, JSocket * jsock,
-                                    guint32 events)
+/*
+ * Handles all whole packages received in order, then writes the responses
+ * together. When the responses reach the high water mark, writes them
+ * before going on. Stops if reading is paused, too many requests are not
+ * answered or the connection is closing, the rest are handled after that
+ * Returns FALSE if the connection is closed
+ */
+static inline gboolean ja_worker_handle_packages(JaWorker * jw,
+                                                 JSocket * jsock)
 {
-    ja_worker_lock(jw);
-    j_poll_modify(jw->poller, jsock, events);
-    ja_worker_unlock(jw);
+    gint ret;
+    do {
+        ret = 0;
+        while (!ja_worker_conn_is(jsock,
+                                  CONN_CLOSING | CONN_PAUSED | CONN_WAITING)
+               && j_socket_write_pending_length(jsock) < jw->high_water
+               && (ret = j_socket_next_package(jsock)) > 0) {
+            ja_worker_handle_request(jw, jsock);
+        }
+        if (ret < 0) {          /* invalid package */
+            ja_worker_remove(jw, jsock);
+            return FALSE;
+        }
+        if (!ja_worker_flush(jw, jsock)) {
+            return FALSE;
+        }
+        /* stopped by the high water mark, but the responses are writen */
+    } while (ret > 0
+             && !ja_worker_conn_is(jsock,
+                                   CONN_CLOSING | CONN_PAUSED | CONN_WAITING));
+    return TRUE;
 }
 
 /*
- * Deletes a JSocket
- * and closes it
+ * Continues writing the responses
+ * If reading is resumed, handles the packages received already
+ * Returns FALSE if the connection is closed
  */
-static inline void ja_worker_remove(JaWorker * jw, JSocket * jsock)
+static inline gboolean ja_worker_send(JaWorker * jw, JSocket * jsock)
 {
-    ja_worker_lock(jw);
-    j_poll_delete_close(jw->poller, jsock);
-    ja_worker_unlock(jw);
-    g_message("worker %d: close socket", jw->id);
+    gboolean paused = ja_worker_conn_is(jsock, CONN_PAUSED);
+    if (!ja_worker_flush(jw, jsock)) {
+        return FALSE;
+    }
+    if (paused && !ja_worker_conn_is(jsock, CONN_PAUSED)) {
+        return ja_worker_handle_packages(jw, jsock);
+    }
+    return TRUE;
 }
 
 
-static inline gint ja_worker_send(JaWorker * jw, JSocket * jsock,
-                                  const void *data, guint32 count)
+/*
+ * Answers the requests done at the head of backlog,
+ * then handles the packages left if reading stopped for the backlog
+ * Returns FALSE if the connection is closed
+ */
+static inline gboolean ja_worker_answer(JaWorker * jw, JSocket * jsock)
 {
-    gint n = j_socket_write(jsock, data, count);
-    if (n < 0) {
-        ja_worker_remove(jw, jsock);
-    } else if (n == 1) {
-        ja_worker_modify(jw, jsock, J_POLL_EVENT_IN);
-    } else {
-        JaAction act = j_socket_get_flag(jsock);
-        if ((!(act & JA_ACTION_KEEP) && jw->keepalive == 0) || (act & JA_ACTION_DROP)) {    /* should not keep the connection */
-            ja_worker_remove(jw, jsock);
+    GQueue *backlog = ja_worker_backlog(jsock);
+    GList *link;
+    while ((link = g_queue_peek_head_link(backlog)) != NULL) {
+        JaWorkerPending *p = (JaWorkerPending *) link->data;
+        if (p->hook) {
+            break;
         }
+        g_queue_unlink(backlog, link);
+        ja_worker_respond(jw, jsock, p->req, p->act);
+        j_pool_free(p);
     }
-
-    return n;
+    if (g_queue_get_length(backlog) < CONN_BACKLOG_LIMIT) {
+        ja_worker_conn_unset(jsock, CONN_WAITING);
+    }
+    return ja_worker_handle_packages(jw, jsock);
 }
 
-static inline void ja_worker_handle_request(JaWorker * jw, JSocket * jsock)
+/*
+ * Settles a pending request with the result of its hooks,
+ * it's still pending if hook is not NULL
+ */
+static inline void ja_worker_settle(JaWorker * jw, JaWorkerPending * p,
+                                    JaAction act, JaHook ** hook)
 {
-    const void *data = j_socket_data(jsock);
-    guint length = j_socket_data_length(jsock);
-    JaRequest *req = ja_request_new(data, length, NULL, 0);
+    if (hook) {
+        p->hook = hook;
+        return;
+    }
+    jw->outstanding--;
+    if (p->jsock == NULL) {     /* the connection is closed */
+        ja_worker_pending_free(p);
+        return;
+    }
+    p->act = act;
+    p->hook = NULL;
+    ja_worker_answer(jw, p->jsock);
+}
 
+/*
+ * Goes on with the requests completed by other threads,
+ * the hooks after the pending one are called
+ */
+static inline void ja_worker_drain_completions(JaWorker * jw)
+{
+    JaRequest *req;
+    while ((req = (JaRequest *) ja_ring_pop(jw->completions)) != NULL) {
+        JaWorkerPending *p = (JaWorkerPending *) req->pending;
+        JaHook **hook = NULL;
+        JaAction act = req->action;
+        if (p->jsock && !(act & JA_ACTION_DROP)
+            && (hook = ja_worker_next_hook(req, p->hook)) != NULL) {
+            act = ja_worker_run_hooks(jw, req, &hook);
+        }
+        ja_worker_settle(jw, p, act, hook);
+    }
+}
 
-    JaAction act = JA_ACTION_IGNORE;
+/*
+ * Gets room for count actions of batch hooks
+ */
+static inline JaAction *ja_worker_acts(JaWorker * jw, guint count)
+{
+    if (jw->acts_size < count) {
+        jw->acts_size = MAX(count, jw->acts_size * 2);
+        jw->acts = g_renew(JaAction, jw->acts, jw->acts_size);
+    }
+    return jw->acts;
+}
 
-    GList *hooks = ja_get_request_hooks();
+/*
+ * Passes the requests read in this iteration to the batch hooks in turn,
+ * then calls the request hooks of every one not dropped or pending.
+ * The requests read meanwhile, when the connections are answered,
+ * are handled in the next round
+ */
+static inline void ja_worker_run_batch(JaWorker * jw)
+{
+    while (jw->batch->len > 0) {
+        GPtrArray *batch = jw->batch;
+        jw->batch = jw->batch_spare;
+        jw->batch_spare = batch;
 
-    while (hooks) {
-        JaRequestHandler func = (JaRequestHandler) hooks->data;
-        act = func(req);
-        if (act & JA_ACTION_DROP || act & JA_ACTION_IGNORE) {
-            break;
+        JaRequest **reqs = (JaRequest **) batch->pdata;
+        JaAction *acts = ja_worker_acts(jw, batch->len);
+        guint i, left, count = batch->len;
+        JaHook **hook = ja_get_batch_route();
+        while (hook && *hook && count > 0) {
+            for (i = 0, left = 0; i < count; i++) {
+                JaWorkerPending *p = (JaWorkerPending *) reqs[i]->pending;
+                if (p->jsock == NULL) { /* the connection is closed */
+                    ja_worker_settle(jw, p, JA_ACTION_DROP, NULL);
+                } else {
+                    reqs[left++] = reqs[i];
+                }
+            }
+            count = left;
+            gpointer context = ja_worker_context(jw, *hook);
+            for (i = 0; i < count; i++) {
+                acts[i] = JA_ACTION_IGNORE;
+                reqs[i]->context = context;
+            }
+            (*hook)->batch(reqs, acts, count);
+            for (i = 0, left = 0; i < count; i++) {
+                JaWorkerPending *p = (JaWorkerPending *) reqs[i]->pending;
+                if (acts[i] & JA_ACTION_PENDING) {
+                    ja_worker_settle(jw, p, acts[i], hook);
+                } else if (acts[i] & JA_ACTION_DROP) {
+                    ja_worker_settle(jw, p, acts[i], NULL);
+                } else {
+                    p->act = acts[i];
+                    reqs[left++] = reqs[i];
+                }
+            }
+            count = left;
+            hook++;
         }
-        hooks = g_list_next(hooks);
+        for (i = 0; i < count; i++) {
+            JaRequest *req = reqs[i];
+            JaWorkerPending *p = (JaWorkerPending *) req->pending;
+            JaAction act = JA_ACTION_DROP;
+            JaHook **route = NULL;
+            if (p->jsock) {
+                route = ja_get_request_route(req->request, req->request_len);
+                act = route ? ja_worker_run_hooks(jw, req, &route) : p->act;
+            }
+            ja_worker_settle(jw, p, act, route);
+        }
+        g_ptr_array_set_size(batch, 0);
     }
+}
 
-    /* action */
-    if (act & JA_ACTION_RESPONSE) {
-        data = ja_response_data(req);
-        length = ja_response_data_length(req);
-        if (ja_worker_send(jw, jsock, data, length) == 0) { /* response */
-            ja_worker_modify(jw, jsock, J_POLL_EVENT_OUT);
-            j_socket_set_flag(jsock, act);  /* JaAction after writing completely */
-            ja_request_free(req);
-            return;
+/*
+ * Queues the frames pushed to the connections of worker, then writes
+ * them, once for every connection.
+ * A connection not found may be on its way to the inbox, or handed off
+ * already; the push is forwarded to the owner after draining, which may
+ * be jw again, to retry in the next loop. If it's closed, it's dropped.
+ * A connection reaching the high water mark is paused, and the pushes to
+ * it are dropped until it's resumed
+ */
+static inline void ja_worker_drain_pushes(JaWorker * jw)
+{
+    GQueue missed = G_QUEUE_INIT;
+    JaPush *push;
+    guint32 count = 0;
+    /* at most a ring of them, so the writes go on while pushed */
+    while (count++ < PUSH_RING_SIZE
+           && (push = (JaPush *) ja_ring_pop(jw->pushes)) != NULL) {
+        JSocket *jsock = g_hash_table_lookup(jw->conns, &push->conn_id);
+        if (jsock == NULL) {
+            ja_worker_drain(jw);
+            jsock = g_hash_table_lookup(jw->conns, &push->conn_id);
+        }
+        if (jsock == NULL) {
+            g_queue_push_tail(&missed, push);
+            continue;
+        }
+        if (ja_worker_conn_is(jsock, CONN_CLOSING)) {
+            j_pool_free(push);
+            continue;
+        }
+        if (ja_worker_conn_is(jsock, CONN_PAUSED)) {
+            /* taken before ja_push() saw it overloaded */
+            j_pool_free(push);
+        } else {
+            j_socket_queue_header(jsock, push->len);
+            j_socket_queue(jsock, push->data, push->len, j_pool_free, push);
+            if (j_socket_write_pending_length(jsock) >= jw->high_water) {
+                ja_worker_pause(jsock, TRUE);
+            }
+        }
+        if (!ja_worker_conn_is(jsock, CONN_PUSHED)) {
+            ja_worker_conn_set(jsock, CONN_PUSHED);
+            g_ptr_array_add(jw->pushed, jsock);
         }
     }
-
-    if ((!(act & JA_ACTION_KEEP) && jw->keepalive == 0) || (act & JA_ACTION_DROP)) {    /* should not keep the connection */
-        ja_worker_remove(jw, jsock);
+    guint i;
+    for (i = 0; i < jw->pushed->len; i++) {
+        JSocket *jsock = (JSocket *) g_ptr_array_index(jw->pushed, i);
+        ja_worker_conn_unset(jsock, CONN_PUSHED);
+        ja_worker_flush(jw, jsock);
     }
+    g_ptr_array_set_size(jw->pushed, 0);
+    while ((push = (JaPush *) g_queue_pop_head(&missed)) != NULL) {
+        ja_push_forward(push, NULL);
+    }
+}
 
-    ja_request_free(req);
+/*
+ * Wakes the coroutines whose time is up, and resumes the ones woken up
+ */
+static inline void ja_worker_run_coroutines(JaWorker * jw)
+{
+    GList *link;
+    if (!g_queue_is_empty(&jw->sleepers)) {
+        gint64 now = g_get_monotonic_time();
+        while ((link = g_queue_peek_head_link(&jw->sleepers)) != NULL
+               && ((JaWorkerCo *) link->data)->deadline <= now) {
+            ja_worker_co_wake(jw, (JaWorkerCo *) link->data, FALSE);
+        }
+    }
+    while ((link = g_queue_pop_head_link(&jw->ready)) != NULL) {
+        JaWorkerCo *wc = (JaWorkerCo *) link->data;
+        if (ja_worker_co_resume(jw, wc)) {
+            ja_worker_settle(jw, (JaWorkerPending *) wc->req->pending,
+                             wc->act, wc->hook);
+            j_pool_free(wc);
+        }
+    }
 }
 
 
+static inline guint64 ja_worker_keepalive(JaWorker * jw)
+{
+    return jw->keepalive == 0 ? DEFAULT_KEEPALIVE : jw->keepalive;
+}
+
 /*
  * Removes all connections that is timeout
  */
@@ -175,16 +1455,184 @@ static inline void ja_worker_timeout(JaWorker * jw)
     if (jw->keepalive < 0) {
         return;
     }
-    guint64 timeout =
-        jw->keepalive == 0 ? DEFAULT_KEEPALIVE : jw->keepalive;
-    ja_worker_lock(jw);
-    guint32 count = j_poll_remove_timeout(jw->poller, timeout);
+    guint32 count = j_poll_remove_timeout(jw->poller,
+                                          ja_worker_keepalive(jw),
+                                          ja_get_timeout_hooks() ?
+                                          ja_worker_connection_timeout :
+                                          NULL, jw);
     if (count > 0) {
         g_message("%d Jsocket(s) timeout and removed", count);
     }
-    ja_worker_unlock(jw);
 }
 
+/*
+ * Logs the statistics every StatsInterval seconds
+ */
+static inline void ja_worker_log_stats(JaWorker * jw)
+{
+    if (jw->stats_interval <= 0) {
+        return;
+    }
+    guint64 now = j_socket_get_clock();
+    if (now < jw->stats_time) {
+        return;
+    }
+    jw->stats_time = now + jw->stats_interval;
+    JaWorkerStats *stats = &jw->stats;
+    gint64 wall = g_get_monotonic_time();
+    guint64 idle = ja_worker_idle_time(jw, wall);
+    gdouble busy = ja_worker_busy_ratio(idle - jw->stats_idle,
+                                        wall - jw->stats_wall);
+    jw->stats_wall = wall;
+    jw->stats_idle = idle;
+    g_message("worker %d: %u connections, %.0f%% busy, %" G_GUINT64_FORMAT
+              " loops, %" G_GUINT64_FORMAT " events, %" G_GUINT64_FORMAT
+              " handoffs, %" G_GUINT64_FORMAT " handoff stalls (%"
+              G_GUINT64_FORMAT "us), %" G_GUINT64_FORMAT " slabs mapped",
+              jw->id, j_poll_count(jw->poller), busy * 100, stats->loops,
+              stats->events, __atomic_load_n(&stats->handoffs,
+                                             __ATOMIC_RELAXED),
+              __atomic_load_n(&stats->handoff_stalls, __ATOMIC_RELAXED),
+              __atomic_load_n(&stats->handoff_stall_us, __ATOMIC_RELAXED),
+              j_pool_get_map_count());
+    if (!jw->balance || jw->window_length == 0) {
+        return;
+    }
+    JSocket *hottest = NULL;
+    GList *ptr = j_poll_all(jw->poller);
+    while (ptr) {
+        JSocket *jsock = (JSocket *) ptr->data;
+        if (hottest == NULL
+            || j_socket_load_time(jsock) > j_socket_load_time(hottest)) {
+            hottest = jsock;
+        }
+        ptr = g_list_next(ptr);
+    }
+    if (hottest && j_socket_load_time(hottest) > 0) {
+        g_message("worker %d: the busiest connection %s takes %.1f%%, "
+                  "%.0f events/s", jw->id, j_socket_address(hottest),
+                  j_socket_load_time(hottest) * 100.0 / jw->window_length,
+                  j_socket_load_events(hottest) * 1e9 / jw->window_length);
+    }
+}
+
+/*
+ * Gets the timeout of next wait, it's when the first connection may timeout.
+ * A connection added during the wait can't timeout within keepalive seconds,
+ * so that's the upper bound
+ * If statistics are enabled, wakes up in time to log them,
+ * and in time for the first coroutine sleeping
+ * Doesn't wait if requests are read after the batch hooks are called
+ */
+static inline gint ja_worker_wait_timeout(JaWorker * jw)
+{
+    if (jw->batch->len > 0) {
+        return 0;
+    }
+    gint timeout = -1;
+    if (jw->keepalive >= 0) {
+        guint64 keepalive = ja_worker_keepalive(jw);
+        timeout = j_poll_next_timeout(jw->poller, keepalive);
+        if (timeout < 0 || timeout > keepalive * 1000) {
+            timeout = keepalive * 1000;
+        }
+    }
+    if (jw->stats_interval > 0) {
+        guint64 now = j_socket_get_clock();
+        gint next = now >= jw->stats_time ? 0 :
+            (jw->stats_time - now) * 1000;
+        if (timeout < 0 || next < timeout) {
+            timeout = next;
+        }
+    }
+    if (!g_queue_is_empty(&jw->sleepers)) {
+        JaWorkerCo *wc = (JaWorkerCo *) g_queue_peek_head(&jw->sleepers);
+        gint64 left = wc->deadline - g_get_monotonic_time();
+        gint next = left <= 0 ? 0 : (left + 999) / 1000;
+        if (timeout < 0 || next < timeout) {
+            timeout = next;
+        }
+    }
+    return timeout;
+}
+
+
+/*
+ * Handles the events of a connection
+ * Writing goes first, so that reading may be resumed
+ * In edge-triggered mode, reads until EAGAIN unless reading is paused,
+ * (the write queue is always flushed until EAGAIN)
+ * J_POLL_EVENT_ERR may be the acknowledgements of MSG_ZEROCOPY,
+ * it's a real error if there is none
+ * Returns FALSE if the connection is closed
+ */
+static inline gboolean ja_worker_handle_event(JaWorker * jw,
+                                              JSocket * jsock, guint32 type)
+{
+    if (type & J_POLL_EVENT_ERR) {
+        if (j_socket_zerocopy_complete(jsock) <= 0) {
+            ja_worker_remove(jw, jsock);
+            return FALSE;
+        }
+        if (ja_worker_conn_is(jsock, CONN_CLOSING)
+            && !ja_worker_flush(jw, jsock)) {
+            return FALSE;
+        }
+    }
+    if (type & J_POLL_EVENT_OUT) {  /* ready for writing */
+        if (!ja_worker_send(jw, jsock)) {
+            return FALSE;
+        }
+    }
+    if (type & J_POLL_EVENT_IN) {   /* ready for reading */
+        gint n;
+        do {
+            n = j_poll_recv(jw->poller, jsock);
+            if (n < 0) {        /* read error, EOF? whatever */
+                ja_worker_remove(jw, jsock);
+                return FALSE;
+            } else if (n > 0 && !ja_worker_handle_packages(jw, jsock)) {
+                return FALSE;
+            }
+        } while (n > 0 && jw->edge
+                 && !ja_worker_conn_is(jsock,
+                                       CONN_CLOSING | CONN_PAUSED |
+                                       CONN_WAITING));
+    } else if (type & J_POLL_EVENT_HUP) {
+        /* error */
+        ja_worker_remove(jw, jsock);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Handles the events of a connection,
+ * and measures the time spent if balance is on
+ */
+static inline void ja_worker_handle_conn(JaWorker * jw, JSocket * jsock,
+                                         guint32 type)
+{
+    if (!jw->balance) {
+        ja_worker_handle_event(jw, jsock, type);
+        return;
+    }
+    guint64 start = ja_worker_clock();
+    if (ja_worker_handle_event(jw, jsock, type)) {
+        j_socket_load_add(jsock, ja_worker_clock() - start);
+    }
+}
+
+
+/*
+ * A retiring worker waits until its pending requests are completed,
+ * their completions come to it, and its connections closed stop lingering
+ */
+static inline gboolean ja_worker_can_retire(JaWorker * jw)
+{
+    return __atomic_load_n(&jw->retiring, __ATOMIC_ACQUIRE)
+        && jw->outstanding == 0 && j_poll_lingering(jw->poller) == 0;
+}
 
 /*
  * thread routine!!!
@@ -194,33 +1642,70 @@ static void *ja_worker_main(void *arg)
     JaWorker *jw = (JaWorker *) arg;
     JPoll *poller = jw->poller;
     gint i, n;
-    g_message("new worker:%d", jw->id);
+    /*
+     * pinned before anything is allocated, so the slabs and buffers
+     * the worker touches first come from the memory of its node
+     */
+    if (jw->cpu >= 0 && ja_cpu_pin_thread(jw->cpu)) {
+        g_message("new worker:%d on CPU %d", jw->id, jw->cpu);
+    } else {
+        g_message("new worker:%d", jw->id);
+    }
+    ja_worker_init_contexts(jw);
     JPollEvent events[128];
-    while ((n =
-            j_poll_wait(poller, events,
-                        sizeof(events) / sizeof(JPollEvent), 1000)) >= 0) {
+    while (!ja_worker_can_retire(jw) &&
+           (n = j_poll_wait(poller, events,
+                            sizeof(events) / sizeof(JPollEvent),
+                            ja_worker_sleep(jw,
+                                            ja_worker_wait_timeout(jw)))) >=
+           0) {
+        ja_worker_awake(jw);
+        jw->stats.loops++;
+        jw->stats.events += n;
         if (n > 0) {
             for (i = 0; i < n; i++) {
                 JSocket *jsock = events[i].jsock;
                 guint32 type = events[i].type;
-                if (type & J_POLL_EVENT_IN) {   /* ready for reading */
-                    gint n = j_socket_read(jsock);
-                    if (n < 0) {    /* read error, EOF? whatever */
-                        ja_worker_remove(jw, jsock);
-                    } else if (n > 0) {
-                        ja_worker_handle_request(jw, jsock);
-                    }
-                } else if (type & J_POLL_EVENT_OUT) {   /* ready for writing */
-                    ja_worker_send(jw, jsock, NULL, 0);
-                } else if (type & (J_POLL_EVENT_HUP | J_POLL_EVENT_ERR)) {
-                    /* error */
-                    ja_worker_remove(jw, jsock);
+                if (jsock == jw->wakeup) {
+                    ja_worker_clear_wakeup(jw);
+                } else if (jsock == jw->listen_sock) {
+                    ja_worker_accept(jw);
+                } else if (ja_worker_conn_is(jsock, CONN_COROUTINE)) {
+                    ja_worker_co_wake(jw, (JaWorkerCo *)
+                                      j_socket_get_pointer(jsock), TRUE);
+                } else {
+                    ja_worker_handle_conn(jw, jsock, type);
                 }
             }
         }
+        ja_worker_run_batch(jw);
+        ja_worker_drain(jw);
+        ja_worker_drain_pushes(jw);
+        ja_worker_drain_completions(jw);
+        ja_worker_run_coroutines(jw);
         ja_worker_timeout(jw);
+        if (jw->balance) {
+            ja_worker_roll_load(jw);
+            ja_worker_hand_off(jw);
+        }
+        ja_worker_log_stats(jw);
     }
 
+    if (ja_worker_can_retire(jw)) {
+        ja_worker_unlisten(jw);
+        guint32 count = ja_worker_migrate(jw);
+        /* the pushes left go to the heirs, no more comes after migrating */
+        JaPush *push;
+        while ((push = (JaPush *) ja_ring_pop(jw->pushes)) != NULL) {
+            ja_push_forward(push, jw);
+        }
+        g_message("worker %d retires: %u connections handed off",
+                  jw->id, count);
+        ja_worker_free_contexts(jw);
+        __atomic_store_n(&jw->retired, 1, __ATOMIC_RELEASE);
+        return (void *) 0;
+    }
+    ja_worker_free_contexts(jw);
     jw->running = FALSE;
     g_warning("worker quits");
     return (void *) 0;
@@ -235,32 +1720,235 @@ gboolean ja_worker_is_running(JaWorker * jw)
     return jw->running;
 }
 
+/*
+ * Gets the count of connections, including those not registered yet
+ * Called by the server, so the result is approximate
+ */
 guint32 ja_worker_payload(JaWorker * jw)
 {
-    return j_poll_count(jw->poller);
+    return j_poll_count(jw->poller) +
+        __atomic_load_n(&jw->pending, __ATOMIC_RELAXED);
+}
+
+gdouble ja_worker_sample_utilization(JaWorker * jw)
+{
+    gint64 now = g_get_monotonic_time();
+    guint64 idle = ja_worker_idle_time(jw, now);
+    gdouble busy = ja_worker_busy_ratio(idle - jw->sample_idle,
+                                        now - jw->sample_time);
+    jw->sample_time = now;
+    jw->sample_idle = idle;
+    return busy;
+}
+
+void ja_worker_retire(JaWorker * jw, JaWorker ** heirs, guint count)
+{
+    jw->heirs = (JaWorker **) g_memdup(heirs, sizeof(JaWorker *) * count);
+    jw->heir_count = count;
+    __atomic_store_n(&jw->retiring, 1, __ATOMIC_RELEASE);
+    ja_worker_wake(jw);
+}
+
+gboolean ja_worker_is_retired(JaWorker * jw)
+{
+    return __atomic_load_n(&jw->retired, __ATOMIC_ACQUIRE);
+}
+
+gboolean ja_worker_shed(JaWorker * jw, JaWorker * to, gdouble fraction)
+{
+    if (ja_worker_is_shedding(jw)) {
+        return FALSE;
+    }
+    jw->shed_fraction = fraction;
+    __atomic_store_n(&jw->shed_to, to, __ATOMIC_RELEASE);
+    ja_worker_wake(jw);
+    return TRUE;
+}
+
+gboolean ja_worker_is_shedding(JaWorker * jw)
+{
+    return __atomic_load_n(&jw->shed_to, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static inline JPollBackend ja_worker_backend(JaConfig * cfg)
+{
+    const gchar *backend = j_parser_get_directive_text(cfg,
+                                                       DIRECTIVE_IO_BACKEND);
+    if (g_strcmp0(backend, IO_BACKEND_URING) == 0) {
+        return J_POLL_BACKEND_URING;
+    }
+    return J_POLL_BACKEND_EPOLL;
 }
 
-static inline JaWorker *ja_worker_alloc(JaConfig * cfg, gint id)
+static inline JaWorker *ja_worker_alloc(JaConfig * cfg, gint id,
+                                        gint cpu, JSocket * listen_sock)
 {
-    JPoll *poller = j_poll_new();
+    JPoll *poller = j_poll_new_with_backend(ja_worker_backend(cfg));
     if (poller == NULL) {
         return NULL;
     }
-    JaWorker *jw = (JaWorker *) g_slice_alloc(sizeof(JaWorker));
+    gint efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        g_warning("fail to create eventfd: %s", g_strerror(errno));
+        j_poll_close(poller);
+        return NULL;
+    }
+    JaWorker *jw = (JaWorker *) g_slice_alloc0(sizeof(JaWorker));
     jw->id = id;
+    jw->cpu = cpu;
     jw->poller = poller;
     jw->running = TRUE;
+    jw->listen_sock = listen_sock;
+    if (listen_sock) {
+        j_socket_set_persistent(listen_sock, TRUE);
+        j_poll_register_passive(poller, listen_sock);
+    }
     jw->keepalive = j_parser_get_directive_integer(cfg,
                                                    DIRECTIVE_KEEPALIVE);
-    g_mutex_init(&jw->lock);
+
+    gint high = j_parser_get_directive_integer(cfg,
+                                               DIRECTIVE_OUTPUT_HIGH_WATER);
+    gint low = j_parser_get_directive_integer(cfg,
+                                              DIRECTIVE_OUTPUT_LOW_WATER);
+    jw->high_water = high > 0 ? high : DEFAULT_OUTPUT_HIGH_WATER;
+    jw->low_water = low > 0 ? low : DEFAULT_OUTPUT_LOW_WATER;
+    if (jw->low_water > jw->high_water) {
+        jw->low_water = jw->high_water / 4;
+    }
+
+    if (g_strcmp0(j_parser_get_directive_text(cfg,
+                                              DIRECTIVE_EDGE_TRIGGERED),
+                  "on") == 0) {
+        jw->edge = J_POLL_EVENT_ET;
+    }
+    gint zerocopy = j_parser_get_directive_integer(cfg,
+                                                   DIRECTIVE_ZEROCOPY_THRESHOLD);
+    jw->zerocopy = zerocopy > 0 ? zerocopy : 0;
+    jw->balance =
+        g_strcmp0(j_parser_get_directive_text(cfg, DIRECTIVE_BALANCE),
+                  "on") == 0;
+    jw->window_start = ja_worker_clock();
+    jw->coroutines =
+        g_strcmp0(j_parser_get_directive_text(cfg, DIRECTIVE_COROUTINES),
+                  "on") == 0;
+    gint stack_size = j_parser_get_directive_integer(cfg,
+                                                     DIRECTIVE_COROUTINE_STACK_SIZE);
+    jw->stack_size =
+        stack_size > 0 ? stack_size : DEFAULT_COROUTINE_STACK_SIZE;
+    g_queue_init(&jw->sleepers);
+    g_queue_init(&jw->ready);
+    jw->batching = ja_get_batch_hooks() != NULL;
+    jw->batch = g_ptr_array_new();
+    jw->batch_spare = g_ptr_array_new();
+
+    jw->inbox = ja_ring_new(HANDOFF_RING_SIZE);
+    jw->completions = ja_ring_new(COMPLETION_RING_SIZE);
+    jw->pushes = ja_ring_new(PUSH_RING_SIZE);
+    jw->conns = g_hash_table_new(g_int64_hash, g_int64_equal);
+    jw->pushed = g_ptr_array_new();
+    ja_push_set_deliver(ja_worker_deliver_push);
+    jw->wakeup = j_socket_new_fromfd(efd, NULL, 0);
+    j_socket_set_persistent(jw->wakeup, TRUE);
+    j_poll_register(poller, jw->wakeup, J_POLL_EVENT_IN);
+
+    jw->stats_interval = j_parser_get_directive_integer(cfg,
+                                                        DIRECTIVE_STATS_INTERVAL);
+    jw->stats_time = j_socket_get_clock() + jw->stats_interval;
+    jw->stats_wall = jw->sample_time = g_get_monotonic_time();
     return jw;
 }
 
+/*
+ * Gets the coroutines a worker quitting unexpectedly left suspended,
+ * they're never resumed. Those waiting for a descriptor without timeout
+ * are found only by their waiters
+ */
+static inline GPtrArray *ja_worker_co_left(JaWorker * jw)
+{
+    GPtrArray *left = g_ptr_array_new();
+    GList *ptr;
+    for (ptr = j_poll_all(jw->poller); ptr; ptr = g_list_next(ptr)) {
+        JSocket *jsock = (JSocket *) ptr->data;
+        if (ja_worker_conn_is(jsock, CONN_COROUTINE)) {
+            JaWorkerCo *wc = (JaWorkerCo *) j_socket_get_pointer(jsock);
+            if (wc->deadline == 0) {
+                g_ptr_array_add(left, wc);
+            }
+        }
+    }
+    for (ptr = g_queue_peek_head_link(&jw->sleepers); ptr;
+         ptr = g_list_next(ptr)) {
+        g_ptr_array_add(left, ptr->data);
+    }
+    for (ptr = g_queue_peek_head_link(&jw->ready); ptr;
+         ptr = g_list_next(ptr)) {
+        g_ptr_array_add(left, ptr->data);
+    }
+    return left;
+}
+
+/*
+ * The worker must have retired or quit.
+ * The first time, the coroutines left are cancelled and the connections
+ * closed, so the requests are not answered. The requests in blocking hooks
+ * are dropped as their completions come to the worker
+ */
+gboolean ja_worker_reap(JaWorker * jw)
+{
+    JaRequest *req;
+    guint i;
+    if (!jw->reaped) {
+        jw->reaped = TRUE;
+        JSocket *jsock;
+        while ((jsock = (JSocket *) ja_ring_pop(jw->inbox)) != NULL) {
+            j_socket_close(jsock);
+        }
+        GPtrArray *left = ja_worker_co_left(jw);
+        j_poll_close_all(jw->poller);
+        for (i = 0; i < left->len; i++) {
+            JaWorkerCo *wc = (JaWorkerCo *) g_ptr_array_index(left, i);
+            ja_coroutine_free(wc->co);
+            ja_worker_pending_free((JaWorkerPending *) wc->req->pending);
+            j_pool_free(wc);
+            jw->outstanding--;
+        }
+        g_ptr_array_free(left, TRUE);
+        for (i = 0; i < jw->batch->len; i++) {
+            req = (JaRequest *) g_ptr_array_index(jw->batch, i);
+            ja_worker_pending_free((JaWorkerPending *) req->pending);
+            jw->outstanding--;
+        }
+        g_ptr_array_set_size(jw->batch, 0);
+    }
+    while (jw->outstanding > 0
+           && (req = (JaRequest *) ja_ring_pop(jw->completions)) != NULL) {
+        ja_worker_pending_free((JaWorkerPending *) req->pending);
+        jw->outstanding--;
+    }
+    return jw->outstanding == 0;
+}
+
 void ja_worker_free(JaWorker * jw)
 {
-    j_poll_close_all(jw->poller);
-    if (jw->thread) {
+    /* freeing it earlier, the completions would come to freed memory */
+    g_return_if_fail(ja_worker_reap(jw));
+    ja_ring_free(jw->inbox);
+    ja_ring_free(jw->completions);
+    JaPush *push;
+    while ((push = (JaPush *) ja_ring_pop(jw->pushes)) != NULL) {
+        j_pool_free(push);
+    }
+    ja_ring_free(jw->pushes);
+    g_hash_table_destroy(jw->conns);
+    g_ptr_array_free(jw->pushed, TRUE);
+    g_ptr_array_free(jw->batch, TRUE);
+    g_ptr_array_free(jw->batch_spare, TRUE);
+    g_free(jw->acts);
+    if (jw->thread && ja_worker_is_retired(jw)) {
+        g_thread_join(jw->thread);
+    } else if (jw->thread) {
         g_thread_unref(jw->thread);
     }
+    g_free(jw->heirs);
     g_slice_free1(sizeof(JaWorker), jw);
 }
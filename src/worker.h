@@ -37,14 +37,42 @@ typedef struct _JaWorker JaWorker;
 
 gint ja_worker_get_id(JaWorker * jw);
 
+/*
+ * Gets the CPU the worker is pinned to, -1 if it's not
+ */
+gint ja_worker_get_cpu(JaWorker * jw);
+
 /*
  * Creates an JaWorker, and run it
  * JaWorker is thread safe
+ * @param cpu, the CPU the worker thread is pinned to, -1 if not pinned
+ * @param listen_sock, if not NULL, the worker accepts connections itself
+ *                     from this non-blocking (SO_REUSEPORT) socket,
+ *                     and owns it
  */
-JaWorker *ja_worker_create(JaConfig * cfg, gint id);
+JaWorker *ja_worker_create(JaConfig * cfg, gint id, gint cpu,
+                           JSocket * listen_sock);
 
+/*
+ * Drops what the worker left after it has retired or quit: its connections
+ * are closed, and the completions of requests in blocking hooks are taken.
+ * It never blocks, returns FALSE if some requests are still in the hooks,
+ * call it again later
+ */
+gboolean ja_worker_reap(JaWorker * jw);
+
+/*
+ * Frees the worker after ja_worker_reap() returns TRUE,
+ * a retired worker has no requests in blocking hooks, so it's reaped at once
+ */
 void ja_worker_free(JaWorker * jw);
 
+/*
+ * Gets the worker's own listening socket, NULL if it has not
+ * It's closed by the worker when retiring, don't use it after retiring
+ */
+JSocket *ja_worker_get_listen_socket(JaWorker * jw);
+
 /*
  * Adds a client to the worker
  */
@@ -59,5 +87,41 @@ gboolean ja_worker_is_running(JaWorker * jw);
 
 guint32 ja_worker_payload(JaWorker * jw);
 
+/*
+ * Gets the fraction of time the worker spent handling events
+ * (not waiting for them) since the last call, from 0 to 1
+ * Called by the server only
+ */
+gdouble ja_worker_sample_utilization(JaWorker * jw);
+
+/*
+ * Retires the worker, its connections are handed off to the heirs,
+ * then the thread quits. If it has its own listening socket, the
+ * connections pending are handed off too, and the socket is closed.
+ * The heirs must keep running until that
+ * Called by the server only, the worker must not get new clients after it
+ */
+void ja_worker_retire(JaWorker * jw, JaWorker ** heirs, guint count);
+
+/*
+ * Checks if the worker has retired, it can be freed then
+ */
+gboolean ja_worker_is_retired(JaWorker * jw);
+
+/*
+ * Asks the worker to hand connections off to another one,
+ * about fraction of its load in the last window, at next loop iteration
+ * The heaviest connections go first, but one heavier than that is kept.
+ * to must keep running until it's done
+ * Returns FALSE if the last request is not done yet
+ * Called by the server only
+ */
+gboolean ja_worker_shed(JaWorker * jw, JaWorker * to, gdouble fraction);
+
+/*
+ * Checks if the worker is handing connections off
+ */
+gboolean ja_worker_is_shedding(JaWorker * jw);
+
 
 #endif